@@ -0,0 +1,303 @@
+#!/bin/bash
+# Dbin benchmark: starts a CR, an SU and several NUs, each in its own network namespace on one
+# bridge, then times fdel, fback and NU-to-NU (fnu) transfers over a grid of file sizes and
+# concurrency levels. Results go to stdout as CSV, one row per (operation, size, concurrency);
+# progress goes to stderr. Needs root (for the namespaces) and the three programs built.
+#
+# Settings, all optional:
+#   BENCH_NUS          NUs to start (default 4); the highest concurrency used is capped at this
+#   BENCH_SIZES        file sizes (default "1K 1M 64M 1G 10G"); sizes the disk cannot hold are skipped
+#   BENCH_CONCURRENCY  how many NUs run the operation at once (default "1 2 4")
+#   BENCH_OPS          operations to time (default "fdel fback fnu"); fback always follows an fdel
+#   BENCH_ROUNDS       rounds per cell (default 5), fewer for large files (see BENCH_ROUND_BYTES)
+#   BENCH_ROUND_BYTES  most bytes a cell moves across its rounds before it stops at one (default 2G)
+#   BENCH_SUBNET       first three octets of the namespaces' addresses (default 10.88.0)
+#   BENCH_DIR          working directory (default a new directory under /tmp)
+#   BENCH_OUT          also write the CSV to this file
+#   BENCH_KEEP         set to 1 to keep the working directory and node logs
+# DBIN_* settings in the environment (e.g. DBIN_STREAMS, DBIN_COMPRESS) reach every node.
+
+set -u
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+NUS=${BENCH_NUS:-4}
+SIZES=${BENCH_SIZES:-"1K 1M 64M 1G 10G"}
+CONCURRENCY=${BENCH_CONCURRENCY:-"1 2 4"}
+OPS=${BENCH_OPS:-"fdel fback fnu"}
+ROUNDS=${BENCH_ROUNDS:-5}
+ROUND_BYTES=$(numfmt --from=iec "${BENCH_ROUND_BYTES:-2G}")
+SUBNET=${BENCH_SUBNET:-10.88.0}
+WORK=${BENCH_DIR:-$(mktemp -d /tmp/dbin_bench.XXXXXX)}
+CLK_TCK=$(getconf CLK_TCK)
+BRIDGE=dbinbench0
+CR_IP=$SUBNET.1
+SU_IP=$SUBNET.2
+
+declare -A PID IN_FD
+NODES="cr su"
+for ((i = 1; i <= NUS; ++i)); do NODES="$NODES nu$i"; done
+
+log() { echo "bench: $*" >&2; }
+now_ns() { date +%s%N; }
+node_ip() { case $1 in cr) echo "$CR_IP" ;; su) echo "$SU_IP" ;; nu*) echo "$SUBNET.$((${1#nu} + 2))" ;; esac; }
+count_lines() { grep -cE "$2" "$WORK/$1/node.log" 2>/dev/null; }
+send_cmd() { echo "$2" >&"${IN_FD[$1]}"; }
+
+# Network
+setup_network()
+{
+  ip link add "$BRIDGE" type bridge && ip link set "$BRIDGE" up || return 1
+  for node in $NODES; do
+    ip netns add "dbin_bench_$node" || return 1
+    ip link add "dbb_$node" type veth peer name eth0 netns "dbin_bench_$node" || return 1
+    ip link set "dbb_$node" master "$BRIDGE" up
+    ip netns exec "dbin_bench_$node" ip addr add "$(node_ip "$node")/24" dev eth0
+    ip netns exec "dbin_bench_$node" ip link set eth0 up
+    ip netns exec "dbin_bench_$node" ip link set lo up
+    # Nodes learn their own address from the route to a public one, so give them a default route
+    ip netns exec "dbin_bench_$node" ip route add default dev eth0
+  done
+}
+
+cleanup()
+{
+  for node in $NODES; do
+    [ -n "${PID[$node]:-}" ] && kill "${PID[$node]}" 2>/dev/null
+  done
+  sleep 0.3
+  for node in $NODES; do ip netns del "dbin_bench_$node" 2>/dev/null; done
+  ip link del "$BRIDGE" 2>/dev/null
+  if [ "${BENCH_KEEP:-0}" = 1 ]; then log "working directory kept in $WORK"; else rm -rf "$WORK"; fi
+}
+
+# Nodes
+# Each node reads its commands from a FIFO the harness holds open, and its output goes to node.log.
+start_node()
+{
+  local node=$1 program=$2
+  mkdir -p "$WORK/$node"
+  cp "$program" "$WORK/$node/"
+  mkfifo "$WORK/$node/in"
+  (cd "$WORK/$node" && exec ip netns exec "dbin_bench_$node" stdbuf -oL "./$(basename "$program")" < in > node.log 2>&1) &
+  PID[$node]=$!
+  local fd
+  exec {fd}> "$WORK/$node/in"
+  IN_FD[$node]=$fd
+}
+
+start_nodes()
+{
+  start_node cr "$ROOT/Central_Repository/cr"
+  for ((i = 1; i <= NUS; ++i)); do start_node "nu$i" "$ROOT/Normal_User/nu"; done
+  sleep 0.5
+  start_node su "$ROOT/Super_User/su"
+  send_cmd su "$NUS"
+  for ((i = 1; i <= NUS; ++i)); do send_cmd su "$(node_ip "nu$i")"; done
+  send_cmd su "$CR_IP"
+  send_cmd su "$SU_IP"
+  # Ready once every NU holds the table and the SU and every NU have a session with the CR
+  local deadline=$(( $(date +%s) + 30 ))
+  while [ "$(date +%s)" -lt "$deadline" ]; do
+    local ready=1
+    for ((i = 1; i <= NUS; ++i)); do [ "$(count_lines "nu$i" 'IP table received')" -ge 1 ] || ready=0; done
+    [ "$(count_lines cr 'Session opened with')" -ge $((NUS + 1)) ] || ready=0
+    [ $ready = 1 ] && return 0
+    sleep 0.2
+  done
+  return 1
+}
+
+# Sum of user and system CPU seconds every node has used so far.
+cpu_seconds()
+{
+  local ticks=0
+  for node in $NODES; do
+    local stat
+    stat=$(cat "/proc/${PID[$node]}/stat" 2>/dev/null) || continue
+    set -- ${stat##*) }
+    ticks=$((ticks + ${12} + ${13}))
+  done
+  awk -v t="$ticks" -v hz="$CLK_TCK" 'BEGIN { printf "%.3f", t / hz }'
+}
+
+# Workload
+command_for()
+{
+  local op=$1 i=$2 name=$3
+  case $op in
+    fdel) echo "fdel $CR_IP $name" ;;
+    fback) echo "fback $CR_IP $name" ;;
+    fnu) echo "fnu $(node_ip "nu$((i % NUS + 1))") $name" ;;
+  esac
+}
+
+done_marker()
+{
+  case $1 in
+    fdel|fnu) echo '^(> )?File transfer complete\.' ;;
+    fback) echo 'File download complete\.' ;;
+  esac
+}
+
+fail_marker()
+{
+  case $1 in
+    fdel|fnu) echo 'File transfer incomplete|upload aborted|not started|already held' ;;
+    fback) echo 'CR Reply|interrupted;|does not match' ;;
+  esac
+}
+
+# Runs one operation on NUs 1..c at once and waits for each to finish or give up. Appends each
+# NU's "<latency_ms> <ok>" to $3 and the phase's wall time and CPU use to the cell's totals.
+run_phase()
+{
+  local op=$1 c=$2 samples=$3 name=$4 timeout_s=$5
+  local -a done_before fail_before started finished
+  for ((i = 1; i <= c; ++i)); do
+    done_before[i]=$(count_lines "nu$i" "$(done_marker "$op")")
+    fail_before[i]=$(count_lines "nu$i" "$(fail_marker "$op")")
+  done
+  local cpu_start phase_start
+  cpu_start=$(cpu_seconds)
+  phase_start=$(now_ns)
+  for ((i = 1; i <= c; ++i)); do
+    started[i]=$(now_ns)
+    send_cmd "nu$i" "$(command_for "$op" "$i" "$name")"
+  done
+  local pending=$c deadline=$(( $(date +%s) + timeout_s ))
+  while [ $pending -gt 0 ] && [ "$(date +%s)" -lt "$deadline" ]; do
+    for ((i = 1; i <= c; ++i)); do
+      [ -n "${finished[i]:-}" ] && continue
+      if [ "$(count_lines "nu$i" "$(done_marker "$op")")" -gt "${done_before[i]}" ]; then
+        finished[i]=$(now_ns)
+        echo "$(( (finished[i] - started[i]) / 1000 )) 1" >> "$samples"
+        pending=$((pending - 1))
+      elif [ "$(count_lines "nu$i" "$(fail_marker "$op")")" -gt "${fail_before[i]}" ]; then
+        finished[i]=$(now_ns)
+        echo "0 0" >> "$samples"
+        pending=$((pending - 1))
+      fi
+    done
+    [ $pending -gt 0 ] && sleep 0.002
+  done
+  for ((i = 1; i <= c; ++i)); do [ -z "${finished[i]:-}" ] && echo "0 0" >> "$samples"; done
+  local phase_ns=$(( $(now_ns) - phase_start ))
+  local cpu_end
+  cpu_end=$(cpu_seconds)
+  echo "$phase_ns $cpu_start $cpu_end" >> "$samples.time"
+}
+
+# One CSV row from a cell's samples; latencies arrive sorted, so the percentiles are nearest-rank.
+report_cell()
+{
+  local op=$1 size=$2 bytes=$3 c=$4 rounds=$5 samples=$6
+  sort -n "$samples" | awk -v op="$op" -v size="$size" -v bytes="$bytes" -v c="$c" -v rounds="$rounds" -v times="$samples.time" '
+    { if ($2 == 1) { ok++; lat[ok] = $1 / 1000.0 } else failed++ }
+    END {
+      while ((getline line < times) > 0) { split(line, t, " "); seconds += t[1] / 1e9; cpu += t[3] - t[2] }
+      n = ok
+      p50 = n ? lat[int(0.5 * n + 0.999999)] : 0
+      p99 = n ? lat[int(0.99 * n + 0.999999)] : 0
+      moved = ok * bytes
+      throughput = seconds ? moved / 1048576 / seconds : 0
+      cpu_per_gib = moved ? cpu / (moved / 1073741824) : 0
+      printf "%s,%s,%d,%d,%d,%d,%d,%.3f,%.2f,%.3f,%.3f,%.3f,%.3f\n", op, size, bytes, c, rounds, ok, failed + 0, seconds, throughput, p50, p99, cpu, cpu_per_gib
+    }'
+}
+
+# The file each NU sends: random data, so compression does not flatter the numbers, and a
+# different first block per NU, so the CR's content dedup never skips an upload.
+make_files()
+{
+  local size=$1 bytes=$2 name=$3
+  head -c "$bytes" /dev/urandom > "$WORK/base.bin"
+  for ((i = 1; i <= NUS; ++i)); do
+    cp --reflink=auto "$WORK/base.bin" "$WORK/nu$i/$name"
+    printf 'dbin-bench-nu%04d' "$i" | dd of="$WORK/nu$i/$name" conv=notrunc status=none
+  done
+  rm -f "$WORK/base.bin"
+}
+
+clear_received()
+{
+  for ((i = 1; i <= NUS; ++i)); do rm -f "$WORK/nu$i"/nu_downloads/* "$WORK/nu$i"/nu_recv_from_nu/*; done
+}
+
+has_op() { [[ " $OPS " == *" $1 "* ]]; }
+
+main()
+{
+  [ "$(id -u)" -eq 0 ] || { log "needs root to create network namespaces"; exit 1; }
+  for program in Central_Repository/cr Super_User/su Normal_User/nu; do
+    [ -x "$ROOT/$program" ] || { log "$program is not built; run make bench, or make in its directory"; exit 1; }
+  done
+  [ "$NUS" -ge 2 ] || { log "BENCH_NUS must be at least 2, for fnu"; exit 1; }
+  mkdir -p "$WORK"
+  trap cleanup EXIT
+  trap 'exit 130' INT TERM
+  setup_network || { log "could not set up the network namespaces"; exit 1; }
+  start_nodes || { log "nodes did not come up; see $WORK/*/node.log"; BENCH_KEEP=1; exit 1; }
+  log "CR, SU and $NUS NUs up in $WORK"
+
+  local header="op,size,bytes,concurrency,rounds,ops,failed,seconds,throughput_mib_s,p50_ms,p99_ms,cpu_s,cpu_s_per_gib"
+  echo "$header"
+  [ -n "${BENCH_OUT:-}" ] && echo "$header" > "$BENCH_OUT"
+  local max_c=1
+  for c in $CONCURRENCY; do [ "$c" -gt "$max_c" ] && max_c=$c; done
+  [ "$max_c" -gt "$NUS" ] && max_c=$NUS
+
+  for size in $SIZES; do
+    local bytes name
+    bytes=$(numfmt --from=iec "$size") || continue
+    name="bench_$size.bin"
+    # Each NU's source file, plus a stored and a received copy for every NU that runs at once
+    local avail need
+    avail=$(df --output=avail -B1 "$WORK" | tail -1)
+    need=$((bytes * (NUS + 2 * max_c) + 64 * 1048576))
+    if [ "$need" -gt "$avail" ]; then
+      log "skipping $size: needs $(numfmt --to=iec "$need") of disk, $(numfmt --to=iec "$avail") free"
+      continue
+    fi
+    log "preparing $size files"
+    make_files "$size" "$bytes" "$name"
+    # Generous per-operation timeout: a minute plus the file at 20 MiB/s
+    local timeout_s=$((60 + bytes / 20971520))
+    for c in $CONCURRENCY; do
+      if [ "$c" -gt "$NUS" ]; then
+        log "skipping concurrency $c: only $NUS NUs"
+        continue
+      fi
+      local rounds=$ROUNDS
+      [ $((rounds * bytes * c)) -gt "$ROUND_BYTES" ] && rounds=$((ROUND_BYTES / (bytes * c)))
+      [ "$rounds" -lt 1 ] && rounds=1
+      log "$size x $c, $rounds round(s)"
+      local cell="$WORK/cell"
+      rm -f "$cell".*
+      # fback needs the file stored and takes it out again, so every fdel is followed by one. The
+      # CR holds an fdel's verdict until the file is recorded, so the fback always finds it.
+      if has_op fdel || has_op fback; then
+        for ((r = 0; r < rounds; ++r)); do
+          run_phase fdel "$c" "$cell.fdel" "$name" "$timeout_s"
+          run_phase fback "$c" "$cell.fback" "$name" "$timeout_s"
+          clear_received
+        done
+      fi
+      if has_op fnu; then
+        for ((r = 0; r < rounds; ++r)); do
+          run_phase fnu "$c" "$cell.fnu" "$name" "$timeout_s"
+          clear_received
+        done
+      fi
+      for op in $OPS; do
+        [ -f "$cell.$op" ] || continue
+        local row
+        row=$(report_cell "$op" "$size" "$bytes" "$c" "$rounds" "$cell.$op")
+        echo "$row"
+        [ -n "${BENCH_OUT:-}" ] && echo "$row" >> "$BENCH_OUT"
+      done
+    done
+    for ((i = 1; i <= NUS; ++i)); do rm -f "$WORK/nu$i/$name"; done
+  done
+}
+
+main "$@"
@@ -2,22 +2,40 @@
 			//DBIN CENTRAL REPOSITORY Program//            
 //------------------------------------------------------------------------------------//
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <stdarg.h>
 #include <unistd.h>
+#include <time.h>
 #include <pthread.h>
+#include <errno.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <net/if.h>
+#include <ifaddrs.h>
+#include <netinet/tcp.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
 #include <sqlite3.h>
 #include <ctype.h>
+#include <limits.h>
 #include <libgen.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <dirent.h>
+#include "dbin_common.h"
 
 // Port Definitions 
 #define SU_IP_CR 8101
+#define NU_SENDTO_SU 8102
 #define SU_SENDTO_CR 8104
 #define NU_SENDTO_CR 8107
 #define FSEE_PORT 8108
@@ -25,392 +43,3224 @@
 #define CR_REPLY_PORT 8113
 #define TCP_FILE_TRANSFER_PORT 9000
 
-#define MAX_CHUNK_SIZE 4096
-#define MAX_IP_LENGTH 16
-#define MAX_CMD_LENGTH 512
-#define MAX_NODES 10
-#define MAX_FILENAME_LENGTH 256
 #define MAX_FILEPATH_LENGTH 512
+#define MAX_PENDING_TRANSFERS 64
+#define PENDING_TRANSFER_TIMEOUT 30
+#define DATA_IDLE_TIMEOUT 30
+#define SESSION_IDLE_TIMEOUT 15
+#define SESSION_BUFFER_SIZE 4096
+#define SESSION_OUTPUT_LIMIT (256 * 1024)
+#define TRANSFER_MAGIC "DBTX"
+#define BATCH_FILE_MAGIC "DBFH"
+#define SESSION_MAGIC "DBSS"
+#define DEFAULT_WORKER_COUNT 8
+#define DEFAULT_JOB_QUEUE_DEPTH 64
+#define DEFAULT_HASHER_COUNT 2
+#define DEFAULT_MAX_TRANSFERS 32
+#define REACTOR_MAX_EVENTS 64
+#define REACTOR_IO_BUFFER_SIZE 65536
+#define TRANSFER_VERDICT_OK 'K'
+#define TRANSFER_VERDICT_BAD 'X'
+#define BLOB_DIRECTORY "cr_data_storage/blobs"
+#define DB_BUSY_TIMEOUT_MS 5000
+#define LISTING_PAGE_ROWS 1000
+#define LISTING_BUFFER_SIZE 65536
+#define LISTING_END_MARKER "End of listing:"
+#define LISTING_OPTIONS_USAGE "Options: name=<glob> min=<size> max=<size> newest=<n> totals (sizes take K, M or G)."
+#define DEFAULT_COMMIT_BATCH 64
+#define DEFAULT_COMMIT_DELAY_MS 5
+#define BUSY_REPLY "BUSY: Repository is busy, retry later."
+#define CONTROL_RTO_INITIAL_MS 250
+#define CONTROL_RTO_MIN_MS 100
+#define CONTROL_RTO_MAX_MS 4000
+#define CONTROL_MAX_ATTEMPTS 6
+#define RECENT_MESSAGE_IDS 256
+#define MAX_RTT_ESTIMATES 256
+#define TABLE_PULL_INTERVAL_MS 500
+#define CONTROL_MULTICAST_GROUP "239.255.68.66"
+#define RATE_LIMIT_MAX_KBPS (1 << 30)
 
 // Global State
 sqlite3 *G_DB;
-pthread_mutex_t G_DB_MUTEX = PTHREAD_MUTEX_INITIALIZER;
-volatile bool G_EXIT_REQUEST = false;
-char G_IP_TABLE[MAX_NODES + 2][MAX_IP_LENGTH];
-int G_NUM_NODES_IN_TABLE = 0;
+char G_DB_PATH[MAX_FILEPATH_LENGTH];
+// Who belongs to the network (see Membership); once the table has arrived only the reactor
+// thread reads or changes it.
+ip_set G_MEMBERS;
+struct in_addr G_CR_ADDR;
+struct in_addr G_SU_ADDR;
+// Every table and change the SU sends names the membership version it produces; 0 until the first
+// whole table has arrived. A table sent in chunks is collected in G_TABLE_STAGING.
+uint64_t G_MEMBERSHIP_VERSION = 0;
+typedef enum { MEMBERSHIP_IGNORED, MEMBERSHIP_PENDING, MEMBERSHIP_APPLIED, MEMBERSHIP_BEHIND } membership_result;
+typedef struct { uint64_t version; int chunk_count; int next_chunk; struct in_addr cr_addr; struct in_addr su_addr; ip_set nodes; } table_staging;
+table_staging G_TABLE_STAGING;
+long long G_LAST_PULL_MS = 0;
+bool G_COMPRESSION = true;
+// What the metrics endpoint reports (see Metrics), updated from the reactor, the workers and the
+// metadata writer. The writer's own timings are kept in G_DB_METRICS and reported alongside.
+typedef struct { metric_histogram op; metric_histogram commit; } db_metrics;
+db_metrics G_DB_METRICS = 
+{ 
+  .op = { "dbin_db_operation_seconds", "From queueing a metadata change to its commit.", "db operation", 1e-6, 1e-3, "ms" },
+  .commit = { "dbin_db_commit_seconds", "Time the metadata writer spends on each batch transaction.", "db commit", 1e-6, 1e-3, "ms" },
+};
+node_metrics G_METRICS = 
+{ 
+  .handshake = { "dbin_handshake_seconds", "From sending READY to the transfer's first data connection.", "handshake", 1e-6, 1e-3, "ms" },
+  .first_byte = { "dbin_first_byte_seconds", "From sending READY to the first payload byte of an upload.", "first byte", 1e-6, 1e-3, "ms" },
+  .throughput = { "dbin_transfer_throughput_bytes_per_second", "Payload rate of each completed transfer.", "throughput", 1024, 1.0 / 1024, "MiB/s" },
+  .histograms = { &G_METRICS.handshake, &G_METRICS.first_byte, &G_METRICS.throughput, &G_DB_METRICS.op, &G_DB_METRICS.commit },
+};
 
-// Structs for thread arguments
-typedef struct { int port; bool is_su_listener; } listener_config;
-typedef struct { char filename[MAX_FILENAME_LENGTH]; char sender_ip[MAX_IP_LENGTH]; } tcp_download_info;
-typedef struct { char filename[MAX_FILENAME_LENGTH]; struct sockaddr_in requester_addr; int reply_port; } tcp_upload_info;
+// Narrows a listing: a filename glob (a trailing '*' makes it a prefix), a size range (-1 leaves
+// an end open), only the newest N stored files, or just the count and total size.
+typedef struct { char pattern[MAX_FILENAME_LENGTH]; long long min_size; long long max_size; int newest; bool totals_only; } listing_filter;
+
+// Transfers announced over UDP. A slot stays in use until every stripe of the transfer has
+// arrived on the shared TCP acceptor and finished, or the transfer goes quiet and expires. A
+// listing uses a slot only until its single connection arrives and is handed to a worker; a
+// batch holds one for its single connection, however many files that carries.
+typedef enum { TRANSFER_INBOUND, TRANSFER_OUTBOUND, TRANSFER_LISTING, TRANSFER_BATCH } transfer_direction;
+typedef struct 
+{ 
+  bool in_use; 
+  transfer_direction direction;
+  uint64_t transfer_id; 
+  char filename[MAX_FILENAME_LENGTH]; 
+  char sender_ip[MAX_IP_LENGTH]; 
+  char stored_path[MAX_FILEPATH_LENGTH];
+  struct in_addr source_addr; 
+  long long filesize; 
+  long long mtime;
+  int stream_count;
+  bool compress;
+  transfer_priority priority;
+  transfer_flow* flow;
+  bool list_all;
+  listing_filter filter;
+  off_t stripe_have[MAX_STREAMS];
+  uint32_t stripe_crc[MAX_STREAMS];
+  long long expected_crc;
+  uint32_t streams_claimed;
+  int streams_open;
+  int streams_finished;
+  bool failed;
+  int file_fd;
+  char temp_path[MAX_FILEPATH_LENGTH + 32];
+  char content_hash[SHA256_HEX_LENGTH + 1];
+  long long ready_us;
+  long long started_us;
+  long long bytes_moved;
+  struct reactor_conn* verdict_stream;
+  time_t registered_at; 
+} pending_transfer;
+pending_transfer G_PENDING_TRANSFERS[MAX_PENDING_TRANSFERS];
+
+// Fixed set of workers draining a bounded job ring; sized from DBIN_CR_WORKERS / DBIN_CR_QUEUE_DEPTH
+typedef struct { void (*run)(void* arg); void* arg; } worker_job;
+typedef struct 
+{
+  worker_job* jobs;
+  int capacity;
+  int head;
+  int count;
+  pthread_mutex_t mutex;
+  pthread_cond_t not_empty;
+} job_queue;
+job_queue G_JOB_QUEUE = { .mutex = PTHREAD_MUTEX_INITIALIZER, .not_empty = PTHREAD_COND_INITIALIZER };
+
+// Received files are hashed by their own threads (DBIN_CR_HASHERS), never on the reactor. Their
+// queue is a list of the uploads' metadata changes and has no bound: a file already on disk has
+// to be recorded, so a burst of uploads waits its turn rather than being turned away.
+typedef struct
+{
+  struct metadata_op* head;
+  struct metadata_op* tail;
+  bool stopping;
+  int thread_count;
+  pthread_t* threads;
+  pthread_mutex_t mutex;
+  pthread_cond_t not_empty;
+} hash_queue;
+hash_queue G_HASHER = { .mutex = PTHREAD_MUTEX_INITIALIZER, .not_empty = PTHREAD_COND_INITIALIZER };
+
+// Every socket the reactor watches; data connections move AWAIT_HELLO -> RECEIVING -> AWAIT_CHECKSUM
+// -> DONE, or AWAIT_HELLO -> AWAIT_RESUME -> SENDING -> AWAIT_VERDICT -> DONE. The last stripe of an
+// upload waits in AWAIT_RECORD between its checksum and its verdict until the upload's record has
+// committed, so a sender that hears 'K' there knows the file is kept. A resumed stripe sits in
+// CHECK_PREFIX while a worker checksums the part an earlier attempt delivered. The receiving end
+// answers each hello with how many bytes of that stripe it already holds, as a big-endian uint64.
+// After the data the sender appends the stripe's CRC32C (big-endian uint32) and the receiver
+// answers with a one-byte verdict.
+// A batch connection instead cycles BATCH_HEADER -> BATCH_NAME -> BATCH_DATA -> BATCH_CHECKSUM
+// once per file: each file is framed by a header and its name, and followed by its CRC32C
+// (big-endian uint32). A header with an empty name ends the batch; the repository answers with
+// how many of the files it kept, as a big-endian uint32, once all of their records have settled
+// (the stream waits in AWAIT_RECORD until then). A stream that finished cleanly waits for
+// the next hello, so a client may run its following transfer on the same connection.
+// A hello with the session magic instead opens a node's long-lived control session: commands and
+// replies travel on it back to back as control frames, and the node's heartbeat PINGs are answered
+// with PONGs.
+typedef struct { char magic[4]; uint16_t stream_index; uint16_t stream_count; uint64_t transfer_id; } transfer_hello;
+typedef struct { char magic[4]; uint32_t name_length; uint64_t size; uint64_t mtime; } batch_file_header;
+typedef enum { CONN_CONTROL, CONN_ACCEPTOR, CONN_DATA, CONN_METADATA, CONN_COMPLETIONS, CONN_SESSION } conn_kind;
+typedef enum { DATA_AWAIT_HELLO, DATA_AWAIT_RESUME, DATA_CHECK_PREFIX, DATA_RECEIVING, DATA_AWAIT_CHECKSUM, DATA_SENDING, DATA_AWAIT_VERDICT, DATA_BATCH_HEADER, DATA_BATCH_NAME, DATA_BATCH_DATA, DATA_BATCH_CHECKSUM, DATA_AWAIT_RECORD, DATA_DONE } data_state;
+typedef enum { SEND_SENDFILE, SEND_SPLICE, SEND_COPY, SEND_COMPRESSED } send_mode;
+typedef struct reactor_conn
+{
+  conn_kind kind;
+  int fd;
+  bool is_su_listener;
+  data_state state;
+  struct sockaddr_in peer_addr;
+  transfer_hello hello;
+  size_t hello_received;
+  pending_transfer* transfer;
+  int stream_index;
+  off_t stripe_start;
+  uint64_t resume_frame;
+  size_t resume_received;
+  int file_fd;
+  off_t file_offset;
+  long long bytes_remaining;
+  send_mode mode;
+  int pipe_fds[2];
+  size_t pipe_pending;
+  char* copy_buffer;
+  size_t copy_length;
+  size_t copy_sent;
+  bool compress;
+  int incompressible_run;
+  uint8_t* frame_buffer;
+  size_t frame_received;
+  const uint8_t* map;
+  uint32_t crc;
+  uint8_t trailer[4];
+  size_t trailer_done;
+  batch_file_header batch_header;
+  char batch_name[MAX_FILENAME_LENGTH];
+  size_t batch_received;
+  char batch_path[MAX_FILEPATH_LENGTH + 32];
+  int batch_files;
+  int batch_kept;
+  int batch_pending;
+  char* session_in;
+  size_t session_in_length;
+  char* session_out;
+  size_t session_out_length;
+  size_t session_out_capacity;
+  bool session_writing;
+  int holds;
+  bool closed;
+  time_t last_activity;
+  long long throttled_until_ms;
+  struct reactor_conn* next;
+} reactor_conn;
+
+// Control messages that must arrive carry a FIELD_MESSAGE_ID and are answered with a CONTROL_ACK
+// naming it. The sender re-sends until acknowledged, waiting a timeout derived from the round
+// trips it has measured to that node (RFC 6298), and the receiver drops IDs it has already seen.
+// Replies the CR sends to a node's listening port are re-sent from the reactor until acknowledged.
+typedef struct pending_reply 
+{ 
+  uint64_t id; 
+  int fd; 
+  struct sockaddr_in addr; 
+  control_frame frame; 
+  int attempts; 
+  long long first_sent_ms; 
+  long long due_ms; 
+  int rto_ms; 
+  struct pending_reply* next; 
+} pending_reply;
+typedef struct { struct in_addr addr; bool measured; int srtt_ms; int rttvar_ms; int rto_ms; } rtt_estimate;
+// Work that a worker finishes on the reactor's behalf is handed back on one list, signalled through
+// an eventfd; each item names the reactor-side step that completes it.
+typedef struct reactor_completion { void (*finish)(struct reactor_completion* done); struct reactor_completion* next; } reactor_completion;
+typedef struct
+{
+  int epoll_fd;
+  int max_transfers;
+  int transfer_count;
+  reactor_conn* data_conns;
+  reactor_conn* retired_conns;
+  pending_reply* pending_replies;
+  uint64_t recent_ids[RECENT_MESSAGE_IDS];
+  int recent_next;
+  rtt_estimate rtt[MAX_RTT_ESTIMATES];
+  int rtt_count;
+  reactor_completion* completed;
+  pthread_mutex_t completed_mutex;
+  int completed_event_fd;
+  char io_buffer[REACTOR_IO_BUFFER_SIZE];
+} reactor_state;
+reactor_state G_REACTOR = { .completed_mutex = PTHREAD_MUTEX_INITIALIZER, .completed_event_fd = -1 };
+
+// Structs for worker job arguments
+typedef struct { bool for_su; int sock; char owner_ip[MAX_IP_LENGTH]; listing_filter filter; } records_request;
+// A resumed stripe's checksum covers what an earlier attempt delivered too. A worker reads that
+// prefix back through its own descriptor and returns the result to the reactor as a completion.
+typedef struct { reactor_completion done; reactor_conn* conn; int fd; off_t offset; off_t length; uint32_t crc; bool ok; } prefix_check;
+// An fback's lookup, stat and compressibility sample touch the database and the disk, so a worker
+// fills in the transfer and the reactor registers it and answers the requester.
+typedef struct { reactor_completion done; reactor_conn* control; struct sockaddr_in reply_addr; int reply_port; bool offer_compression; bool found; pending_transfer transfer; } fback_lookup;
+
+// Builds listing text in one buffer with a running length, so each row costs only its own size.
+// The writer flushes to its socket when a row does not fit.
+typedef struct { int sock; char* data; size_t capacity; size_t length; bool stopped; } listing_writer;
+
+// Metadata statements, prepared once. G_DB is used only by the metadata writer thread; every
+// thread that lists or looks up files gets its own read-only connection, which in WAL mode reads
+// a consistent snapshot without waiting for the writer.
+typedef enum 
+{
+  WRITER_BEGIN, WRITER_COMMIT, WRITER_ROLLBACK, WRITER_SAVEPOINT, WRITER_RELEASE, WRITER_ROLLBACK_TO,
+  WRITER_OWNER_HAS_BLOB, WRITER_BLOB_KNOWN, WRITER_FILE_HASH, WRITER_BLOB_ADD_REF, WRITER_FILE_UPSERT,
+  WRITER_BLOB_DROP_REF, WRITER_BLOB_DELETE, WRITER_FILE_DELETE, WRITER_CLEAR_FILES, WRITER_CLEAR_BLOBS,
+  WRITER_STATEMENT_COUNT
+} writer_statement;
+static const char* const WRITER_SQL[WRITER_STATEMENT_COUNT] = {
+  [WRITER_BEGIN] = "BEGIN IMMEDIATE;",
+  [WRITER_COMMIT] = "COMMIT;",
+  [WRITER_ROLLBACK] = "ROLLBACK;",
+  [WRITER_SAVEPOINT] = "SAVEPOINT metadata_op;",
+  [WRITER_RELEASE] = "RELEASE metadata_op;",
+  [WRITER_ROLLBACK_TO] = "ROLLBACK TO metadata_op;",
+  [WRITER_OWNER_HAS_BLOB] = "SELECT 1 FROM StoredFiles s JOIN Blobs b ON b.hash = s.hash WHERE s.owner_ip = ? AND s.hash = ? AND b.size = ? LIMIT 1;",
+  [WRITER_BLOB_KNOWN] = "SELECT 1 FROM Blobs WHERE hash = ?;",
+  [WRITER_FILE_HASH] = "SELECT hash FROM StoredFiles WHERE filename = ? AND owner_ip = ?;",
+  [WRITER_BLOB_ADD_REF] = "INSERT INTO Blobs (hash, size, refcount, crc32c) VALUES (?, ?, 1, ?) ON CONFLICT(hash) DO UPDATE SET refcount = refcount + 1, crc32c = COALESCE(crc32c, excluded.crc32c);",
+  [WRITER_FILE_UPSERT] = "INSERT OR REPLACE INTO StoredFiles (filename, owner_ip, hash, size, stored_at) VALUES (?, ?, ?, ?, strftime('%s', 'now'));",
+  [WRITER_BLOB_DROP_REF] = "UPDATE Blobs SET refcount = refcount - 1 WHERE hash = ? RETURNING refcount;",
+  [WRITER_BLOB_DELETE] = "DELETE FROM Blobs WHERE hash = ?;",
+  [WRITER_FILE_DELETE] = "DELETE FROM StoredFiles WHERE filename = ? AND owner_ip = ? RETURNING hash;",
+  [WRITER_CLEAR_FILES] = "DELETE FROM StoredFiles;",
+  [WRITER_CLEAR_BLOBS] = "DELETE FROM Blobs;",
+};
+sqlite3_stmt* G_WRITER_STMTS[WRITER_STATEMENT_COUNT];
+// Listings page with a keyset cursor on id, so every page is an index seek however deep it is;
+// an owner's pages walk the owner_ip index, whose entries are in id order. Every listing binds
+// ?1 owner, ?2 glob, ?3/?4 size range, ?5 cursor and ?6 page size, leaving unused filters NULL.
+#define LISTING_SELECT "SELECT id, filename, owner_ip, size, stored_at FROM StoredFiles WHERE "
+#define LISTING_FILTER "(?2 IS NULL OR filename GLOB ?2) AND (?3 IS NULL OR size >= ?3) AND (?4 IS NULL OR size <= ?4)"
+typedef enum 
+{
+  READER_FILES_PAGE, READER_FILES_PAGE_DESC, READER_OWNER_FILES_PAGE, READER_OWNER_FILES_PAGE_DESC,
+  READER_FILES_TOTALS, READER_OWNER_FILES_TOTALS, READER_LOOKUP_FILE, READER_STATEMENT_COUNT
+} reader_statement;
+static const char* const READER_SQL[READER_STATEMENT_COUNT] = {
+  [READER_FILES_PAGE] = LISTING_SELECT "id > ?5 AND " LISTING_FILTER " ORDER BY id LIMIT ?6;",
+  [READER_FILES_PAGE_DESC] = LISTING_SELECT "id < ?5 AND " LISTING_FILTER " ORDER BY id DESC LIMIT ?6;",
+  [READER_OWNER_FILES_PAGE] = LISTING_SELECT "owner_ip = ?1 AND id > ?5 AND " LISTING_FILTER " ORDER BY id LIMIT ?6;",
+  [READER_OWNER_FILES_PAGE_DESC] = LISTING_SELECT "owner_ip = ?1 AND id < ?5 AND " LISTING_FILTER " ORDER BY id DESC LIMIT ?6;",
+  [READER_FILES_TOTALS] = "SELECT COUNT(*), COALESCE(SUM(size), 0) FROM StoredFiles WHERE " LISTING_FILTER ";",
+  [READER_OWNER_FILES_TOTALS] = "SELECT COUNT(*), COALESCE(SUM(size), 0) FROM StoredFiles WHERE owner_ip = ?1 AND " LISTING_FILTER ";",
+  [READER_LOOKUP_FILE] = "SELECT s.hash, b.crc32c FROM StoredFiles s LEFT JOIN Blobs b ON b.hash = s.hash WHERE s.filename = ? AND s.owner_ip = ?;",
+};
+typedef struct { sqlite3* db; sqlite3_stmt* stmts[READER_STATEMENT_COUNT]; } db_reader;
+__thread db_reader* G_THREAD_READER;
+
+// Metadata changes are applied by one writer thread, a batch per transaction, so a burst of
+// uploads pays for one fsync. A batch closes at DBIN_CR_COMMIT_BATCH changes or
+// DBIN_CR_COMMIT_DELAY_MS after its first one; each change then goes back to the reactor through
+// an eventfd, which is where whoever waits on it hears that it is durable: an upload's last
+// stripe gets its verdict only then.
+typedef enum { METADATA_RECORD_UPLOAD, METADATA_REFERENCE_STORED, METADATA_DELETE_FBACK, METADATA_CLEAR } metadata_kind;
+typedef struct metadata_op
+{
+  metadata_kind kind;
+  char filename[MAX_FILENAME_LENGTH];
+  char owner_ip[MAX_IP_LENGTH];
+  char path[MAX_FILEPATH_LENGTH + 32];
+  char hash[SHA256_HEX_LENGTH + 1];
+  long long size;
+  long long crc;
+  bool duplicate;
+  bool ok;
+  char released_hash[SHA256_HEX_LENGTH + 1];
+  char released_path[MAX_FILEPATH_LENGTH];
+  reactor_conn* control;
+  reactor_conn* stream;
+  bool in_batch;
+  struct sockaddr_in reply_addr;
+  control_message* request;
+  long long submitted_us;
+  struct metadata_op* next;
+} metadata_op;
+typedef struct
+{
+  metadata_op* head;
+  metadata_op* tail;
+  int count;
+  int batch_limit;
+  int delay_ms;
+  bool stopping;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t not_empty;
+  metadata_op* done;
+  pthread_mutex_t done_mutex;
+  int event_fd;
+} metadata_queue;
+metadata_queue G_METADATA = { .mutex = PTHREAD_MUTEX_INITIALIZER, .not_empty = PTHREAD_COND_INITIALIZER, .done_mutex = PTHREAD_MUTEX_INITIALIZER, .event_fd = -1 };
 
 // Function Prototypes
-void trim_whitespace(char *str);
+struct in_addr env_su_addr(void);
+void join_control_group(int sock);
 bool initialize_database(const char* db_name);
-void db_insert_file_record(const char* filename, const char* owner_ip);
-void db_clear_all_records();
-void parse_and_store_ip_table(const char* buffer);
-bool is_ip_in_table(const char* ip_to_check);
-void send_file_records(const struct sockaddr_in* recipient_addr, int reply_port, bool for_su);
-void* tcp_download_thread(void* arg);
-void* tcp_upload_thread(void* arg);
-void* listener_thread_func(void* arg);
-
-// Utility Functions (Database, IP, Validation)
-void trim_whitespace(char *str) 
-{
-  if (!str) return;
-  char *end = str + strlen(str) - 1;
-  while (end >= str && isspace((unsigned char)*end)) end--;
-  *(end + 1) = '\0';
-  char *start = str;
-  while (*start && isspace((unsigned char)*start)) start++;
-  memmove(str, start, strlen(start) + 1);
+bool is_content_hash(const char* text);
+void blob_path(const char* hash, char* path, size_t path_size);
+bool db_ensure_column(const char* table, const char* column, const char* definition);
+bool db_prepare_statements(sqlite3* db, const char* const* sql, sqlite3_stmt** stmts, int count);
+sqlite3_stmt* db_writer(writer_statement which);
+bool db_exec_writer(writer_statement which);
+sqlite3_stmt* db_reader_statement(reader_statement which);
+bool db_lookup_stored_file(const char* filename, const char* owner_ip, char* path, size_t path_size, long long* crc);
+void db_release_reference(metadata_op* op, const char* hash);
+bool db_reference_blob(metadata_op* op, bool blob_must_exist);
+bool db_clear_all_records(void);
+void discard_released_files(const metadata_op* op);
+void remove_unreferenced_blobs(void);
+bool sync_directory(const char* path);
+bool load_resume_state(const char* part_path, long long filesize, long long mtime, int* stream_count, off_t* have);
+void save_resume_state(const char* part_path, long long filesize, long long mtime, int stream_count, const off_t* have);
+void keep_partial_upload(pending_transfer* transfer);
+bool register_pending_transfer(const pending_transfer* transfer);
+pending_transfer* claim_pending_transfer(const transfer_hello* hello, struct in_addr peer);
+uint32_t transfer_checksum(const pending_transfer* transfer);
+void complete_transfer(pending_transfer* transfer);
+void end_transfer_stream(pending_transfer* transfer, bool completed);
+void release_transfer(pending_transfer* transfer);
+void expire_pending_transfers(void);
+transfer_flow* open_flow(transfer_priority priority, struct in_addr peer);
+void close_flow(transfer_flow* flow);
+size_t flow_quantum(const transfer_flow* flow, size_t want);
+void refill_flow(transfer_flow* flow);
+void charge_flow(transfer_flow* flow, size_t bytes);
+void count_transfer_bytes(pending_transfer* transfer, bool sent, size_t bytes);
+bool start_worker_pool(int worker_count, int queue_depth);
+bool submit_job(void (*run)(void* arg), void* arg);
+void* worker_thread_func(void* arg);
+bool start_hashers(int count);
+void hash_upload(metadata_op* op);
+void* hasher_thread_func(void* arg);
+void stop_hashers(void);
+membership_result stage_table_chunk(const control_message* message);
+membership_result apply_membership_change(const control_message* message);
+membership_result apply_membership(const control_message* message);
+void request_table_pull(struct in_addr su_addr);
+rtt_estimate* find_rtt_estimate(struct in_addr addr);
+void record_rtt_sample(struct in_addr addr, long long sample_ms);
+bool remember_message_id(uint64_t id);
+bool acknowledge_message(int sock, const struct sockaddr_in* sender_addr, const control_message* message);
+void send_reliable_reply(int sock, const struct sockaddr_in* recipient_addr, const control_frame* message);
+void acknowledge_reply(const struct sockaddr_in* sender_addr, uint64_t id);
+void retransmit_control_replies(void);
+int next_retransmit_wait_ms(void);
+void send_control_reply(reactor_conn* control, const struct sockaddr_in* recipient_addr, int reply_port, const control_frame* message);
+void send_control_text(reactor_conn* control, const struct sockaddr_in* recipient_addr, int reply_port, const char* text);
+bool listing_flush(listing_writer* writer);
+bool listing_printf(listing_writer* writer, const char* format, ...) __attribute__((format(printf, 2, 3)));
+bool parse_size(const char* text, long long* size);
+bool parse_listing_filter(char* options, listing_filter* filter, char* error, size_t error_size);
+void bind_listing_filter(sqlite3_stmt* stmt, const char* owner_ip, const listing_filter* filter);
+long long write_file_records(listing_writer* writer, const char* owner_ip, bool for_su, const listing_filter* filter);
+bool write_file_totals(listing_writer* writer, const char* owner_ip, bool for_su, const listing_filter* filter);
+void stream_file_records(int sock, const char* owner_ip, bool for_su, const listing_filter* filter);
+void send_file_records_job(void* arg);
+void record_upload(metadata_op* op);
+void settle_metadata_ops(metadata_op* batch);
+metadata_op* new_metadata_op(metadata_kind kind, const char* filename, const char* owner_ip);
+bool start_metadata_writer(int batch_limit, int delay_ms);
+void submit_metadata(metadata_op* op);
+bool apply_metadata_op(metadata_op* op);
+void commit_metadata_batch(metadata_op* batch);
+void* metadata_writer_thread_func(void* arg);
+void stop_metadata_writer(void);
+void report_metadata_op(metadata_op* op);
+void finish_metadata_ops(reactor_conn* conn);
+bool reactor_add(reactor_conn* conn, uint32_t events);
+void reactor_set_events(reactor_conn* conn, uint32_t events);
+reactor_conn* reactor_open_listener(conn_kind kind, int type, int port, bool is_su_listener);
+void release_conn(reactor_conn* conn);
+void retire_conn(reactor_conn* conn);
+void free_retired_conns(void);
+void finish_data_stream(reactor_conn* conn);
+void close_data_conn(reactor_conn* conn);
+bool recycle_data_conn(reactor_conn* conn);
+bool await_upload_record(reactor_conn* conn);
+void send_record_verdict(reactor_conn* conn, bool ok);
+bool finish_batch(reactor_conn* conn);
+void settle_batch_file(reactor_conn* conn, bool ok);
+bool send_batch_tally(reactor_conn* conn);
+bool start_session(reactor_conn* conn);
+bool flush_session(reactor_conn* conn);
+void session_send(reactor_conn* conn, const control_frame* message);
+bool handle_session_readable(reactor_conn* conn);
+void close_session(reactor_conn* conn);
+void accept_data_connections(reactor_conn* acceptor);
+bool start_data_transfer(reactor_conn* conn);
+bool start_prefix_check(reactor_conn* conn, int fd, off_t length);
+void check_prefix_job(void* arg);
+void finish_prefix_check(reactor_completion* done);
+void complete_on_reactor(reactor_completion* done);
+void run_completions(reactor_conn* conn);
+bool resume_stripe(reactor_conn* conn, off_t held);
+bool start_listing_stream(reactor_conn* conn);
+bool receive_compressed_frames(reactor_conn* conn);
+int recv_frame(int sock, void* frame, size_t length, size_t* received);
+bool receive_batch_files(reactor_conn* conn);
+bool handle_data_readable(reactor_conn* conn);
+int pump_file_to_socket(reactor_conn* conn);
+bool handle_data_writable(reactor_conn* conn);
+void handle_upload_request(reactor_conn* control, const control_message* request, const struct sockaddr_in* sender_addr, const char* sender_ip_str, bool content_checked);
+void handle_fback_request(reactor_conn* control, const control_message* request, const struct sockaddr_in* sender_addr, const char* requester_ip, int reply_port);
+void lookup_fback_job(void* arg);
+void finish_fback_lookup(reactor_completion* done);
+void answer_fback(fback_lookup* lookup);
+void handle_listing_request(reactor_conn* control, const control_message* request, const struct sockaddr_in* sender_addr, const char* requester_ip, int records_port);
+void handle_batch_request(reactor_conn* control, const control_message* request, const struct sockaddr_in* sender_addr, const char* sender_ip_str);
+void handle_control_message(reactor_conn* control, const control_message* message, const struct sockaddr_in* sender_addr, const char* sender_ip_str);
+void handle_control_datagrams(reactor_conn* control);
+bool conn_throttled(reactor_conn* conn);
+void resume_throttled_conns(void);
+int next_resume_wait_ms(int wait);
+void sweep_idle_data_conns(void);
+void run_reactor(void);
+
+// DBIN_SU_IP names the SU, so a node started after it can pull the table. 0.0.0.0 when unset.
+struct in_addr env_su_addr(void)
+{
+  struct in_addr addr = { .s_addr = 0 };
+  const char* value = getenv("DBIN_SU_IP");
+  if (value && inet_pton(AF_INET, value, &addr) != 1) 
+  {
+    fprintf(stderr, "Ignoring DBIN_SU_IP=%s (not an IPv4 address).\n", value);
+    addr.s_addr = 0;
+  }
+  return addr;
+}
+
+// Joins the SU's control multicast group on every interface that can carry it, so a broadcast
+// reaches this socket in the SU's one datagram. Where none can, the SU's unicast copies still arrive.
+void join_control_group(int sock)
+{
+  struct ifaddrs* interfaces;
+  if (getifaddrs(&interfaces) < 0) return;
+  struct ip_mreqn membership = { .imr_address.s_addr = INADDR_ANY };
+  inet_pton(AF_INET, CONTROL_MULTICAST_GROUP, &membership.imr_multiaddr);
+  for (struct ifaddrs* entry = interfaces; entry; entry = entry->ifa_next) 
+  {
+    if (!entry->ifa_addr || entry->ifa_addr->sa_family != AF_INET || !(entry->ifa_flags & IFF_MULTICAST)) continue;
+    membership.imr_ifindex = if_nametoindex(entry->ifa_name);
+    setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership));
+  }
+  freeifaddrs(interfaces);
+}
+
+bool initialize_database(const char* db_name) 
+{
+  if (sqlite3_open(db_name, &G_DB)) 
+  {
+    fprintf(stderr, "DB Error: %s\n", sqlite3_errmsg(G_DB)); 
+    return false;
+  }
+  strncpy(G_DB_PATH, db_name, sizeof(G_DB_PATH) - 1);
+  sqlite3_busy_timeout(G_DB, DB_BUSY_TIMEOUT_MS);
+  char *err_msg = 0;
+  // WAL lets the per-thread readers list files while an insert is being committed; FULL makes each
+  // commit durable, and the metadata writer batches changes so that costs one fsync per batch
+  if (sqlite3_exec(G_DB, "PRAGMA journal_mode=WAL; PRAGMA synchronous=FULL;", 0, 0, &err_msg) != SQLITE_OK) 
+  {
+    fprintf(stderr, "SQL error: %s\n", err_msg); sqlite3_free(err_msg); 
+    return false;
+  }
+  // Stored files point at a content-addressed blob; a NULL hash marks a file kept under its legacy per-owner name
+  const char *sql = "CREATE TABLE IF NOT EXISTS StoredFiles (id INTEGER PRIMARY KEY, filename TEXT NOT NULL, owner_ip TEXT NOT NULL, hash TEXT, size INTEGER, stored_at INTEGER, UNIQUE(filename, owner_ip));"
+                    "CREATE TABLE IF NOT EXISTS Blobs (hash TEXT PRIMARY KEY, size INTEGER NOT NULL, refcount INTEGER NOT NULL, crc32c INTEGER);"
+                    "CREATE INDEX IF NOT EXISTS StoredFilesByOwner ON StoredFiles (owner_ip);";
+  if (sqlite3_exec(G_DB, sql, 0, 0, &err_msg) != SQLITE_OK) 
+  {
+    fprintf(stderr, "SQL error: %s\n", err_msg); sqlite3_free(err_msg); 
+    return false;
+  }
+  // Databases from before deduplication, checksums and catalogue queries lack these columns
+  if (!db_ensure_column("StoredFiles", "hash", "TEXT") || !db_ensure_column("Blobs", "crc32c", "INTEGER") ||
+      !db_ensure_column("StoredFiles", "size", "INTEGER") || !db_ensure_column("StoredFiles", "stored_at", "INTEGER")) return false;
+  // Older records learn their size from their blob; legacy per-owner copies keep NULL
+  sqlite3_exec(G_DB, "UPDATE StoredFiles SET size = (SELECT b.size FROM Blobs b WHERE b.hash = StoredFiles.hash) WHERE size IS NULL AND hash IS NOT NULL;", 0, 0, 0);
+  if (!db_prepare_statements(G_DB, WRITER_SQL, G_WRITER_STMTS, WRITER_STATEMENT_COUNT)) return false;
+  mkdir("cr_data_storage", 0755);
+  mkdir(BLOB_DIRECTORY, 0755);
+  printf("Database initialized.\n");
+  return true;
+}
+
+bool db_ensure_column(const char* table, const char* column, const char* definition)
+{
+  char sql[MAX_CMD_LENGTH];
+  sqlite3_stmt* probe;
+  snprintf(sql, sizeof(sql), "SELECT %s FROM %s LIMIT 0;", column, table);
+  if (sqlite3_prepare_v2(G_DB, sql, -1, &probe, 0) == SQLITE_OK) 
+  {
+    sqlite3_finalize(probe);
+    return true;
+  }
+  char *err_msg = 0;
+  snprintf(sql, sizeof(sql), "ALTER TABLE %s ADD COLUMN %s %s;", table, column, definition);
+  if (sqlite3_exec(G_DB, sql, 0, 0, &err_msg) != SQLITE_OK) 
+  {
+    fprintf(stderr, "SQL error: %s\n", err_msg); sqlite3_free(err_msg); 
+    return false;
+  }
+  return true;
+}
+
+bool db_prepare_statements(sqlite3* db, const char* const* sql, sqlite3_stmt** stmts, int count)
+{
+  for (int i = 0; i < count; i++) 
+  {
+    if (sqlite3_prepare_v3(db, sql[i], -1, SQLITE_PREPARE_PERSISTENT, &stmts[i], 0) != SQLITE_OK) 
+    {
+      fprintf(stderr, "SQL prepare failed: %s\n", sqlite3_errmsg(db));
+      while (i-- > 0) sqlite3_finalize(stmts[i]);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Hands out a cached writer statement ready to bind; the caller resets it when done. Only the
+// metadata writer thread calls this once the repository is running.
+sqlite3_stmt* db_writer(writer_statement which)
+{
+  sqlite3_stmt* stmt = G_WRITER_STMTS[which];
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  return stmt;
+}
+
+bool db_exec_writer(writer_statement which)
+{
+  sqlite3_stmt* stmt = db_writer(which);
+  bool ok = sqlite3_step(stmt) == SQLITE_DONE;
+  sqlite3_reset(stmt);
+  return ok;
+}
+
+// Same as db_writer for the calling thread's read-only connection, opened on first use. Reset
+// the statement promptly: a reader holds its WAL snapshot until then.
+sqlite3_stmt* db_reader_statement(reader_statement which)
+{
+  if (!G_THREAD_READER) 
+  {
+    db_reader* reader = calloc(1, sizeof(db_reader));
+    if (!reader) return NULL;
+    if (sqlite3_open_v2(G_DB_PATH, &reader->db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK) 
+    {
+      fprintf(stderr, "DB reader open failed: %s\n", sqlite3_errmsg(reader->db));
+      sqlite3_close(reader->db);
+      free(reader);
+      return NULL;
+    }
+    sqlite3_busy_timeout(reader->db, DB_BUSY_TIMEOUT_MS);
+    if (!db_prepare_statements(reader->db, READER_SQL, reader->stmts, READER_STATEMENT_COUNT)) 
+    {
+      sqlite3_close(reader->db);
+      free(reader);
+      return NULL;
+    }
+    G_THREAD_READER = reader;
+  }
+  sqlite3_stmt* stmt = G_THREAD_READER->stmts[which];
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  return stmt;
+}
+
+bool is_content_hash(const char* text)
+{
+  if (strlen(text) != SHA256_HEX_LENGTH) return false;
+  for (const char* c = text; *c; c++) if (!isxdigit((unsigned char)*c) || isupper((unsigned char)*c)) return false;
+  return true;
+}
+
+void blob_path(const char* hash, char* path, size_t path_size)
+{
+  snprintf(path, path_size, "%s/%s", BLOB_DIRECTORY, hash);
+}
+
+// Resolves where an owner's stored file lives on disk and its CRC32C (-1 if unknown); false if
+// there is no such record.
+bool db_lookup_stored_file(const char* filename, const char* owner_ip, char* path, size_t path_size, long long* crc)
+{
+  bool found = false;
+  sqlite3_stmt* stmt = db_reader_statement(READER_LOOKUP_FILE);
+  if (stmt) 
+  {
+    sqlite3_bind_text(stmt, 1, filename, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, owner_ip, -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW) 
+    {
+      found = true;
+      const char* hash = (const char*)sqlite3_column_text(stmt, 0);
+      if (hash) blob_path(hash, path, path_size);
+      else snprintf(path, path_size, "cr_data_storage/%s_%s", owner_ip, filename);
+      *crc = sqlite3_column_type(stmt, 1) == SQLITE_NULL ? -1 : sqlite3_column_int64(stmt, 1);
+    }
+    sqlite3_reset(stmt);
+  }
+  return found;
+}
+
+// Drops one reference to a blob, deleting its row with its last reference; a NULL hash is a
+// legacy per-owner copy. Files are only noted on the op and removed once the batch commits.
+void db_release_reference(metadata_op* op, const char* hash)
+{
+  if (!hash) 
+  {
+    snprintf(op->released_path, sizeof(op->released_path), "cr_data_storage/%s_%s", op->owner_ip, op->filename);
+    return;
+  }
+  sqlite3_stmt* stmt = db_writer(WRITER_BLOB_DROP_REF);
+  sqlite3_bind_text(stmt, 1, hash, -1, SQLITE_STATIC);
+  bool unreferenced = sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int64(stmt, 0) <= 0;
+  sqlite3_reset(stmt);
+  if (!unreferenced) return;
+  stmt = db_writer(WRITER_BLOB_DELETE);
+  sqlite3_bind_text(stmt, 1, hash, -1, SQLITE_STATIC);
+  sqlite3_step(stmt);
+  sqlite3_reset(stmt);
+  strncpy(op->released_hash, hash, sizeof(op->released_hash) - 1);
+}
+
+// Points the op's (filename, owner_ip) at its blob, taking a reference and releasing whatever the
+// record pointed at before. With blob_must_exist the call fails unless the same owner already
+// references the blob, which is how an upload offering a known hash skips sending any data. A new blob records the op's
+// CRC32C (-1 if unknown). Runs inside the writer's transaction.
+bool db_reference_blob(metadata_op* op, bool blob_must_exist)
+{
+  bool ok = true;
+  sqlite3_stmt* stmt;
+  if (blob_must_exist) 
+  {
+    // Knowing a hash proves nothing, so only content the owner has already sent is reused
+    stmt = db_writer(WRITER_OWNER_HAS_BLOB);
+    sqlite3_bind_text(stmt, 1, op->owner_ip, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, op->hash, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 3, op->size);
+    ok = sqlite3_step(stmt) == SQLITE_ROW;
+    sqlite3_reset(stmt);
+  }
+  bool had_record = false, same_blob = false;
+  char old_hash[SHA256_HEX_LENGTH + 1] = "";
+  if (ok) 
+  {
+    stmt = db_writer(WRITER_FILE_HASH);
+    sqlite3_bind_text(stmt, 1, op->filename, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, op->owner_ip, -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW) 
+    {
+      had_record = true;
+      const char* hash_text = (const char*)sqlite3_column_text(stmt, 0);
+      if (hash_text) strncpy(old_hash, hash_text, sizeof(old_hash) - 1);
+      same_blob = hash_text && strcmp(hash_text, op->hash) == 0;
+    }
+    sqlite3_reset(stmt);
+  }
+  if (ok && !same_blob) 
+  {
+    stmt = db_writer(WRITER_BLOB_ADD_REF);
+    sqlite3_bind_text(stmt, 1, op->hash, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, op->size);
+    if (op->crc >= 0) sqlite3_bind_int64(stmt, 3, op->crc);
+    ok = sqlite3_step(stmt) == SQLITE_DONE;
+    sqlite3_reset(stmt);
+    if (ok) 
+    {
+      stmt = db_writer(WRITER_FILE_UPSERT);
+      sqlite3_bind_text(stmt, 1, op->filename, -1, SQLITE_STATIC);
+      sqlite3_bind_text(stmt, 2, op->owner_ip, -1, SQLITE_STATIC);
+      sqlite3_bind_text(stmt, 3, op->hash, -1, SQLITE_STATIC);
+      sqlite3_bind_int64(stmt, 4, op->size);
+      ok = sqlite3_step(stmt) == SQLITE_DONE;
+      sqlite3_reset(stmt);
+    }
+    if (ok && had_record) db_release_reference(op, old_hash[0] ? old_hash : NULL);
+  }
+  if (!ok && !blob_must_exist) fprintf(stderr, "DB insert failed: %s\n", sqlite3_errmsg(G_DB));
+  return ok;
+}
+
+bool db_clear_all_records(void)
+{
+  bool ok = db_exec_writer(WRITER_CLEAR_FILES) && db_exec_writer(WRITER_CLEAR_BLOBS);
+  if (!ok) fprintf(stderr, "Failed to clear records: %s\n", sqlite3_errmsg(G_DB));
+  return ok;
+}
+
+// Removes what an op released, now that its batch is committed. A blob dropped by one op may have
+// been taken up again by a later op in the same batch, so only blobs that are still unknown go.
+void discard_released_files(const metadata_op* op)
+{
+  char path[MAX_FILEPATH_LENGTH];
+  if (op->released_path[0] && remove(op->released_path) == 0) printf("File '%s' deleted from disk.\n", op->released_path);
+  if (!op->released_hash[0]) return;
+  sqlite3_stmt* stmt = db_writer(WRITER_BLOB_KNOWN);
+  sqlite3_bind_text(stmt, 1, op->released_hash, -1, SQLITE_STATIC);
+  bool known = sqlite3_step(stmt) == SQLITE_ROW;
+  sqlite3_reset(stmt);
+  if (known) return;
+  blob_path(op->released_hash, path, sizeof(path));
+  if (remove(path) == 0) printf("File '%s' deleted from disk.\n", path);
+}
+
+void remove_unreferenced_blobs(void)
+{
+  DIR* dir = opendir(BLOB_DIRECTORY);
+  if (!dir) return;
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL)
+  {
+    if (!is_content_hash(entry->d_name)) continue;
+    // A content hash is exactly SHA256_HEX_LENGTH characters, and the zeroed probe terminates it
+    metadata_op probe = { .released_path = "" };
+    memcpy(probe.released_hash, entry->d_name, SHA256_HEX_LENGTH);
+    discard_released_files(&probe);
+  }
+  closedir(dir);
+}
+
+// A renamed file only survives a crash once the directory holding its new name is flushed too.
+bool sync_directory(const char* path)
+{
+  int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) return false;
+  bool ok = fsync(fd) == 0;
+  close(fd);
+  return ok;
+}
+
+// Resume State
+// '<file>.part.meta' records how much of each stripe of '<file>.part' is already on disk, so a
+// later upload of the same file (same size and modification time) continues where it stopped.
+bool load_resume_state(const char* part_path, long long filesize, long long mtime, int* stream_count, off_t* have)
+{
+  char meta_path[MAX_FILEPATH_LENGTH + 48];
+  snprintf(meta_path, sizeof(meta_path), "%s.meta", part_path);
+  FILE* meta = fopen(meta_path, "r");
+  if (!meta) return false;
+  long long saved_size, saved_mtime;
+  int saved_streams;
+  bool ok = fscanf(meta, "DBRESUME %lld %lld %d", &saved_size, &saved_mtime, &saved_streams) == 3 && saved_size == filesize && saved_mtime == mtime && saved_streams >= 1 && saved_streams <= MAX_STREAMS;
+  for (int i = 0; ok && i < saved_streams; ++i)
+  {
+    long long held;
+    off_t offset, length;
+    stripe_range(filesize, saved_streams, i, &offset, &length);
+    ok = fscanf(meta, "%lld", &held) == 1 && held >= 0 && held <= length;
+    if (ok) have[i] = held;
+  }
+  fclose(meta);
+  struct stat part_stat;
+  if (ok && (stat(part_path, &part_stat) < 0 || part_stat.st_size != filesize)) ok = false;
+  if (ok) *stream_count = saved_streams;
+  return ok;
+}
+
+void save_resume_state(const char* part_path, long long filesize, long long mtime, int stream_count, const off_t* have)
+{
+  char meta_path[MAX_FILEPATH_LENGTH + 48], temp_path[MAX_FILEPATH_LENGTH + 56];
+  snprintf(meta_path, sizeof(meta_path), "%s.meta", part_path);
+  snprintf(temp_path, sizeof(temp_path), "%s.tmp", meta_path);
+  FILE* meta = fopen(temp_path, "w");
+  if (!meta) 
+  { 
+    perror("fopen resume state"); 
+    return; 
+  }
+  fprintf(meta, "DBRESUME %lld %lld %d", filesize, mtime, stream_count);
+  for (int i = 0; i < stream_count; ++i) fprintf(meta, " %lld", (long long)have[i]);
+  fprintf(meta, "\n");
+  if (fclose(meta) == 0) rename(temp_path, meta_path);
+}
+
+// Flushes an unfinished upload and records its per-stripe progress for the sender's next attempt.
+void keep_partial_upload(pending_transfer* transfer)
+{
+  long long held = 0;
+  for (int i = 0; i < transfer->stream_count; ++i) held += transfer->stripe_have[i];
+  if (transfer->file_fd >= 0) fdatasync(transfer->file_fd);
+  save_resume_state(transfer->temp_path, transfer->filesize, transfer->mtime, transfer->stream_count, transfer->stripe_have);
+  fprintf(stderr, "Upload of '%s' interrupted; %lld of %lld bytes kept for resume.\n", transfer->filename, held, transfer->filesize);
+}
+
+// Pending Transfer Registry (owned by the reactor thread)
+// Admits an announced transfer until all of its streams have finished. Returns false when the
+// repository is at its transfer limit; a re-announced transfer keeps its admission.
+bool register_pending_transfer(const pending_transfer* transfer)
+{
+  expire_pending_transfers();
+  int free_slot = -1;
+  for (int i = 0; i < MAX_PENDING_TRANSFERS; ++i)
+  {
+    pending_transfer* slot = &G_PENDING_TRANSFERS[i];
+    if (slot->in_use && slot->transfer_id == transfer->transfer_id) return true;
+    // Two uploads of the same file would share one partial copy, so the later one waits
+    if (slot->in_use && slot->direction == TRANSFER_INBOUND && transfer->direction == TRANSFER_INBOUND && strcmp(slot->stored_path, transfer->stored_path) == 0) return false;
+    if (!slot->in_use && free_slot < 0) free_slot = i;
+  }
+  if (free_slot < 0 || G_REACTOR.transfer_count >= G_REACTOR.max_transfers) return false;
+  pending_transfer* slot = &G_PENDING_TRANSFERS[free_slot];
+  *slot = *transfer;
+  slot->in_use = true;
+  slot->streams_claimed = 0;
+  slot->streams_open = slot->streams_finished = 0;
+  slot->failed = false;
+  slot->file_fd = -1;
+  slot->flow = NULL;
+  slot->ready_us = monotonic_us();
+  slot->started_us = 0;
+  slot->bytes_moved = 0;
+  slot->verdict_stream = NULL;
+  slot->registered_at = time(NULL);
+  G_REACTOR.transfer_count++;
+  return true;
+}
+
+// Binds a data connection's hello to its announced transfer and stripe. An fback's requester
+// picks how many of the offered streams it opens, so the first hello fixes the count.
+pending_transfer* claim_pending_transfer(const transfer_hello* hello, struct in_addr peer)
+{
+  uint64_t transfer_id = be64toh(hello->transfer_id);
+  int stream_index = ntohs(hello->stream_index);
+  int stream_count = ntohs(hello->stream_count);
+  for (int i = 0; i < MAX_PENDING_TRANSFERS; ++i)
+  {
+    pending_transfer* slot = &G_PENDING_TRANSFERS[i];
+    if (!slot->in_use || slot->transfer_id != transfer_id || slot->source_addr.s_addr != peer.s_addr) continue;
+    if (slot->direction == TRANSFER_OUTBOUND && slot->streams_claimed == 0 && stream_count >= 1 && stream_count <= slot->stream_count) slot->stream_count = stream_count;
+    if (slot->failed || stream_count != slot->stream_count || stream_index >= stream_count || (slot->streams_claimed & (1u << stream_index))) return NULL;
+    // The flow starts with the first stream, so a transfer that never connects takes no share
+    if (slot->streams_claimed == 0 && slot->direction != TRANSFER_LISTING) 
+    {
+      slot->flow = open_flow(slot->priority, peer);
+      histogram_record(&G_METRICS.handshake, monotonic_us() - slot->ready_us);
+      slot->started_us = metrics_transfer_started();
+    }
+    slot->streams_claimed |= 1u << stream_index;
+    slot->streams_open++;
+    slot->registered_at = time(NULL);
+    if (slot->direction == TRANSFER_INBOUND && slot->file_fd < 0)
+    {
+      // Land in '<stored>.part', which an earlier interrupted attempt may already have partly filled
+      mkdir("cr_data_storage", 0755);
+      slot->file_fd = open(slot->temp_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+      if (slot->file_fd < 0 || ftruncate(slot->file_fd, slot->filesize) < 0) 
+      {
+        perror("open download");
+        end_transfer_stream(slot, false);
+        return NULL;
+      }
+      save_resume_state(slot->temp_path, slot->filesize, slot->mtime, slot->stream_count, slot->stripe_have);
+    }
+    return slot;
+  }
+  return NULL;
+}
+
+// The whole file's CRC32C, from the checksums its stripes were verified against.
+uint32_t transfer_checksum(const pending_transfer* transfer)
+{
+  uint32_t crc = 0;
+  for (int i = 0; i < transfer->stream_count; ++i)
+  {
+    off_t offset, length;
+    stripe_range(transfer->filesize, transfer->stream_count, i, &offset, &length);
+    crc = crc32c_combine(crc, transfer->stripe_crc[i], length);
+  }
+  return crc;
+}
+
+void complete_transfer(pending_transfer* transfer)
+{
+  // A listing's connection already belongs to a worker, and a batch filed each file as it arrived
+  if (transfer->direction == TRANSFER_LISTING || transfer->direction == TRANSFER_BATCH) return;
+  if (transfer->direction == TRANSFER_OUTBOUND)
+  {
+    // A stored copy that no longer matches its upload checksum was sent damaged; keep the record
+    if (transfer->expected_crc >= 0 && transfer_checksum(transfer) != (uint32_t)transfer->expected_crc)
+    {
+      fprintf(stderr, "Stored copy of '%s' no longer matches its checksum; record kept.\n", transfer->filename);
+      return;
+    }
+    // An fback hands the stored file back to its owner, so the record and the copy go once it is sent
+    metadata_op* op = new_metadata_op(METADATA_DELETE_FBACK, transfer->filename, transfer->sender_ip);
+    if (op) submit_metadata(op);
+    return;
+  }
+  metadata_op* job = new_metadata_op(METADATA_RECORD_UPLOAD, transfer->filename, transfer->sender_ip);
+  if (!job) return;
+  close(transfer->file_fd);
+  transfer->file_fd = -1;
+  // Staged under a name unique to this transfer; a hasher hashes it and the writer files it as a blob
+  snprintf(job->path, sizeof(job->path), "%s.%016llx.staged", transfer->stored_path, (unsigned long long)transfer->transfer_id);
+  if (rename(transfer->temp_path, job->path) < 0) 
+  { 
+    perror("rename download"); 
+    free(job);
+    return; 
+  }
+  char meta_path[sizeof(transfer->temp_path) + 8];
+  snprintf(meta_path, sizeof(meta_path), "%s.meta", transfer->temp_path);
+  remove(meta_path);
+  snprintf(job->hash, sizeof(job->hash), "%s", transfer->content_hash);
+  job->size = transfer->filesize;
+  job->crc = transfer_checksum(transfer);
+  job->stream = transfer->verdict_stream;
+  if (job->stream) job->stream->holds++;
+  printf("File '%s' received and stored.\n", transfer->filename);
+  hash_upload(job);
+}
+
+// Called as each stripe's connection closes; the last one settles the whole transfer.
+void end_transfer_stream(pending_transfer* transfer, bool completed)
+{
+  transfer->streams_open--;
+  transfer->registered_at = time(NULL);
+  if (completed) transfer->streams_finished++;
+  else transfer->failed = true;
+  if (!transfer->failed && transfer->streams_finished == transfer->stream_count)
+  {
+    complete_transfer(transfer);
+    release_transfer(transfer);
+  }
+  else if (transfer->failed && transfer->streams_open == 0)
+  {
+    if (transfer->direction == TRANSFER_INBOUND) keep_partial_upload(transfer);
+    else if (transfer->direction == TRANSFER_OUTBOUND) fprintf(stderr, "Upload of '%s' incomplete, keeping stored copy.\n", transfer->filename);
+    else if (transfer->direction == TRANSFER_BATCH) fprintf(stderr, "Batch from %s ended early; the files before the break are kept.\n", transfer->sender_ip);
+    release_transfer(transfer);
+  }
+}
+
+void release_transfer(pending_transfer* transfer)
+{
+  if (transfer->file_fd >= 0) close(transfer->file_fd);
+  close_flow(transfer->flow);
+  transfer->flow = NULL;
+  if (transfer->started_us > 0) metrics_transfer_finished(transfer->started_us, transfer->bytes_moved, !transfer->failed && transfer->streams_finished == transfer->stream_count);
+  transfer->in_use = false;
+  G_REACTOR.transfer_count--;
+}
+
+// Drops transfers whose streams never arrived (or stopped arriving) within the timeout.
+void expire_pending_transfers(void)
+{
+  time_t now = time(NULL);
+  for (int i = 0; i < MAX_PENDING_TRANSFERS; ++i)
+  {
+    pending_transfer* slot = &G_PENDING_TRANSFERS[i];
+    if (!slot->in_use || slot->streams_open > 0 || now - slot->registered_at <= PENDING_TRANSFER_TIMEOUT) continue;
+    if (slot->streams_claimed && slot->direction == TRANSFER_INBOUND) keep_partial_upload(slot);
+    release_transfer(slot);
+  }
+}
+
+// Scheduling (owned by the reactor thread)
+// Every transfer is a flow in a priority class: interactive (fback) or bulk (uploads and
+// batches). DBIN_RATE_LIMIT_KBPS caps all of the repository's transfers together and
+// DBIN_PEER_RATE_LIMIT_KBPS those with any one node. Active flows share each limit in proportion
+// to their class's weight, so an fback keeps most of the link while backups pour in, and each
+// flow's streams draw on one token bucket that refills at the flow's share. A stream whose flow
+// has run dry is parked until the bucket refills. With neither limit set no flows are kept.
+
+// Registers a transfer with 'peer'; NULL when no limit is set, which every caller treats as unmetered.
+transfer_flow* open_flow(transfer_priority priority, struct in_addr peer)
+{
+  if (G_SCHEDULER.global_rate == 0 && G_SCHEDULER.peer_rate == 0) return NULL;
+  transfer_flow* flow = calloc(1, sizeof(transfer_flow));
+  if (!flow) return NULL;
+  flow->priority = priority;
+  flow->peer = peer;
+  flow->refilled_ms = monotonic_ms();
+  flow->next = G_SCHEDULER.flows;
+  G_SCHEDULER.flows = flow;
+  rebalance_flows();
+  return flow;
+}
+
+void close_flow(transfer_flow* flow)
+{
+  if (!flow) return;
+  transfer_flow** link = &G_SCHEDULER.flows;
+  while (*link && *link != flow) link = &(*link)->next;
+  if (*link) *link = flow->next;
+  rebalance_flows();
+  free(flow);
+}
+
+// Caps one send or receive at the flow's quantum, so the bucket is checked often enough to follow
+// its share as other flows come and go.
+size_t flow_quantum(const transfer_flow* flow, size_t want)
+{
+  if (!flow) return want;
+  size_t quantum = rate_quantum(flow->rate);
+  return want < quantum ? want : quantum;
+}
+
+void refill_flow(transfer_flow* flow)
+{
+  long long now = monotonic_ms();
+  double burst = rate_quantum(flow->rate);
+  flow->tokens += (now - flow->refilled_ms) * flow->rate / 1000.0;
+  if (flow->tokens > burst) flow->tokens = burst;
+  flow->refilled_ms = now;
+}
+
+// Draws what a stream just moved from its flow's bucket, which may go into debt; the stream is
+// parked before its next move until the debt is paid off.
+void charge_flow(transfer_flow* flow, size_t bytes)
+{
+  if (flow) flow->tokens -= bytes;
+}
+
+// Counts what a stream of 'transfer' just moved, wherever the reactor charges its flow. The first
+// byte of an upload also closes its time-to-first-byte sample.
+void count_transfer_bytes(pending_transfer* transfer, bool sent, size_t bytes)
+{
+  if (transfer->bytes_moved == 0 && !sent) histogram_record(&G_METRICS.first_byte, monotonic_us() - transfer->ready_us);
+  transfer->bytes_moved += bytes;
+  metric_add(sent ? &G_METRICS.bytes_sent : &G_METRICS.bytes_received, bytes);
+}
+
+// Worker Pool
+bool start_worker_pool(int worker_count, int queue_depth)
+{
+  G_JOB_QUEUE.jobs = calloc(queue_depth, sizeof(worker_job));
+  if (!G_JOB_QUEUE.jobs) return false;
+  G_JOB_QUEUE.capacity = queue_depth;
+  for (int i = 0; i < worker_count; ++i)
+  {
+    pthread_t worker_tid;
+    if (pthread_create(&worker_tid, NULL, worker_thread_func, NULL) != 0) return false;
+    pthread_detach(worker_tid);
+  }
+  printf("Worker pool started with %d workers and a queue of %d jobs.\n", worker_count, queue_depth);
+  return true;
+}
+
+// Queues a job without blocking; returns false when the queue is full so the caller can shed load.
+bool submit_job(void (*run)(void* arg), void* arg)
+{
+  bool queued = false;
+  pthread_mutex_lock(&G_JOB_QUEUE.mutex);
+  if (G_JOB_QUEUE.count < G_JOB_QUEUE.capacity)
+  {
+    int tail = (G_JOB_QUEUE.head + G_JOB_QUEUE.count) % G_JOB_QUEUE.capacity;
+    G_JOB_QUEUE.jobs[tail] = (worker_job){ .run = run, .arg = arg };
+    G_JOB_QUEUE.count++;
+    queued = true;
+    pthread_cond_signal(&G_JOB_QUEUE.not_empty);
+  }
+  pthread_mutex_unlock(&G_JOB_QUEUE.mutex);
+  return queued;
+}
+
+void* worker_thread_func(void* arg)
+{
+  (void)arg;
+  while (true)
+  {
+    pthread_mutex_lock(&G_JOB_QUEUE.mutex);
+    while (G_JOB_QUEUE.count == 0) pthread_cond_wait(&G_JOB_QUEUE.not_empty, &G_JOB_QUEUE.mutex);
+    worker_job job = G_JOB_QUEUE.jobs[G_JOB_QUEUE.head];
+    G_JOB_QUEUE.head = (G_JOB_QUEUE.head + 1) % G_JOB_QUEUE.capacity;
+    G_JOB_QUEUE.count--;
+    pthread_mutex_unlock(&G_JOB_QUEUE.mutex);
+    job.run(job.arg);
+  }
+  return NULL;
+}
+
+// Upload Hashers
+bool start_hashers(int count)
+{
+  G_HASHER.threads = calloc(count, sizeof(pthread_t));
+  if (!G_HASHER.threads) return false;
+  for (; G_HASHER.thread_count < count; ++G_HASHER.thread_count)
+  {
+    if (pthread_create(&G_HASHER.threads[G_HASHER.thread_count], NULL, hasher_thread_func, NULL) != 0) return false;
+  }
+  printf("Started %d upload hasher(s).\n", count);
+  return true;
+}
+
+void hash_upload(metadata_op* op)
+{
+  op->next = NULL;
+  pthread_mutex_lock(&G_HASHER.mutex);
+  if (G_HASHER.tail) G_HASHER.tail->next = op;
+  else G_HASHER.head = op;
+  G_HASHER.tail = op;
+  pthread_cond_signal(&G_HASHER.not_empty);
+  pthread_mutex_unlock(&G_HASHER.mutex);
+}
+
+void* hasher_thread_func(void* arg)
+{
+  (void)arg;
+  while (true)
+  {
+    pthread_mutex_lock(&G_HASHER.mutex);
+    while (!G_HASHER.head && !G_HASHER.stopping) pthread_cond_wait(&G_HASHER.not_empty, &G_HASHER.mutex);
+    metadata_op* op = G_HASHER.head;
+    if (op) 
+    {
+      G_HASHER.head = op->next;
+      if (!G_HASHER.head) G_HASHER.tail = NULL;
+      op->next = NULL;
+    }
+    pthread_mutex_unlock(&G_HASHER.mutex);
+    if (!op) break;
+    record_upload(op);
+  }
+  return NULL;
+}
+
+// Lets the hashers finish every queued upload, so that all of them reach the metadata writer.
+void stop_hashers(void)
+{
+  pthread_mutex_lock(&G_HASHER.mutex);
+  G_HASHER.stopping = true;
+  pthread_cond_broadcast(&G_HASHER.not_empty);
+  pthread_mutex_unlock(&G_HASHER.mutex);
+  for (int i = 0; i < G_HASHER.thread_count; ++i) pthread_join(G_HASHER.threads[i], NULL);
+}
+
+// Collects one chunk of a table. The SU sends chunks in order, each once the last is acknowledged,
+// and chunk 0 starts the collection over, so a copy re-sent while another is arriving still ends
+// whole. The finished table replaces the membership unless a newer version was applied meanwhile.
+membership_result stage_table_chunk(const control_message* message)
+{
+  table_staging* staging = &G_TABLE_STAGING;
+  if (!CONTROL_HAS(message, FIELD_CR_ADDR) || !CONTROL_HAS(message, FIELD_SU_ADDR) || !CONTROL_HAS(message, FIELD_CHUNK) || 
+      !CONTROL_HAS(message, FIELD_COUNT) || message->chunk >= message->count) 
+  {
+    return MEMBERSHIP_IGNORED;
+  }
+  if (message->version < G_MEMBERSHIP_VERSION) return MEMBERSHIP_IGNORED;
+  if (message->chunk == 0) 
+  {
+    ip_set_clear(&staging->nodes);
+    staging->version = message->version;
+    staging->chunk_count = message->count;
+    staging->next_chunk = 0;
+    staging->cr_addr = message->cr_addr;
+    staging->su_addr = message->su_addr;
+  }
+  else if (message->version != staging->version || message->chunk != staging->next_chunk) return MEMBERSHIP_IGNORED;
+  for (int i = 0; i < message->node_count; ++i) 
+  {
+    if (!ip_set_add(&staging->nodes, message->nodes[i])) perror("membership set");
+  }
+  if (++staging->next_chunk < staging->chunk_count) return MEMBERSHIP_PENDING;
+  if (staging->version < G_MEMBERSHIP_VERSION) return MEMBERSHIP_IGNORED;
+  // The staged set becomes the membership, and the old one is cleared to stage the next table
+  ip_set previous = G_MEMBERS;
+  G_MEMBERS = staging->nodes;
+  staging->nodes = previous;
+  ip_set_clear(&staging->nodes);
+  G_CR_ADDR = staging->cr_addr;
+  G_SU_ADDR = staging->su_addr;
+  if (!ip_set_add(&G_MEMBERS, G_CR_ADDR) || !ip_set_add(&G_MEMBERS, G_SU_ADDR)) perror("membership set");
+  G_MEMBERSHIP_VERSION = staging->version;
+  return MEMBERSHIP_APPLIED;
+}
+
+// Applies an addition or removal, which lists only the NUs that changed. It must carry the version
+// right after ours; one further ahead means a change was missed, and the table must be pulled.
+membership_result apply_membership_change(const control_message* message)
+{
+  if (message->version <= G_MEMBERSHIP_VERSION) return MEMBERSHIP_IGNORED;
+  if (G_MEMBERSHIP_VERSION == 0 || message->version != G_MEMBERSHIP_VERSION + 1) return MEMBERSHIP_BEHIND;
+  for (int i = 0; i < message->node_count; ++i) 
+  {
+    struct in_addr node = message->nodes[i];
+    if (node.s_addr == G_CR_ADDR.s_addr || node.s_addr == G_SU_ADDR.s_addr) continue;
+    if (message->type == CONTROL_NODE_REMOVE) ip_set_remove(&G_MEMBERS, node);
+    else if (!ip_set_add(&G_MEMBERS, node)) perror("membership set");
+  }
+  G_MEMBERSHIP_VERSION = message->version;
+  return MEMBERSHIP_APPLIED;
+}
+
+// Applies a table chunk or a change sent by the SU.
+membership_result apply_membership(const control_message* message)
+{
+  if (!CONTROL_HAS(message, FIELD_VERSION)) return MEMBERSHIP_IGNORED;
+  if (message->type == CONTROL_IP_TABLE) return stage_table_chunk(message);
+  if (message->type == CONTROL_NODE_ADD || message->type == CONTROL_NODE_REMOVE) return apply_membership_change(message);
+  return MEMBERSHIP_IGNORED;
+}
+
+// Asks the SU to send the whole table again, at most once per TABLE_PULL_INTERVAL_MS. The request
+// is not acknowledged; until the table arrives, the node simply asks again.
+void request_table_pull(struct in_addr su_addr)
+{
+  long long now = monotonic_ms();
+  if (now - G_LAST_PULL_MS < TABLE_PULL_INTERVAL_MS) return;
+  G_LAST_PULL_MS = now;
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0) return;
+  control_frame pull;
+  control_begin(&pull, CONTROL_TABLE_PULL);
+  struct sockaddr_in su = { .sin_family = AF_INET, .sin_addr = su_addr, .sin_port = htons(NU_SENDTO_SU) };
+  send_control(sock, &su, &pull);
+  close(sock);
+}
+
+// Reliable Control Messages
+// Returns the node's round-trip estimate, adding one at the initial timeout for a node not yet
+// measured, or NULL once the table is full.
+rtt_estimate* find_rtt_estimate(struct in_addr addr)
+{
+  for (int i = 0; i < G_REACTOR.rtt_count; ++i) 
+  {
+    if (G_REACTOR.rtt[i].addr.s_addr == addr.s_addr) return &G_REACTOR.rtt[i];
+  }
+  if (G_REACTOR.rtt_count == MAX_RTT_ESTIMATES) return NULL;
+  rtt_estimate* estimate = &G_REACTOR.rtt[G_REACTOR.rtt_count++];
+  *estimate = (rtt_estimate){ .addr = addr, .rto_ms = CONTROL_RTO_INITIAL_MS };
+  return estimate;
+}
+
+// Folds one round trip into the node's smoothed estimate and derives its retransmit timeout.
+void record_rtt_sample(struct in_addr addr, long long sample_ms)
+{
+  rtt_estimate* estimate = find_rtt_estimate(addr);
+  if (!estimate) return;
+  if (!estimate->measured) 
+  {
+    estimate->srtt_ms = sample_ms;
+    estimate->rttvar_ms = sample_ms / 2;
+    estimate->measured = true;
+  }
+  else
+  {
+    long long deviation = estimate->srtt_ms > sample_ms ? estimate->srtt_ms - sample_ms : sample_ms - estimate->srtt_ms;
+    estimate->rttvar_ms = (3 * estimate->rttvar_ms + deviation) / 4;
+    estimate->srtt_ms = (7 * estimate->srtt_ms + sample_ms) / 8;
+  }
+  int rto = estimate->srtt_ms + 4 * estimate->rttvar_ms;
+  estimate->rto_ms = rto < CONTROL_RTO_MIN_MS ? CONTROL_RTO_MIN_MS : rto > CONTROL_RTO_MAX_MS ? CONTROL_RTO_MAX_MS : rto;
+}
+
+// Returns false if the ID was seen recently, so a re-sent message is acted on only once.
+bool remember_message_id(uint64_t id)
+{
+  for (int i = 0; i < RECENT_MESSAGE_IDS; ++i) 
+  {
+    if (G_REACTOR.recent_ids[i] == id) return false;
+  }
+  G_REACTOR.recent_ids[G_REACTOR.recent_next] = id;
+  G_REACTOR.recent_next = (G_REACTOR.recent_next + 1) % RECENT_MESSAGE_IDS;
+  return true;
+}
+
+// Acknowledges a message that carries an ID. Returns false for a duplicate, which has already been
+// acted on; messages without an ID pass through.
+bool acknowledge_message(int sock, const struct sockaddr_in* sender_addr, const control_message* message)
+{
+  if (!CONTROL_HAS(message, FIELD_MESSAGE_ID)) return true;
+  control_frame ack;
+  control_begin(&ack, CONTROL_ACK);
+  control_put_u64(&ack, FIELD_MESSAGE_ID, message->message_id);
+  send_control(sock, sender_addr, &ack);
+  return remember_message_id(message->message_id);
+}
+
+// Sends a reply to a node's listening port and keeps it until the node acknowledges it.
+void send_reliable_reply(int sock, const struct sockaddr_in* recipient_addr, const control_frame* message)
+{
+  pending_reply* reply = malloc(sizeof(pending_reply));
+  rtt_estimate* estimate = find_rtt_estimate(recipient_addr->sin_addr);
+  if (!reply) 
+  {
+    send_control(sock, recipient_addr, message);
+    return;
+  }
+  *reply = (pending_reply){ .id = generate_transfer_id(), .fd = sock, .addr = *recipient_addr, .frame = *message, .attempts = 1, .first_sent_ms = monotonic_ms() };
+  reply->rto_ms = estimate ? estimate->rto_ms : CONTROL_RTO_INITIAL_MS;
+  reply->due_ms = reply->first_sent_ms + reply->rto_ms;
+  control_put_u64(&reply->frame, FIELD_MESSAGE_ID, reply->id);
+  send_control(sock, &reply->addr, &reply->frame);
+  reply->next = G_REACTOR.pending_replies;
+  G_REACTOR.pending_replies = reply;
+}
+
+// Settles the acknowledged reply. Only replies that were never re-sent yield a round-trip sample,
+// since an ACK for a re-sent one could answer either copy.
+void acknowledge_reply(const struct sockaddr_in* sender_addr, uint64_t id)
+{
+  pending_reply** link = &G_REACTOR.pending_replies;
+  while (*link && !((*link)->id == id && (*link)->addr.sin_addr.s_addr == sender_addr->sin_addr.s_addr)) link = &(*link)->next;
+  pending_reply* reply = *link;
+  if (!reply) return;
+  if (reply->attempts == 1) record_rtt_sample(reply->addr.sin_addr, monotonic_ms() - reply->first_sent_ms);
+  *link = reply->next;
+  free(reply);
+}
+
+// Re-sends every reply whose timeout ran out, doubling its timeout each time, and gives up on a
+// node that has not answered any of them.
+void retransmit_control_replies(void)
+{
+  long long now = monotonic_ms();
+  pending_reply** link = &G_REACTOR.pending_replies;
+  while (*link)
+  {
+    pending_reply* reply = *link;
+    if (reply->due_ms > now) 
+    {
+      link = &reply->next;
+      continue;
+    }
+    if (reply->attempts == CONTROL_MAX_ATTEMPTS) 
+    {
+      char ip[MAX_IP_LENGTH];
+      inet_ntop(AF_INET, &reply->addr.sin_addr, ip, sizeof(ip));
+      fprintf(stderr, "Reply to %s was never acknowledged; gave up after %d attempts.\n", ip, reply->attempts);
+      *link = reply->next;
+      free(reply);
+      continue;
+    }
+    send_control(reply->fd, &reply->addr, &reply->frame);
+    reply->attempts++;
+    reply->rto_ms = reply->rto_ms * 2 > CONTROL_RTO_MAX_MS ? CONTROL_RTO_MAX_MS : reply->rto_ms * 2;
+    reply->due_ms = now + reply->rto_ms;
+    link = &reply->next;
+  }
+}
+
+// How long the reactor may sleep before a reply is due for re-sending, at most a second.
+int next_retransmit_wait_ms(void)
+{
+  long long now = monotonic_ms();
+  long long wait = 1000;
+  for (pending_reply* reply = G_REACTOR.pending_replies; reply; reply = reply->next) 
+  {
+    if (reply->due_ms - now < wait) wait = reply->due_ms - now;
+  }
+  return wait < 0 ? 0 : (int)wait;
+}
+
+// A reply goes back the way its request came: on the node's session, or as a datagram. Answers to
+// a transfer announcement go to the asking socket as they are, since the asker re-sends the
+// announcement until one arrives; replies to a node's listening port are sent reliably.
+void send_control_reply(reactor_conn* control, const struct sockaddr_in* recipient_addr, int reply_port, const control_frame* message)
+{
+  if (control->kind == CONN_SESSION)
+  {
+    session_send(control, message);
+    return;
+  }
+  struct sockaddr_in reply_addr = *recipient_addr;
+  if (reply_port > 0) 
+  {
+    reply_addr.sin_port = htons(reply_port);
+    send_reliable_reply(control->fd, &reply_addr, message);
+    return;
+  }
+  send_control(control->fd, &reply_addr, message);
+}
+
+// Answers meant for the user, such as errors and BUSY for a command, travel as TEXT.
+void send_control_text(reactor_conn* control, const struct sockaddr_in* recipient_addr, int reply_port, const char* text)
+{
+  control_frame reply;
+  control_begin(&reply, CONTROL_TEXT);
+  control_put_string(&reply, FIELD_TEXT, text);
+  send_control_reply(control, recipient_addr, reply_port, &reply);
+}
+
+// Command, Reply & Worker Jobs
+bool listing_flush(listing_writer* writer)
+{
+  size_t sent = 0;
+  while (sent < writer->length)
+  {
+    ssize_t n = send(writer->sock, writer->data + sent, writer->length - sent, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    sent += n;
+  }
+  writer->length = 0;
+  return true;
+}
+
+bool listing_printf(listing_writer* writer, const char* format, ...)
+{
+  for (int attempt = 0; attempt < 2 && !writer->stopped; ++attempt)
+  {
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(writer->data + writer->length, writer->capacity - writer->length, format, args);
+    va_end(args);
+    if (n < 0) break;
+    if ((size_t)n < writer->capacity - writer->length) 
+    {
+      writer->length += n;
+      return true;
+    }
+    writer->data[writer->length] = '\0';
+    if (writer->length == 0 || !listing_flush(writer)) break;
+  }
+  writer->stopped = true;
+  return false;
+}
+
+// Pages through the caller's files (or every file, for the SU) and returns how many were written.
+// Each page is reset before the next so a long listing never pins an old snapshot of the WAL.
+bool parse_size(const char* text, long long* size)
+{
+  char* end;
+  errno = 0;
+  long long value = strtoll(text, &end, 10);
+  if (errno || end == text || value < 0) return false;
+  int shift = 0;
+  if (*end == 'K' || *end == 'k') shift = 10;
+  else if (*end == 'M' || *end == 'm') shift = 20;
+  else if (*end == 'G' || *end == 'g') shift = 30;
+  if (shift) end++;
+  if (*end != '\0' || value > (LLONG_MAX >> shift)) return false;
+  *size = value << shift;
+  return true;
+}
+
+bool parse_listing_filter(char* options, listing_filter* filter, char* error, size_t error_size)
+{
+  *filter = (listing_filter){ .min_size = -1, .max_size = -1 };
+  char* saveptr;
+  for (char* option = options ? strtok_r(options, " ", &saveptr) : NULL; option; option = strtok_r(NULL, " ", &saveptr))
+  {
+    long long newest = 0;
+    bool ok = true;
+    if (strncmp(option, "name=", 5) == 0) 
+    {
+      ok = option[5] && strlen(option + 5) < sizeof(filter->pattern);
+      if (ok) strcpy(filter->pattern, option + 5);
+    }
+    else if (strncmp(option, "min=", 4) == 0) ok = parse_size(option + 4, &filter->min_size);
+    else if (strncmp(option, "max=", 4) == 0) ok = parse_size(option + 4, &filter->max_size);
+    else if (strncmp(option, "newest=", 7) == 0) 
+    {
+      ok = parse_size(option + 7, &newest) && newest > 0 && newest <= INT_MAX;
+      filter->newest = (int)newest;
+    }
+    else if (strcmp(option, "totals") == 0) filter->totals_only = true;
+    else ok = false;
+    if (!ok) 
+    {
+      snprintf(error, error_size, "Bad listing option '%s'. %s", option, LISTING_OPTIONS_USAGE);
+      return false;
+    }
+  }
+  return true;
+}
+
+void bind_listing_filter(sqlite3_stmt* stmt, const char* owner_ip, const listing_filter* filter)
+{
+  sqlite3_bind_text(stmt, 1, owner_ip, -1, SQLITE_STATIC);
+  if (filter->pattern[0]) sqlite3_bind_text(stmt, 2, filter->pattern, -1, SQLITE_STATIC);
+  if (filter->min_size >= 0) sqlite3_bind_int64(stmt, 3, filter->min_size);
+  if (filter->max_size >= 0) sqlite3_bind_int64(stmt, 4, filter->max_size);
+}
+
+// Pages through the caller's files (or every file, for the SU) that pass the filter and returns
+// how many were written; newest-N walks the same pages backwards. Each page is reset before the
+// next so a long listing never pins an old snapshot of the WAL.
+long long write_file_records(listing_writer* writer, const char* owner_ip, bool for_su, const listing_filter* filter)
+{
+  bool newest_first = filter->newest > 0;
+  long long written = 0, cursor = newest_first ? LLONG_MAX : 0;
+  reader_statement which = for_su ? (newest_first ? READER_FILES_PAGE_DESC : READER_FILES_PAGE) : (newest_first ? READER_OWNER_FILES_PAGE_DESC : READER_OWNER_FILES_PAGE);
+  while (!writer->stopped)
+  {
+    int page_rows = LISTING_PAGE_ROWS;
+    if (newest_first && filter->newest - written < page_rows) page_rows = (int)(filter->newest - written);
+    if (page_rows <= 0) break;
+    sqlite3_stmt* stmt = db_reader_statement(which);
+    if (!stmt) break;
+    bind_listing_filter(stmt, owner_ip, filter);
+    sqlite3_bind_int64(stmt, 5, cursor);
+    sqlite3_bind_int(stmt, 6, page_rows);
+    int rows = 0;
+    while (sqlite3_step(stmt) == SQLITE_ROW) 
+    {
+      rows++;
+      char size_text[24] = "-", stored_text[24] = "-";
+      if (sqlite3_column_type(stmt, 3) != SQLITE_NULL) snprintf(size_text, sizeof(size_text), "%lld", (long long)sqlite3_column_int64(stmt, 3));
+      if (sqlite3_column_type(stmt, 4) != SQLITE_NULL) 
+      {
+        time_t stored_at = (time_t)sqlite3_column_int64(stmt, 4);
+        struct tm stored_tm;
+        if (localtime_r(&stored_at, &stored_tm)) strftime(stored_text, sizeof(stored_text), "%Y-%m-%d %H:%M", &stored_tm);
+      }
+      if (!listing_printf(writer, "File: %-40s | Owner: %-15s | Size: %12s | Stored: %s\n", sqlite3_column_text(stmt, 1), sqlite3_column_text(stmt, 2), size_text, stored_text)) break;
+      cursor = sqlite3_column_int64(stmt, 0);
+      written++;
+    }
+    sqlite3_reset(stmt);
+    if (rows < page_rows) break;
+  }
+  return written;
+}
+
+// Answers 'totals' with one aggregate over the same filters, so no rows cross the wire.
+bool write_file_totals(listing_writer* writer, const char* owner_ip, bool for_su, const listing_filter* filter)
+{
+  sqlite3_stmt* stmt = db_reader_statement(for_su ? READER_FILES_TOTALS : READER_OWNER_FILES_TOTALS);
+  if (!stmt) return false;
+  bind_listing_filter(stmt, owner_ip, filter);
+  bool ok = sqlite3_step(stmt) == SQLITE_ROW;
+  if (ok) ok = listing_printf(writer, "%s %lld file(s), %lld bytes in total.\n", LISTING_END_MARKER, (long long)sqlite3_column_int64(stmt, 0), (long long)sqlite3_column_int64(stmt, 1));
+  sqlite3_reset(stmt);
+  return ok;
+}
+
+// Streams the whole listing, then an end line that tells the client nothing was cut off.
+void stream_file_records(int sock, const char* owner_ip, bool for_su, const listing_filter* filter)
+{
+  char* buffer = malloc(LISTING_BUFFER_SIZE);
+  if (!buffer) return;
+  listing_writer writer = { .sock = sock, .data = buffer, .capacity = LISTING_BUFFER_SIZE };
+  if (filter->totals_only) 
+  {
+    if (!write_file_totals(&writer, owner_ip, for_su, filter) || !listing_flush(&writer)) fprintf(stderr, "Listing for %s ended early.\n", owner_ip);
+    free(buffer);
+    return;
+  }
+  long long written = write_file_records(&writer, owner_ip, for_su, filter);
+  if (!writer.stopped) 
+  {
+    if (written == 0) listing_printf(&writer, "No files found.\n");
+    listing_printf(&writer, "%s %lld file(s).\n", LISTING_END_MARKER, written);
+  }
+  if (writer.stopped || !listing_flush(&writer)) fprintf(stderr, "Listing for %s ended early.\n", owner_ip);
+  free(buffer);
+}
+
+void send_file_records_job(void* arg)
+{
+  records_request* request = (records_request*)arg;
+  stream_file_records(request->sock, request->owner_ip, request->for_su, &request->filter);
+  close(request->sock);
+  free(request);
+}
+
+void record_upload(metadata_op* op)
+{
+  char hash[SHA256_HEX_LENGTH + 1];
+  // A 'K' verdict promises the file outlives a crash, so its data is on disk before it is filed
+  int fd = open(op->path, O_RDONLY | O_CLOEXEC);
+  bool synced = fd >= 0 && fdatasync(fd) == 0;
+  if (fd >= 0) close(fd);
+  if (!synced || !sha256_file(op->path, hash)) 
+  {
+    perror("hash upload");
+    remove(op->path);
+    settle_metadata_ops(op);
+    return;
+  }
+  if (op->hash[0] && strcmp(op->hash, hash) != 0) fprintf(stderr, "Warning: '%s' from %s does not match the hash its sender offered.\n", op->filename, op->owner_ip);
+  strcpy(op->hash, hash);
+  submit_metadata(op);
+}
+
+// Metadata Writer
+// Hands settled changes back to the reactor. A change that never reached the writer, such as an
+// upload that could not be hashed, is settled here too, failed, so whoever waits on it hears.
+void settle_metadata_ops(metadata_op* batch)
+{
+  pthread_mutex_lock(&G_METADATA.done_mutex);
+  metadata_op** link = &G_METADATA.done;
+  while (*link) link = &(*link)->next;
+  *link = batch;
+  pthread_mutex_unlock(&G_METADATA.done_mutex);
+  uint64_t one = 1;
+  if (write(G_METADATA.event_fd, &one, sizeof(one)) < 0) perror("eventfd write");
+}
+
+metadata_op* new_metadata_op(metadata_kind kind, const char* filename, const char* owner_ip)
+{
+  metadata_op* op = calloc(1, sizeof(metadata_op));
+  if (!op) return NULL;
+  op->kind = kind;
+  op->crc = -1;
+  if (filename) strncpy(op->filename, filename, sizeof(op->filename) - 1);
+  if (owner_ip) strncpy(op->owner_ip, owner_ip, sizeof(op->owner_ip) - 1);
+  return op;
+}
+
+bool start_metadata_writer(int batch_limit, int delay_ms)
+{
+  G_METADATA.batch_limit = batch_limit;
+  G_METADATA.delay_ms = delay_ms;
+  G_METADATA.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (G_METADATA.event_fd < 0) 
+  {
+    perror("eventfd");
+    return false;
+  }
+  if (pthread_create(&G_METADATA.thread, NULL, metadata_writer_thread_func, NULL) != 0) return false;
+  printf("Metadata writer started, committing up to %d changes per %d ms.\n", batch_limit, delay_ms);
+  return true;
+}
+
+// Never refuses: a change that was not queued would leave the stored files and records apart.
+void submit_metadata(metadata_op* op)
+{
+  op->submitted_us = monotonic_us();
+  pthread_mutex_lock(&G_METADATA.mutex);
+  if (G_METADATA.tail) G_METADATA.tail->next = op;
+  else G_METADATA.head = op;
+  G_METADATA.tail = op;
+  G_METADATA.count++;
+  pthread_cond_signal(&G_METADATA.not_empty);
+  pthread_mutex_unlock(&G_METADATA.mutex);
+}
+
+bool apply_metadata_op(metadata_op* op)
+{
+  char path[MAX_FILEPATH_LENGTH];
+  switch (op->kind)
+  {
+    case METADATA_RECORD_UPLOAD:
+    {
+      // Filing the blob here keeps it in step with the releases this thread makes. It is filed
+      // only once its reference is in place, and commit_metadata_batch takes it back if the batch
+      // does not commit.
+      blob_path(op->hash, path, sizeof(path));
+      op->duplicate = access(path, F_OK) == 0;
+      bool ok = db_reference_blob(op, false);
+      if (ok && !op->duplicate && rename(op->path, path) < 0) 
+      {
+        perror("rename blob");
+        ok = false;
+      }
+      if (!ok || op->duplicate) remove(op->path);
+      return ok;
+    }
+    case METADATA_REFERENCE_STORED:
+      return db_reference_blob(op, true);
+    case METADATA_DELETE_FBACK:
+    {
+      sqlite3_stmt* stmt = db_writer(WRITER_FILE_DELETE);
+      sqlite3_bind_text(stmt, 1, op->filename, -1, SQLITE_STATIC);
+      sqlite3_bind_text(stmt, 2, op->owner_ip, -1, SQLITE_STATIC);
+      bool found = sqlite3_step(stmt) == SQLITE_ROW;
+      char hash[SHA256_HEX_LENGTH + 1] = "";
+      const char* hash_text = found ? (const char*)sqlite3_column_text(stmt, 0) : NULL;
+      if (hash_text) strncpy(hash, hash_text, sizeof(hash) - 1);
+      if (!found) fprintf(stderr, "DB delete failed: %s\n", sqlite3_errmsg(G_DB));
+      sqlite3_reset(stmt);
+      if (found) db_release_reference(op, hash[0] ? hash : NULL);
+      return found;
+    }
+    case METADATA_CLEAR:
+      return db_clear_all_records();
+  }
+  return false;
+}
+
+// One transaction for the whole batch, with a savepoint per change so a change that fails is
+// undone alone. Nothing is removed from disk until the commit has returned.
+void commit_metadata_batch(metadata_op* batch)
+{
+  bool committed = db_exec_writer(WRITER_BEGIN);
+  bool cleared = false, filed = false;
+  for (metadata_op* op = batch; committed && op; op = op->next)
+  {
+    if (!db_exec_writer(WRITER_SAVEPOINT)) 
+    {
+      op->ok = false;
+      continue;
+    }
+    op->ok = apply_metadata_op(op);
+    if (!op->ok) db_exec_writer(WRITER_ROLLBACK_TO);
+    db_exec_writer(WRITER_RELEASE);
+    cleared = cleared || (op->ok && op->kind == METADATA_CLEAR);
+    filed = filed || (op->ok && op->kind == METADATA_RECORD_UPLOAD && !op->duplicate);
+  }
+  // New blobs' names must be durable before any record pointing at them is
+  if (committed && filed && !sync_directory(BLOB_DIRECTORY)) 
+  {
+    perror("fsync blobs");
+    db_exec_writer(WRITER_ROLLBACK);
+    committed = false;
+  }
+  if (committed && !db_exec_writer(WRITER_COMMIT)) 
+  {
+    fprintf(stderr, "DB commit failed: %s\n", sqlite3_errmsg(G_DB));
+    db_exec_writer(WRITER_ROLLBACK);
+    committed = false;
+  }
+  long long committed_us = monotonic_us();
+  for (metadata_op* op = batch; op; op = op->next)
+  {
+    if (!committed && op->ok && op->kind == METADATA_RECORD_UPLOAD && !op->duplicate) 
+    {
+      // The blob this op filed has no reference left once its transaction is gone
+      char path[MAX_FILEPATH_LENGTH];
+      blob_path(op->hash, path, sizeof(path));
+      remove(path);
+    }
+    if (!committed) op->ok = false;
+    else if (op->ok) discard_released_files(op);
+    histogram_record(&G_DB_METRICS.op, committed_us - op->submitted_us);
+  }
+  if (committed && cleared) remove_unreferenced_blobs();
+}
+
+void* metadata_writer_thread_func(void* arg)
+{
+  (void)arg;
+  while (true)
+  {
+    pthread_mutex_lock(&G_METADATA.mutex);
+    while (G_METADATA.count == 0 && !G_METADATA.stopping) pthread_cond_wait(&G_METADATA.not_empty, &G_METADATA.mutex);
+    if (G_METADATA.count == 0) 
+    {
+      pthread_mutex_unlock(&G_METADATA.mutex);
+      break;
+    }
+    // Hold the batch open until it is full or the oldest change has waited long enough
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += (long)G_METADATA.delay_ms * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+    while (G_METADATA.count < G_METADATA.batch_limit && !G_METADATA.stopping)
+    {
+      if (pthread_cond_timedwait(&G_METADATA.not_empty, &G_METADATA.mutex, &deadline) == ETIMEDOUT) break;
+    }
+    metadata_op* batch = G_METADATA.head;
+    metadata_op* last = batch;
+    for (int i = 1; i < G_METADATA.batch_limit && last->next; ++i) last = last->next;
+    G_METADATA.head = last->next;
+    if (!G_METADATA.head) G_METADATA.tail = NULL;
+    for (metadata_op* op = batch; op != last->next; op = op->next) G_METADATA.count--;
+    last->next = NULL;
+    pthread_mutex_unlock(&G_METADATA.mutex);
+
+    long long commit_started_us = monotonic_us();
+    commit_metadata_batch(batch);
+    histogram_record(&G_DB_METRICS.commit, monotonic_us() - commit_started_us);
+
+    settle_metadata_ops(batch);
+  }
+  return NULL;
+}
+
+// Lets the writer drain what is queued, then reports the last changes before the database closes.
+void stop_metadata_writer(void)
+{
+  pthread_mutex_lock(&G_METADATA.mutex);
+  G_METADATA.stopping = true;
+  pthread_cond_signal(&G_METADATA.not_empty);
+  pthread_mutex_unlock(&G_METADATA.mutex);
+  pthread_join(G_METADATA.thread, NULL);
+  finish_metadata_ops(NULL);
+}
+
+void report_metadata_op(metadata_op* op)
+{
+  switch (op->kind)
+  {
+    case METADATA_RECORD_UPLOAD:
+      if (op->ok) printf("DB record inserted for '%s'%s.\n", op->filename, op->duplicate ? " (content already stored)" : "");
+      else fprintf(stderr, "DB record for '%s' from %s was not saved.\n", op->filename, op->owner_ip);
+      if (op->stream && op->in_batch) settle_batch_file(op->stream, op->ok);
+      else if (op->stream) send_record_verdict(op->stream, op->ok);
+      break;
+    case METADATA_REFERENCE_STORED:
+    {
+      // A session that closed meanwhile has no one left to answer
+      if (op->control->closed) break;
+      char sender_ip_str[MAX_IP_LENGTH];
+      inet_ntop(AF_INET, &op->reply_addr.sin_addr, sender_ip_str, sizeof(sender_ip_str));
+      if (!op->ok) 
+      {
+        // Not stored after all, so the content has to be sent
+        if (!G_EXIT_REQUEST) handle_upload_request(op->control, op->request, &op->reply_addr, sender_ip_str, true);
+        break;
+      }
+      printf("File '%s' from %s matches stored content; no transfer needed.\n", op->filename, op->owner_ip);
+      control_frame reply;
+      control_begin(&reply, CONTROL_STORED);
+      control_put_u64(&reply, FIELD_TRANSFER_ID, op->request->transfer_id);
+      send_control_reply(op->control, &op->reply_addr, 0, &reply);
+      break;
+    }
+    case METADATA_DELETE_FBACK:
+      if (op->ok) printf("DB record for '%s' deleted.\n", op->filename);
+      break;
+    case METADATA_CLEAR:
+      if (op->ok) printf("All file records cleared from database.\n");
+      break;
+  }
+}
+
+// Runs on the reactor thread when the writer signals that a batch is settled.
+void finish_metadata_ops(reactor_conn* conn)
+{
+  uint64_t settled;
+  if (conn && read(conn->fd, &settled, sizeof(settled)) < 0) return;
+  pthread_mutex_lock(&G_METADATA.done_mutex);
+  metadata_op* op = G_METADATA.done;
+  G_METADATA.done = NULL;
+  pthread_mutex_unlock(&G_METADATA.done_mutex);
+  while (op)
+  {
+    metadata_op* next = op->next;
+    report_metadata_op(op);
+    if (op->control) release_conn(op->control);
+    if (op->stream) release_conn(op->stream);
+    free(op->request);
+    free(op);
+    op = next;
+  }
+}
+
+// Reactor
+bool reactor_add(reactor_conn* conn, uint32_t events)
+{
+  struct epoll_event event = { .events = events, .data.ptr = conn };
+  if (epoll_ctl(G_REACTOR.epoll_fd, EPOLL_CTL_ADD, conn->fd, &event) < 0) 
+  {
+    perror("epoll_ctl add");
+    return false;
+  }
+  return true;
+}
+
+void reactor_set_events(reactor_conn* conn, uint32_t events)
+{
+  struct epoll_event event = { .events = events, .data.ptr = conn };
+  epoll_ctl(G_REACTOR.epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+}
+
+// Binds a non-blocking socket on the given port and registers it with the reactor.
+reactor_conn* reactor_open_listener(conn_kind kind, int type, int port, bool is_su_listener)
+{
+  int fd = socket(AF_INET, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  int opt = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+  struct sockaddr_in listen_addr = { .sin_family = AF_INET, .sin_addr.s_addr = INADDR_ANY, .sin_port = htons(port) };
+  if (fd < 0 || bind(fd, (struct sockaddr*)&listen_addr, sizeof(listen_addr)) < 0 || (type == SOCK_STREAM && listen(fd, SOMAXCONN) < 0)) 
+  {
+    perror("listener bind");
+    if (fd >= 0) close(fd);
+    return NULL;
+  }
+  reactor_conn* conn = calloc(1, sizeof(reactor_conn));
+  conn->kind = kind;
+  conn->fd = fd;
+  conn->is_su_listener = is_su_listener;
+  // The SU broadcasts to these ports through its multicast group
+  if (is_su_listener && type == SOCK_DGRAM) join_control_group(fd);
+  if (!reactor_add(conn, EPOLLIN)) 
+  {
+    close(fd);
+    free(conn);
+    return NULL;
+  }
+  printf("%s listener started on port %d.\n", type == SOCK_STREAM ? "TCP" : "UDP", port);
+  return conn;
+}
+
+// A connection that a metadata change still points at outlives its socket until the change has
+// been reported.
+void release_conn(reactor_conn* conn)
+{
+  if (--conn->holds == 0 && conn->closed) retire_conn(conn);
+}
+
+// A closed connection may still have events waiting later in the batch epoll_wait returned, so
+// it is only freed once that batch has been handled.
+void retire_conn(reactor_conn* conn)
+{
+  conn->next = G_REACTOR.retired_conns;
+  G_REACTOR.retired_conns = conn;
+}
+
+void free_retired_conns(void)
+{
+  while (G_REACTOR.retired_conns)
+  {
+    reactor_conn* next = G_REACTOR.retired_conns->next;
+    free(G_REACTOR.retired_conns);
+    G_REACTOR.retired_conns = next;
+  }
+}
+
+// Settles whatever transfer the connection was carrying, leaving the socket itself alone.
+void finish_data_stream(reactor_conn* conn)
+{
+  if (conn->file_fd >= 0) close(conn->file_fd);
+  // A batch file cut off mid-way is dropped; the sender's next batch carries it again
+  if (conn->transfer && conn->transfer->direction == TRANSFER_BATCH && conn->file_fd >= 0) remove(conn->batch_path);
+  if (conn->pipe_fds[0] >= 0) 
+  {
+    close(conn->pipe_fds[0]);
+    close(conn->pipe_fds[1]);
+  }
+  if (conn->transfer && conn->transfer->direction == TRANSFER_INBOUND && (conn->state == DATA_RECEIVING || conn->state == DATA_AWAIT_CHECKSUM || conn->state == DATA_DONE)) 
+  {
+    conn->transfer->stripe_have[conn->stream_index] = conn->file_offset - conn->stripe_start;
+  }
+  if (conn->transfer) end_transfer_stream(conn->transfer, conn->state == DATA_DONE);
+  free(conn->copy_buffer);
+  free(conn->frame_buffer);
+  if (conn->map) munmap((void*)conn->map, conn->transfer->filesize);
+}
+
+void close_data_conn(reactor_conn* conn)
+{
+  if (conn->kind == CONN_SESSION) 
+  {
+    close_session(conn);
+    return;
+  }
+  epoll_ctl(G_REACTOR.epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+  close(conn->fd);
+  finish_data_stream(conn);
+  reactor_conn** link = &G_REACTOR.data_conns;
+  while (*link && *link != conn) link = &(*link)->next;
+  if (*link) *link = conn->next;
+  conn->closed = true;
+  if (conn->holds == 0) retire_conn(conn);
+}
+
+// A stream that finished cleanly waits for another hello on the same socket, so its client can
+// start the next transfer without a new handshake and on a window that is already open.
+bool recycle_data_conn(reactor_conn* conn)
+{
+  finish_data_stream(conn);
+  *conn = (reactor_conn){ .kind = CONN_DATA, .fd = conn->fd, .state = DATA_AWAIT_HELLO, .peer_addr = conn->peer_addr, .file_fd = -1, .pipe_fds = { -1, -1 }, .holds = conn->holds, .last_activity = conn->last_activity, .next = conn->next };
+  reactor_set_events(conn, EPOLLIN | EPOLLRDHUP);
+  return true;
+}
+
+// Settles an upload's last stripe while holding back its verdict, which report_metadata_op sends
+// once the record has committed. An upload that could not be handed to the writer is refused now.
+bool await_upload_record(reactor_conn* conn)
+{
+  conn->transfer->verdict_stream = conn;
+  recycle_data_conn(conn);
+  if (conn->holds == 0)
+  {
+    char verdict = TRANSFER_VERDICT_BAD;
+    send(conn->fd, &verdict, 1, MSG_NOSIGNAL);
+    return false;
+  }
+  conn->state = DATA_AWAIT_RECORD;
+  reactor_set_events(conn, EPOLLRDHUP);
+  return true;
+}
+
+void send_record_verdict(reactor_conn* conn, bool ok)
+{
+  // A sender that hung up meanwhile will announce the file again
+  if (conn->closed) return;
+  char verdict = ok ? TRANSFER_VERDICT_OK : TRANSFER_VERDICT_BAD;
+  if (send(conn->fd, &verdict, 1, MSG_NOSIGNAL) != 1 || !ok)
+  {
+    close_data_conn(conn);
+    return;
+  }
+  conn->state = DATA_AWAIT_HELLO;
+  reactor_set_events(conn, EPOLLIN | EPOLLRDHUP);
+}
+
+// Sessions
+// Turns a connection whose hello asks for a session into its node's control channel. The SU is
+// recognised by its address.
+bool start_session(reactor_conn* conn)
+{
+  char peer_ip[MAX_IP_LENGTH];
+  inet_ntop(AF_INET, &conn->peer_addr.sin_addr, peer_ip, sizeof(peer_ip));
+  if (!(conn->session_in = malloc(SESSION_BUFFER_SIZE))) return false;
+  conn->kind = CONN_SESSION;
+  conn->is_su_listener = conn->peer_addr.sin_addr.s_addr == G_SU_ADDR.s_addr;
+  // Replies are small and awaited one at a time, so none should sit waiting for more to join it
+  int nodelay = 1;
+  setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+  printf("Session opened with %s.\n", peer_ip);
+  return true;
+}
+
+// Writes what the session has queued until the socket is full. Returns false once it has failed.
+bool flush_session(reactor_conn* conn)
+{
+  size_t sent = 0;
+  while (sent < conn->session_out_length)
+  {
+    ssize_t n = send(conn->fd, conn->session_out + sent, conn->session_out_length - sent, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+    if (n <= 0) return false;
+    sent += n;
+  }
+  memmove(conn->session_out, conn->session_out + sent, conn->session_out_length - sent);
+  conn->session_out_length -= sent;
+  bool writing = conn->session_out_length > 0;
+  if (writing != conn->session_writing) reactor_set_events(conn, EPOLLIN | EPOLLRDHUP | (writing ? EPOLLOUT : 0));
+  conn->session_writing = writing;
+  return true;
+}
+
+// Queues one frame for the session's node and sends what the socket takes now. A node that stops
+// reading is cut off rather than buffered for; the shutdown surfaces as a hangup on the next wakeup.
+void session_send(reactor_conn* conn, const control_frame* message)
+{
+  if (conn->closed || message->invalid) return;
+  size_t needed = conn->session_out_length + message->length;
+  if (needed > SESSION_OUTPUT_LIMIT) 
+  {
+    shutdown(conn->fd, SHUT_RDWR);
+    return;
+  }
+  if (needed > conn->session_out_capacity)
+  {
+    size_t capacity = conn->session_out_capacity ? conn->session_out_capacity : SESSION_BUFFER_SIZE;
+    while (capacity < needed) capacity *= 2;
+    char* grown = realloc(conn->session_out, capacity);
+    if (!grown) 
+    {
+      shutdown(conn->fd, SHUT_RDWR);
+      return;
+    }
+    conn->session_out = grown;
+    conn->session_out_capacity = capacity;
+  }
+  memcpy(conn->session_out + conn->session_out_length, message->data, message->length);
+  conn->session_out_length = needed;
+  if (!flush_session(conn)) shutdown(conn->fd, SHUT_RDWR);
+}
+
+// Runs every complete frame the node has sent as if it had arrived as a datagram on its port.
+bool handle_session_readable(reactor_conn* conn)
+{
+  char peer_ip[MAX_IP_LENGTH];
+  inet_ntop(AF_INET, &conn->peer_addr.sin_addr, peer_ip, sizeof(peer_ip));
+  control_message message;
+  while (true)
+  {
+    ssize_t n = recv(conn->fd, conn->session_in + conn->session_in_length, SESSION_BUFFER_SIZE - conn->session_in_length, 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+    if (n <= 0) return false;
+    // A node the SU has removed loses its session at its next frame
+    if (!ip_set_contains(&G_MEMBERS, conn->peer_addr.sin_addr))
+    {
+      printf("SECURITY ALERT: Closed session with %s, which is no longer in the network.\n", peer_ip);
+      return false;
+    }
+    conn->session_in_length += n;
+    size_t offset = 0;
+    int frame_length;
+    while ((frame_length = control_decode((const uint8_t*)conn->session_in + offset, conn->session_in_length - offset, &message)) > 0)
+    {
+      offset += frame_length;
+      if (message.type == CONTROL_PING) 
+      {
+        control_frame pong;
+        control_begin(&pong, CONTROL_PONG);
+        session_send(conn, &pong);
+      }
+      else handle_control_message(conn, &message, &conn->peer_addr, peer_ip);
+    }
+    if (frame_length < 0) 
+    {
+      fprintf(stderr, "Session with %s sent a malformed frame, closed.\n", peer_ip);
+      return false;
+    }
+    memmove(conn->session_in, conn->session_in + offset, conn->session_in_length - offset);
+    conn->session_in_length -= offset;
+  }
+}
+
+void close_session(reactor_conn* conn)
+{
+  char peer_ip[MAX_IP_LENGTH];
+  inet_ntop(AF_INET, &conn->peer_addr.sin_addr, peer_ip, sizeof(peer_ip));
+  printf("Session with %s closed.\n", peer_ip);
+  epoll_ctl(G_REACTOR.epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+  close(conn->fd);
+  reactor_conn** link = &G_REACTOR.data_conns;
+  while (*link && *link != conn) link = &(*link)->next;
+  if (*link) *link = conn->next;
+  free(conn->session_in);
+  free(conn->session_out);
+  conn->session_in = conn->session_out = NULL;
+  conn->session_out_length = 0;
+  conn->closed = true;
+  if (conn->holds == 0) retire_conn(conn);
+}
+
+void accept_data_connections(reactor_conn* acceptor)
+{
+  while (true)
+  {
+    struct sockaddr_in peer_addr;
+    socklen_t peer_len = sizeof(peer_addr);
+    int data_sock = accept4(acceptor->fd, (struct sockaddr*)&peer_addr, &peer_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (data_sock < 0) 
+    { 
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) perror("TCP accept"); 
+      return; 
+    }
+    if (!ip_set_contains(&G_MEMBERS, peer_addr.sin_addr)) 
+    {
+      char peer_ip[MAX_IP_LENGTH];
+      inet_ntop(AF_INET, &peer_addr.sin_addr, peer_ip, sizeof(peer_ip));
+      printf("SECURITY ALERT: Dropped TCP connection from unauthorized IP: %s\n", peer_ip);
+      close(data_sock);
+      continue;
+    }
+    reactor_conn* conn = calloc(1, sizeof(reactor_conn));
+    conn->kind = CONN_DATA;
+    conn->fd = data_sock;
+    conn->state = DATA_AWAIT_HELLO;
+    conn->peer_addr = peer_addr;
+    conn->file_fd = -1;
+    conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+    conn->last_activity = time(NULL);
+    if (!reactor_add(conn, EPOLLIN | EPOLLRDHUP)) 
+    {
+      close(data_sock);
+      free(conn);
+      continue;
+    }
+    conn->next = G_REACTOR.data_conns;
+    G_REACTOR.data_conns = conn;
+  }
+}
+
+// Binds a complete hello to its announced transfer and switches the connection into
+// receiving (upload) or sending (fback) mode.
+bool start_data_transfer(reactor_conn* conn)
+{
+  if (memcmp(conn->hello.magic, SESSION_MAGIC, sizeof(conn->hello.magic)) == 0) return start_session(conn);
+  if (memcmp(conn->hello.magic, TRANSFER_MAGIC, sizeof(conn->hello.magic)) != 0 ||
+      !(conn->transfer = claim_pending_transfer(&conn->hello, conn->peer_addr.sin_addr))) 
+  {
+    fprintf(stderr, "Dropped data connection for an unknown transfer.\n");
+    return false;
+  }
+  pending_transfer* transfer = conn->transfer;
+  if (transfer->direction == TRANSFER_LISTING) return start_listing_stream(conn);
+  if (transfer->direction == TRANSFER_BATCH)
+  {
+    conn->state = DATA_BATCH_HEADER;
+    return true;
+  }
+  off_t stripe_length;
+  conn->stream_index = ntohs(conn->hello.stream_index);
+  stripe_range(transfer->filesize, transfer->stream_count, conn->stream_index, &conn->stripe_start, &stripe_length);
+  conn->file_offset = conn->stripe_start;
+  conn->bytes_remaining = stripe_length;
+  conn->compress = transfer->compress;
+  if (transfer->direction == TRANSFER_OUTBOUND)
+  {
+    conn->file_fd = open(transfer->stored_path, O_RDONLY | O_CLOEXEC);
+    if (conn->file_fd < 0) 
+    {
+      perror("open fback");
+      return false;
+    }
+    // Checksums read the pages sendfile and splice move through a mapping; without one only the copy path can checksum
+    conn->map = transfer->filesize > 0 ? mmap(NULL, transfer->filesize, PROT_READ, MAP_SHARED, conn->file_fd, 0) : NULL;
+    if (conn->map == MAP_FAILED) conn->map = NULL;
+    conn->mode = conn->compress ? SEND_COMPRESSED : conn->map ? SEND_SENDFILE : SEND_COPY;
+    conn->state = DATA_AWAIT_RESUME;
+    return true;
+  }
+
+  // Tell the sender where this stripe resumes; a fresh socket always has room for 8 bytes
+  off_t resume = transfer->stripe_have[conn->stream_index];
+  uint64_t resume_frame = htobe64(resume);
+  if (send(conn->fd, &resume_frame, sizeof(resume_frame), MSG_NOSIGNAL) != (ssize_t)sizeof(resume_frame)) return false;
+  if (resume > 0) return start_prefix_check(conn, transfer->file_fd, resume);
+  conn->state = DATA_RECEIVING;
+  return true;
+}
+
+// Parks the stream, listening only for a hangup, while a worker checksums the first 'length'
+// bytes of its stripe. Without a free worker the stream is dropped and its sender tries again.
+bool start_prefix_check(reactor_conn* conn, int fd, off_t length)
+{
+  prefix_check* check = calloc(1, sizeof(prefix_check));
+  if (!check) return false;
+  *check = (prefix_check){ .done.finish = finish_prefix_check, .conn = conn, .fd = dup(fd), .offset = conn->stripe_start, .length = length };
+  if (check->fd < 0 || !submit_job(check_prefix_job, check)) 
+  {
+    fprintf(stderr, "No worker free to check the resumed stripe of '%s', dropped.\n", conn->transfer->filename);
+    if (check->fd >= 0) close(check->fd);
+    free(check);
+    return false;
+  }
+  conn->holds++;
+  conn->state = DATA_CHECK_PREFIX;
+  reactor_set_events(conn, EPOLLRDHUP);
+  return true;
+}
+
+void check_prefix_job(void* arg)
+{
+  prefix_check* check = (prefix_check*)arg;
+  check->ok = crc32c_file_range(check->fd, check->offset, check->length, &check->crc);
+  close(check->fd);
+  complete_on_reactor(&check->done);
+}
+
+// Runs on the reactor thread when workers have finished checking resumed stripes.
+// Picks a resumed stripe back up once a worker has checked the prefix it already held.
+void finish_prefix_check(reactor_completion* done)
+{
+  prefix_check* check = (prefix_check*)done;
+  reactor_conn* stream = check->conn;
+  if (!stream->closed) 
+  {
+    stream->crc = check->ok ? check->crc : 0;
+    if (!check->ok || !resume_stripe(stream, check->length)) close_data_conn(stream);
+  }
+  release_conn(stream);
+  free(check);
+}
+
+// Called by a worker to hand finished work back to the reactor thread.
+void complete_on_reactor(reactor_completion* done)
+{
+  pthread_mutex_lock(&G_REACTOR.completed_mutex);
+  done->next = G_REACTOR.completed;
+  G_REACTOR.completed = done;
+  pthread_mutex_unlock(&G_REACTOR.completed_mutex);
+  uint64_t one = 1;
+  if (write(G_REACTOR.completed_event_fd, &one, sizeof(one)) < 0) perror("eventfd write");
+}
+
+// Runs on the reactor thread when workers have handed back finished work.
+void run_completions(reactor_conn* conn)
+{
+  uint64_t settled;
+  if (read(conn->fd, &settled, sizeof(settled)) < 0) return;
+  pthread_mutex_lock(&G_REACTOR.completed_mutex);
+  reactor_completion* done = G_REACTOR.completed;
+  G_REACTOR.completed = NULL;
+  pthread_mutex_unlock(&G_REACTOR.completed_mutex);
+  while (done)
+  {
+    reactor_completion* next = done->next;
+    done->finish(done);
+    done = next;
+  }
 }
 
-bool initialize_database(const char* db_name) 
+// Continues a stripe after the first 'held' bytes, whose checksum conn->crc already holds.
+bool resume_stripe(reactor_conn* conn, off_t held)
 {
-  if (sqlite3_open(db_name, &G_DB)) 
+  conn->file_offset += held;
+  conn->bytes_remaining -= held;
+  if (conn->transfer->direction == TRANSFER_INBOUND) 
   {
-    fprintf(stderr, "DB Error: %s\n", sqlite3_errmsg(G_DB)); 
+    conn->state = DATA_RECEIVING;
+    reactor_set_events(conn, EPOLLIN | EPOLLRDHUP);
+    return true;
+  }
+  conn->state = DATA_SENDING;
+  reactor_set_events(conn, EPOLLOUT);
+  return handle_data_writable(conn);
+}
+
+// Listings are written with blocking sends on a worker, which pages through the catalogue on its
+// own descriptor; the reactor then lets go of the connection. Always returns false for that reason.
+bool start_listing_stream(reactor_conn* conn)
+{
+  records_request* request = calloc(1, sizeof(records_request));
+  if (!request) return false;
+  request->for_su = conn->transfer->list_all;
+  request->filter = conn->transfer->filter;
+  snprintf(request->owner_ip, sizeof(request->owner_ip), "%s", conn->transfer->sender_ip);
+  request->sock = dup(conn->fd);
+  struct timeval stall_timeout = { .tv_sec = DATA_IDLE_TIMEOUT, .tv_usec = 0 };
+  if (request->sock < 0 || fcntl(request->sock, F_SETFL, fcntl(request->sock, F_GETFL) & ~O_NONBLOCK) < 0 ||
+      setsockopt(request->sock, SOL_SOCKET, SO_SNDTIMEO, &stall_timeout, sizeof(stall_timeout)) < 0) 
+  {
+    perror("listing socket");
+    if (request->sock >= 0) close(request->sock);
+    free(request);
     return false;
   }
-  char *err_msg = 0;
-  const char *sql = "CREATE TABLE IF NOT EXISTS StoredFiles (id INTEGER PRIMARY KEY, filename TEXT NOT NULL, owner_ip TEXT NOT NULL, UNIQUE(filename, owner_ip));";
-  if (sqlite3_exec(G_DB, sql, 0, 0, &err_msg) != SQLITE_OK) 
+  if (!submit_job(send_file_records_job, request)) 
   {
-    fprintf(stderr, "SQL error: %s\n", err_msg); sqlite3_free(err_msg); 
+    fprintf(stderr, "Listing for %s dropped, all workers are busy.\n", request->owner_ip);
+    close(request->sock);
+    free(request);
     return false;
   }
-  printf("Database initialized.\n");
+  conn->state = DATA_DONE;
+  return false;
+}
+
+// Compressed uploads arrive as frames; only whole decoded chunks advance file_offset, so an
+// interrupted stripe always resumes on a chunk boundary.
+bool receive_compressed_frames(reactor_conn* conn)
+{
+  if (!conn->frame_buffer && !(conn->frame_buffer = malloc(COMPRESS_FRAME_HEADER + COMPRESS_CHUNK_SIZE))) return false;
+  while (conn->bytes_remaining > 0)
+  {
+    size_t frame_length = COMPRESS_FRAME_HEADER, raw_length = 0, packed_length = 0;
+    if (conn->frame_received >= COMPRESS_FRAME_HEADER)
+    {
+      uint32_t header[2];
+      memcpy(header, conn->frame_buffer, sizeof(header));
+      raw_length = ntohl(header[0]);
+      packed_length = ntohl(header[1]);
+      if (raw_length == 0 || raw_length > COMPRESS_CHUNK_SIZE || (long long)raw_length > conn->bytes_remaining || packed_length > raw_length)
+      {
+        fprintf(stderr, "Upload of '%s' sent a malformed frame, stream dropped.\n", conn->transfer->filename);
+        return false;
+      }
+      frame_length += packed_length;
+    }
+    if (conn->frame_received < frame_length)
+    {
+      if (conn_throttled(conn)) return true;
+      ssize_t n = recv(conn->fd, conn->frame_buffer + conn->frame_received, frame_length - conn->frame_received, 0);
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+      if (n <= 0) 
+      {
+        fprintf(stderr, "Upload of '%s' ended with %lld bytes of its stream missing, discarded.\n", conn->transfer->filename, conn->bytes_remaining);
+        return false;
+      }
+      charge_flow(conn->transfer->flow, n);
+      count_transfer_bytes(conn->transfer, false, n);
+      conn->frame_received += n;
+      continue;
+    }
+    const uint8_t* chunk = conn->frame_buffer + COMPRESS_FRAME_HEADER;
+    if (packed_length < raw_length)
+    {
+      if (!lz_decompress(chunk, packed_length, (uint8_t*)G_REACTOR.io_buffer, raw_length)) 
+      {
+        fprintf(stderr, "Upload of '%s' sent a corrupt compressed frame, stream dropped.\n", conn->transfer->filename);
+        return false;
+      }
+      chunk = (const uint8_t*)G_REACTOR.io_buffer;
+    }
+    if (pwrite(conn->transfer->file_fd, chunk, raw_length, conn->file_offset) != (ssize_t)raw_length) 
+    {
+      perror("pwrite download");
+      return false;
+    }
+    conn->crc = crc32c_update(conn->crc, chunk, raw_length);
+    conn->file_offset += raw_length;
+    conn->bytes_remaining -= raw_length;
+    conn->frame_received = 0;
+  }
+  conn->state = DATA_AWAIT_CHECKSUM;
   return true;
 }
 
-void db_insert_file_record(const char* filename, const char* owner_ip) 
+// Reads into a fixed-size frame across as many wakeups as it takes. Returns 1 once the frame is
+// complete, 0 when the socket has nothing more for now, and -1 when the peer is gone.
+int recv_frame(int sock, void* frame, size_t length, size_t* received)
 {
-  pthread_mutex_lock(&G_DB_MUTEX);
-  const char* sql = "INSERT OR IGNORE INTO StoredFiles (filename, owner_ip) VALUES (?, ?);";
-  sqlite3_stmt* stmt;
-  if (sqlite3_prepare_v2(G_DB, sql, -1, &stmt, 0) == SQLITE_OK) 
+  while (*received < length)
   {
-    sqlite3_bind_text(stmt, 1, filename, -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 2, owner_ip, -1, SQLITE_STATIC);
-    if (sqlite3_step(stmt) != SQLITE_DONE) fprintf(stderr, "DB insert failed: %s\n", sqlite3_errmsg(G_DB));
-    else printf("DB record inserted for '%s'.\n", filename);
-    sqlite3_finalize(stmt);
+    ssize_t n = recv(sock, (char*)frame + *received, length - *received, 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    if (n <= 0) return -1;
+    *received += n;
   }
-  pthread_mutex_unlock(&G_DB_MUTEX);
+  return 1;
 }
 
-void db_clear_all_records() 
+// Files each file of a batch as soon as its checksum is in: it is staged under a name unique to
+// the batch and handed to the same hashing and metadata path as a single upload, so a long batch
+// commits in the writer's groups rather than one transaction per file.
+bool receive_batch_files(reactor_conn* conn)
 {
-  pthread_mutex_lock(&G_DB_MUTEX);
-  char* err_msg = 0;
-  if (sqlite3_exec(G_DB, "DELETE FROM StoredFiles;", 0, 0, &err_msg) != SQLITE_OK) 
+  pending_transfer* transfer = conn->transfer;
+  while (true)
   {
-    fprintf(stderr, "Failed to clear records: %s\n", err_msg); sqlite3_free(err_msg);
-  } 
-  else 
+    if (conn->state == DATA_BATCH_HEADER)
+    {
+      int result = recv_frame(conn->fd, &conn->batch_header, sizeof(conn->batch_header), &conn->batch_received);
+      if (result <= 0) return result == 0;
+      conn->batch_received = 0;
+      uint32_t name_length = ntohl(conn->batch_header.name_length);
+      if (memcmp(conn->batch_header.magic, BATCH_FILE_MAGIC, sizeof(conn->batch_header.magic)) != 0 || name_length >= MAX_FILENAME_LENGTH)
+      {
+        fprintf(stderr, "Batch from %s sent a malformed file header, stream dropped.\n", transfer->sender_ip);
+        return false;
+      }
+      if (name_length == 0) return finish_batch(conn);
+      conn->state = DATA_BATCH_NAME;
+    }
+    if (conn->state == DATA_BATCH_NAME)
+    {
+      size_t name_length = ntohl(conn->batch_header.name_length);
+      int result = recv_frame(conn->fd, conn->batch_name, name_length, &conn->batch_received);
+      if (result <= 0) return result == 0;
+      conn->batch_received = 0;
+      conn->batch_name[name_length] = '\0';
+      // Names are stored flat under the owner's prefix, so anything that could climb out is refused
+      if (strlen(conn->batch_name) != name_length || strchr(conn->batch_name, '/') || strcmp(conn->batch_name, ".") == 0 || strcmp(conn->batch_name, "..") == 0)
+      {
+        fprintf(stderr, "Batch from %s named an unusable file, stream dropped.\n", transfer->sender_ip);
+        return false;
+      }
+      snprintf(conn->batch_path, sizeof(conn->batch_path), "cr_data_storage/%s_%.255s.%016llx-%d.staged", transfer->sender_ip, conn->batch_name, (unsigned long long)transfer->transfer_id, conn->batch_files);
+      mkdir("cr_data_storage", 0755);
+      conn->file_fd = open(conn->batch_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+      if (conn->file_fd < 0)
+      {
+        perror("open batch file");
+        return false;
+      }
+      conn->file_offset = 0;
+      conn->bytes_remaining = (long long)be64toh(conn->batch_header.size);
+      conn->crc = 0;
+      conn->state = DATA_BATCH_DATA;
+    }
+    if (conn->state == DATA_BATCH_DATA)
+    {
+      while (conn->bytes_remaining > 0)
+      {
+        if (conn_throttled(conn)) return true;
+        size_t want = conn->bytes_remaining < REACTOR_IO_BUFFER_SIZE ? (size_t)conn->bytes_remaining : REACTOR_IO_BUFFER_SIZE;
+        ssize_t n = recv(conn->fd, G_REACTOR.io_buffer, flow_quantum(transfer->flow, want), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+        if (n <= 0)
+        {
+          fprintf(stderr, "Batch from %s ended inside '%s', which is discarded.\n", transfer->sender_ip, conn->batch_name);
+          return false;
+        }
+        charge_flow(transfer->flow, n);
+        count_transfer_bytes(transfer, false, n);
+        if (pwrite(conn->file_fd, G_REACTOR.io_buffer, n, conn->file_offset) != n)
+        {
+          perror("pwrite batch file");
+          return false;
+        }
+        conn->crc = crc32c_update(conn->crc, G_REACTOR.io_buffer, n);
+        conn->file_offset += n;
+        conn->bytes_remaining -= n;
+      }
+      conn->state = DATA_BATCH_CHECKSUM;
+    }
+    if (conn->state == DATA_BATCH_CHECKSUM)
+    {
+      int result = recv_frame(conn->fd, conn->trailer, sizeof(conn->trailer), &conn->trailer_done);
+      if (result <= 0) return result == 0;
+      conn->trailer_done = 0;
+      close(conn->file_fd);
+      conn->file_fd = -1;
+      conn->batch_files++;
+      uint32_t checksum_frame;
+      memcpy(&checksum_frame, conn->trailer, sizeof(checksum_frame));
+      metadata_op* op = ntohl(checksum_frame) == conn->crc ? new_metadata_op(METADATA_RECORD_UPLOAD, conn->batch_name, transfer->sender_ip) : NULL;
+      if (op)
+      {
+        strcpy(op->path, conn->batch_path);
+        op->size = conn->file_offset;
+        op->crc = conn->crc;
+        op->stream = conn;
+        op->in_batch = true;
+        conn->holds++;
+        conn->batch_pending++;
+        hash_upload(op);
+      }
+      else
+      {
+        fprintf(stderr, "'%s' in the batch from %s failed its checksum, discarded.\n", conn->batch_name, transfer->sender_ip);
+        remove(conn->batch_path);
+      }
+      conn->state = DATA_BATCH_HEADER;
+    }
+  }
+}
+
+// Ends the batch's stream. Its kept count only covers files whose records have committed, so the
+// stream waits in AWAIT_RECORD until the last of them has settled.
+bool finish_batch(reactor_conn* conn)
+{
+  int files = conn->batch_files, kept = conn->batch_kept, pending = conn->batch_pending;
+  conn->state = DATA_DONE;
+  recycle_data_conn(conn);
+  conn->batch_files = files;
+  conn->batch_kept = kept;
+  conn->batch_pending = pending;
+  if (pending == 0) return send_batch_tally(conn);
+  conn->state = DATA_AWAIT_RECORD;
+  reactor_set_events(conn, EPOLLRDHUP);
+  return true;
+}
+
+void settle_batch_file(reactor_conn* conn, bool ok)
+{
+  conn->batch_pending--;
+  if (ok) conn->batch_kept++;
+  if (!conn->closed && conn->state == DATA_AWAIT_RECORD && conn->batch_pending == 0 && !send_batch_tally(conn)) close_data_conn(conn);
+}
+
+bool send_batch_tally(reactor_conn* conn)
+{
+  char peer_ip[MAX_IP_LENGTH];
+  inet_ntop(AF_INET, &conn->peer_addr.sin_addr, peer_ip, sizeof(peer_ip));
+  printf("Batch of %d file(s) from %s received; %d stored.\n", conn->batch_files, peer_ip, conn->batch_kept);
+  uint32_t kept_frame = htonl(conn->batch_kept);
+  conn->batch_files = conn->batch_kept = 0;
+  conn->state = DATA_AWAIT_HELLO;
+  reactor_set_events(conn, EPOLLIN | EPOLLRDHUP);
+  return send(conn->fd, &kept_frame, sizeof(kept_frame), MSG_NOSIGNAL) == (ssize_t)sizeof(kept_frame);
+}
+
+// Drains whatever the socket holds into this stream's stripe of the upload file. Returns false
+// once the connection is finished.
+bool handle_data_readable(reactor_conn* conn)
+{
+  if (conn->kind == CONN_SESSION) return handle_session_readable(conn);
+  if (conn->state == DATA_AWAIT_HELLO)
+  {
+    while (conn->hello_received < sizeof(conn->hello))
+    {
+      ssize_t n = recv(conn->fd, (char*)&conn->hello + conn->hello_received, sizeof(conn->hello) - conn->hello_received, 0);
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+      if (n <= 0) return false;
+      conn->hello_received += n;
+    }
+    if (!start_data_transfer(conn)) return false;
+    if (conn->kind == CONN_SESSION) return handle_session_readable(conn);
+    if (conn->state == DATA_CHECK_PREFIX) return true;
+  }
+  // Only a hangup wakes a stream that waits on a worker's checksum or on the writer for its verdict
+  if (conn->state == DATA_CHECK_PREFIX || conn->state == DATA_AWAIT_RECORD) return false;
+  if (conn->transfer->direction == TRANSFER_BATCH) return receive_batch_files(conn);
+  if (conn->state == DATA_AWAIT_RESUME)
+  {
+    while (conn->resume_received < sizeof(conn->resume_frame))
+    {
+      ssize_t n = recv(conn->fd, (char*)&conn->resume_frame + conn->resume_received, sizeof(conn->resume_frame) - conn->resume_received, 0);
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+      if (n <= 0) return false;
+      conn->resume_received += n;
+    }
+    uint64_t resume = be64toh(conn->resume_frame);
+    if (resume > (uint64_t)conn->bytes_remaining) return false;
+    if (resume > 0) return start_prefix_check(conn, conn->file_fd, resume);
+    return resume_stripe(conn, 0);
+  }
+  if (conn->state == DATA_AWAIT_VERDICT)
+  {
+    char verdict;
+    ssize_t n = recv(conn->fd, &verdict, 1, 0);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+    if (n == 1 && verdict == TRANSFER_VERDICT_OK) 
+    {
+      conn->transfer->stripe_crc[conn->stream_index] = conn->crc;
+      conn->state = DATA_DONE;
+      return recycle_data_conn(conn);
+    }
+    else if (n == 1) fprintf(stderr, "fback of '%s' failed its checksum at the requester.\n", conn->transfer->filename);
+    return false;
+  }
+  if (conn->state == DATA_AWAIT_CHECKSUM)
+  {
+    while (conn->trailer_done < sizeof(conn->trailer))
+    {
+      ssize_t n = recv(conn->fd, conn->trailer + conn->trailer_done, sizeof(conn->trailer) - conn->trailer_done, 0);
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+      if (n <= 0) return false;
+      conn->trailer_done += n;
+    }
+    uint32_t checksum_frame;
+    memcpy(&checksum_frame, conn->trailer, sizeof(checksum_frame));
+    char verdict = ntohl(checksum_frame) == conn->crc ? TRANSFER_VERDICT_OK : TRANSFER_VERDICT_BAD;
+    if (verdict != TRANSFER_VERDICT_OK)
+    {
+      // Nothing in a damaged stripe can be trusted, so the next attempt sends all of it
+      send(conn->fd, &verdict, 1, MSG_NOSIGNAL);
+      fprintf(stderr, "Upload of '%s' failed its checksum; the stripe will be sent again in full.\n", conn->transfer->filename);
+      conn->file_offset = conn->stripe_start;
+      return false;
+    }
+    conn->transfer->stripe_crc[conn->stream_index] = conn->crc;
+    conn->state = DATA_DONE;
+    if (!conn->transfer->failed && conn->transfer->streams_finished + 1 == conn->transfer->stream_count) return await_upload_record(conn);
+    send(conn->fd, &verdict, 1, MSG_NOSIGNAL);
+    return recycle_data_conn(conn);
+  }
+  if (conn->state != DATA_RECEIVING) return false;
+  if (conn->compress) return receive_compressed_frames(conn);
+
+  while (conn->bytes_remaining > 0)
   {
-    printf("All file records cleared from database.\n");
+    if (conn_throttled(conn)) return true;
+    size_t want = conn->bytes_remaining < REACTOR_IO_BUFFER_SIZE ? (size_t)conn->bytes_remaining : REACTOR_IO_BUFFER_SIZE;
+    ssize_t n = recv(conn->fd, G_REACTOR.io_buffer, flow_quantum(conn->transfer->flow, want), 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+    if (n <= 0) 
+    {
+      fprintf(stderr, "Upload of '%s' ended with %lld bytes of its stream missing, discarded.\n", conn->transfer->filename, conn->bytes_remaining);
+      return false;
+    }
+    charge_flow(conn->transfer->flow, n);
+    count_transfer_bytes(conn->transfer, false, n);
+    if (pwrite(conn->transfer->file_fd, G_REACTOR.io_buffer, n, conn->file_offset) != n) 
+    {
+      perror("pwrite download");
+      return false;
+    }
+    conn->crc = crc32c_update(conn->crc, G_REACTOR.io_buffer, n);
+    conn->file_offset += n;
+    conn->bytes_remaining -= n;
   }
-  pthread_mutex_unlock(&G_DB_MUTEX);
+  conn->state = DATA_AWAIT_CHECKSUM;
+  return true;
 }
 
-void parse_and_store_ip_table(const char* buffer) 
+// Pushes the fback file into the socket until it would block: sendfile first, then splice
+// through a per-connection pipe, then a pread/send copy. Compressed fbacks always take the copy
+// path, framing each chunk as it is read. Returns 1 when done, 0 when the
+// socket is full, -1 on error.
+int pump_file_to_socket(reactor_conn* conn)
 {
-  char temp_buffer[1024];
-  strncpy(temp_buffer, buffer, sizeof(temp_buffer));
-  G_NUM_NODES_IN_TABLE = 0;
-  strtok(temp_buffer, "\n");
-  char* line = strtok(NULL, "\n");
-  while (line != NULL && G_NUM_NODES_IN_TABLE < (MAX_NODES + 2)) 
+  transfer_flow* flow = conn->transfer->flow;
+  while (conn->bytes_remaining > 0 || conn->pipe_pending > 0 || conn->copy_sent < conn->copy_length)
   {
-    trim_whitespace(line);
-    if (strlen(line) > 0) 
+    if (conn_throttled(conn)) return 0;
+    ssize_t n;
+    if (conn->mode == SEND_SENDFILE)
+    {
+      n = sendfile(conn->fd, conn->file_fd, &conn->file_offset, flow_quantum(flow, (size_t)conn->bytes_remaining));
+      if (n > 0) 
+      { 
+        charge_flow(flow, n);
+        count_transfer_bytes(conn->transfer, true, n);
+        conn->crc = crc32c_update(conn->crc, conn->map + conn->file_offset - n, n);
+        conn->bytes_remaining -= n; 
+        continue; 
+      }
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+      if (n < 0 && (errno == EINVAL || errno == ENOSYS)) 
+      {
+        conn->mode = pipe2(conn->pipe_fds, O_NONBLOCK | O_CLOEXEC) == 0 ? SEND_SPLICE : SEND_COPY;
+        continue;
+      }
+      return -1;
+    }
+    if (conn->mode == SEND_SPLICE)
+    {
+      if (conn->pipe_pending == 0)
+      {
+        size_t want = flow_quantum(flow, conn->bytes_remaining < REACTOR_IO_BUFFER_SIZE ? (size_t)conn->bytes_remaining : REACTOR_IO_BUFFER_SIZE);
+        n = splice(conn->file_fd, &conn->file_offset, conn->pipe_fds[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EINVAL) { conn->mode = SEND_COPY; continue; }
+        if (n <= 0) return -1;
+        conn->crc = crc32c_update(conn->crc, conn->map + conn->file_offset - n, n);
+        conn->pipe_pending = n;
+        conn->bytes_remaining -= n;
+      }
+      n = splice(conn->pipe_fds[0], NULL, conn->fd, NULL, conn->pipe_pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+      if (n > 0) 
+      { 
+        charge_flow(flow, n);
+        count_transfer_bytes(conn->transfer, true, n);
+        conn->pipe_pending -= n; 
+        continue; 
+      }
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+      return -1;
+    }
+    if (conn->copy_sent == conn->copy_length)
     {
-      strncpy(G_IP_TABLE[G_NUM_NODES_IN_TABLE], line, MAX_IP_LENGTH - 1);
-      G_IP_TABLE[G_NUM_NODES_IN_TABLE][MAX_IP_LENGTH - 1] = '\0';
-      G_NUM_NODES_IN_TABLE++;
+      if (!conn->copy_buffer && !(conn->copy_buffer = malloc(COMPRESS_FRAME_HEADER + COMPRESS_CHUNK_SIZE))) return -1;
+      bool compressed = conn->mode == SEND_COMPRESSED;
+      size_t want = conn->bytes_remaining < COMPRESS_CHUNK_SIZE ? (size_t)conn->bytes_remaining : COMPRESS_CHUNK_SIZE;
+      n = pread(conn->file_fd, compressed ? G_REACTOR.io_buffer : conn->copy_buffer, want, conn->file_offset);
+      if (n <= 0) return -1;
+      conn->crc = crc32c_update(conn->crc, compressed ? G_REACTOR.io_buffer : conn->copy_buffer, n);
+      conn->file_offset += n;
+      conn->bytes_remaining -= n;
+      conn->copy_length = compressed ? encode_chunk((const uint8_t*)G_REACTOR.io_buffer, n, (uint8_t*)conn->copy_buffer, &conn->incompressible_run) : (size_t)n;
+      conn->copy_sent = 0;
     }
-    line = strtok(NULL, "\n");
+    n = send(conn->fd, conn->copy_buffer + conn->copy_sent, conn->copy_length - conn->copy_sent, MSG_NOSIGNAL);
+    if (n > 0) 
+    { 
+      charge_flow(flow, n);
+      count_transfer_bytes(conn->transfer, true, n);
+      conn->copy_sent += n; 
+      continue; 
+    }
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    return -1;
+  }
+  // Then the stripe's checksum; the verdict comes back on the read side
+  uint32_t checksum_frame = htonl(conn->crc);
+  memcpy(conn->trailer, &checksum_frame, sizeof(checksum_frame));
+  while (conn->trailer_done < sizeof(conn->trailer))
+  {
+    ssize_t n = send(conn->fd, conn->trailer + conn->trailer_done, sizeof(conn->trailer) - conn->trailer_done, MSG_NOSIGNAL);
+    if (n > 0) { conn->trailer_done += n; continue; }
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    return -1;
   }
+  return 1;
 }
 
-bool is_ip_in_table(const char* ip_to_check) 
+bool handle_data_writable(reactor_conn* conn)
 {
-  for (int i = 0; i < G_NUM_NODES_IN_TABLE; ++i) 
+  if (conn->state != DATA_SENDING) return true;
+  int result = pump_file_to_socket(conn);
+  if (result < 0) return false;
+  if (result > 0) 
   {
-    if (strcmp(G_IP_TABLE[i], ip_to_check) == 0) return true;
+    conn->state = DATA_AWAIT_VERDICT;
+    reactor_set_events(conn, EPOLLIN | EPOLLRDHUP);
   }
-  return false;
+  return true;
 }
 
-// Command, Reply & TCP Transfer Functions
-void send_file_records(const struct sockaddr_in* recipient_addr, int reply_port, bool for_su) 
+// A file belongs to the address its request came from; the sender IP the request carries is only
+// what the node believes its own address to be, and anyone can write another node's there.
+void handle_upload_request(reactor_conn* control, const control_message* request, const struct sockaddr_in* sender_addr, const char* sender_ip_str, bool content_checked)
 {
-  char recipient_ip[MAX_IP_LENGTH];
-  inet_ntop(AF_INET, &recipient_addr->sin_addr, recipient_ip, sizeof(recipient_ip));
-  char response_buffer[MAX_CHUNK_SIZE] = {0};
-  sqlite3_stmt* stmt;
-  const char* sql = for_su ? "SELECT filename, owner_ip FROM StoredFiles;" : "SELECT filename, owner_ip FROM StoredFiles WHERE owner_ip = ?;";
+  if (!CONTROL_HAS(request, FIELD_NAME) || !CONTROL_HAS(request, FIELD_SIZE) || !CONTROL_HAS(request, FIELD_SENDER_IP) || !CONTROL_HAS(request, FIELD_TRANSFER_ID)) return;
 
-  pthread_mutex_lock(&G_DB_MUTEX);
-  if (sqlite3_prepare_v2(G_DB, sql, -1, &stmt, 0) == SQLITE_OK) 
+  control_frame reply;
+  if (request->hash[0] && !content_checked) 
   {
-    if (!for_su) sqlite3_bind_text(stmt, 1, recipient_ip, -1, SQLITE_STATIC);
-    while (sqlite3_step(stmt) == SQLITE_ROW) 
+    // Content this owner has already stored is recorded again without sending any data
+    metadata_op* op = new_metadata_op(METADATA_REFERENCE_STORED, request->name, sender_ip_str);
+    if (op && (op->request = malloc(sizeof(control_message)))) 
     {
-      char line[512];
-      snprintf(line, sizeof(line), "File: %-40s | Owner: %s\n", sqlite3_column_text(stmt, 0), sqlite3_column_text(stmt, 1));
-      strncat(response_buffer, line, sizeof(response_buffer) - strlen(response_buffer) - 1);
+      strcpy(op->hash, request->hash);
+      op->size = request->size;
+      op->control = control;
+      control->holds++;
+      op->reply_addr = *sender_addr;
+      *op->request = *request;
+      submit_metadata(op);
+      return;
     }
-    sqlite3_finalize(stmt);
+    free(op);
   }
-  pthread_mutex_unlock(&G_DB_MUTEX);
 
-  if (strlen(response_buffer) == 0) strcpy(response_buffer, "No files found.\n");
-  int sock = socket(AF_INET, SOCK_DGRAM, 0);
-  struct sockaddr_in reply_addr = *recipient_addr;
-  reply_addr.sin_port = htons(reply_port);
-  sendto(sock, response_buffer, strlen(response_buffer), 0, (struct sockaddr*)&reply_addr, sizeof(reply_addr));
-  close(sock);
+  pending_transfer transfer = { .direction = TRANSFER_INBOUND, .transfer_id = request->transfer_id, .source_addr = sender_addr->sin_addr, .filesize = request->size, .mtime = request->mtime, .stream_count = grant_stream_count(request->streams), 
+                                 .compress = G_COMPRESSION && strcmp(request->codec, COMPRESSION_CODEC) == 0, .priority = PRIORITY_BULK };
+  snprintf(transfer.filename, sizeof(transfer.filename), "%s", request->name);
+  snprintf(transfer.sender_ip, sizeof(transfer.sender_ip), "%s", sender_ip_str);
+  snprintf(transfer.content_hash, sizeof(transfer.content_hash), "%s", request->hash);
+  snprintf(transfer.stored_path, sizeof(transfer.stored_path), "cr_data_storage/%s_%s", transfer.sender_ip, transfer.filename);
+  snprintf(transfer.temp_path, sizeof(transfer.temp_path), "%s.part", transfer.stored_path);
+  // A partial copy from an interrupted attempt fixes the stripe layout and what is already held
+  int saved_streams;
+  if (load_resume_state(transfer.temp_path, transfer.filesize, transfer.mtime, &saved_streams, transfer.stripe_have)) transfer.stream_count = saved_streams;
+  else memset(transfer.stripe_have, 0, sizeof(transfer.stripe_have));
+  if (register_pending_transfer(&transfer)) 
+  {
+    control_begin(&reply, CONTROL_READY_TO_RECEIVE);
+    control_put_u64(&reply, FIELD_TRANSFER_ID, transfer.transfer_id);
+    control_put_u32(&reply, FIELD_PORT, TCP_FILE_TRANSFER_PORT);
+    control_put_u32(&reply, FIELD_STREAMS, transfer.stream_count);
+    control_put_string(&reply, FIELD_CODEC, transfer.compress ? COMPRESSION_CODEC : "none");
+  }
+  else 
+  {
+    control_begin(&reply, CONTROL_BUSY);
+    control_put_u64(&reply, FIELD_TRANSFER_ID, transfer.transfer_id);
+    fprintf(stderr, "At transfer limit, deferred '%s' from %s.\n", request->name, sender_ip_str);
+  }
+  send_control_reply(control, sender_addr, 0, &reply);
 }
 
-void* tcp_download_thread(void* arg) 
+// Announces an fback on the shared acceptor and offers a stream count; the requester connects
+// up to that many streams, each naming this transfer and its stripe in the hello. The file is
+// compressed on the way out if the requester accepts it and a sample of the file shrinks.
+// Announces an fback on the shared acceptor and offers a stream count; the requester connects
+// up to that many streams, each naming this transfer and its stripe in the hello. The file is
+// compressed on the way out if the requester accepts it and a sample of the file shrinks. Finding
+// the file is left to a worker, and the reply is sent once it is done.
+void handle_fback_request(reactor_conn* control, const control_message* request, const struct sockaddr_in* sender_addr, const char* requester_ip, int reply_port)
 {
-  tcp_download_info* info = (tcp_download_info*)arg;
-  int listen_sock = socket(AF_INET, SOCK_STREAM, 0);
-  int opt = 1;
-  setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-
-  struct sockaddr_in listen_addr = { .sin_family = AF_INET, .sin_addr.s_addr = INADDR_ANY, .sin_port = htons(TCP_FILE_TRANSFER_PORT) };
-  if (bind(listen_sock, (struct sockaddr*)&listen_addr, sizeof(listen_addr)) < 0) 
+  if (!CONTROL_HAS(request, FIELD_NAME)) return;
+  fback_lookup* lookup = calloc(1, sizeof(fback_lookup));
+  if (!lookup) 
   {
-    perror("TCP download bind"); close(listen_sock); 
-    free(info); 
-    return NULL;
+    send_control_text(control, sender_addr, reply_port, BUSY_REPLY);
+    return;
   }
-  listen(listen_sock, 1);
-    
-  int data_sock = accept(listen_sock, NULL, NULL);
-  close(listen_sock);
-  if (data_sock < 0) 
-  { 
-    perror("TCP accept"); 
-    free(info); 
-    return NULL; 
+  *lookup = (fback_lookup){ .done.finish = finish_fback_lookup, .control = control, .reply_addr = *sender_addr, .reply_port = reply_port, 
+                            .offer_compression = G_COMPRESSION && strcmp(request->codec, COMPRESSION_CODEC) == 0,
+                            .transfer = { .direction = TRANSFER_OUTBOUND, .source_addr = sender_addr->sin_addr, .priority = PRIORITY_INTERACTIVE, .expected_crc = -1 } };
+  snprintf(lookup->transfer.filename, sizeof(lookup->transfer.filename), "%s", request->name);
+  snprintf(lookup->transfer.sender_ip, sizeof(lookup->transfer.sender_ip), "%s", requester_ip);
+  if (!submit_job(lookup_fback_job, lookup)) 
+  {
+    free(lookup);
+    send_control_text(control, sender_addr, reply_port, BUSY_REPLY);
+    return;
   }
+  control->holds++;
+}
 
-  mkdir("cr_data_storage", 0755);
-  char save_path[MAX_FILEPATH_LENGTH];
-  snprintf(save_path, sizeof(save_path), "cr_data_storage/%s_%s", info->sender_ip, info->filename);
-  FILE* file = fopen(save_path, "wb");
-  if (!file) 
-  { 
-    perror("fopen download"); 
-    close(data_sock); 
-    free(info); 
-    return NULL; 
-  }
-    
-  char buffer[MAX_CHUNK_SIZE];
-  ssize_t bytes_received;
-  while ((bytes_received = recv(data_sock, buffer, sizeof(buffer), 0)) > 0) 
+void lookup_fback_job(void* arg)
+{
+  fback_lookup* lookup = (fback_lookup*)arg;
+  pending_transfer* transfer = &lookup->transfer;
+  struct stat file_stat;
+  lookup->found = db_lookup_stored_file(transfer->filename, transfer->sender_ip, transfer->stored_path, sizeof(transfer->stored_path), &transfer->expected_crc) && stat(transfer->stored_path, &file_stat) == 0;
+  if (lookup->found) 
   {
-    fwrite(buffer, 1, bytes_received, file);
+    transfer->filesize = file_stat.st_size;
+    transfer->mtime = file_stat.st_mtime;
+    transfer->stream_count = streams_for_size(transfer->filesize);
+    int sample_fd = lookup->offer_compression ? open(transfer->stored_path, O_RDONLY | O_CLOEXEC) : -1;
+    if (sample_fd >= 0) 
+    {
+      transfer->compress = sample_compressible(sample_fd, transfer->filesize);
+      close(sample_fd);
+    }
   }
-  fclose(file);
-  close(data_sock);
-  printf("File '%s' received and stored.\n", info->filename);
-  db_insert_file_record(info->filename, info->sender_ip);
-  free(info);
-  return NULL;
+  complete_on_reactor(&lookup->done);
 }
 
-void* tcp_upload_thread(void* arg) 
+// Runs on the reactor once a worker has looked up an fback.
+void finish_fback_lookup(reactor_completion* done)
 {
-  tcp_upload_info* info = (tcp_upload_info*)arg;
-  char requester_ip[MAX_IP_LENGTH];
-  inet_ntop(AF_INET, &info->requester_addr.sin_addr, requester_ip, sizeof(requester_ip));
-    
-  char filepath[MAX_FILEPATH_LENGTH];
-  snprintf(filepath, sizeof(filepath), "cr_data_storage/%s_%s", requester_ip, info->filename);
+  fback_lookup* lookup = (fback_lookup*)done;
+  // A session that closed meanwhile has no one left to answer
+  if (!lookup->control->closed) answer_fback(lookup);
+  release_conn(lookup->control);
+  free(lookup);
+}
 
-  int listen_sock = socket(AF_INET, SOCK_STREAM, 0);
-  int opt = 1;
-  setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-  struct sockaddr_in listen_addr = { .sin_family = AF_INET, .sin_addr.s_addr = INADDR_ANY, .sin_port = htons(0) };
-  if (bind(listen_sock, (struct sockaddr*)&listen_addr, sizeof(listen_addr)) < 0) 
+// Registers the looked-up fback and tells the requester where to fetch it.
+void answer_fback(fback_lookup* lookup)
+{
+  pending_transfer* transfer = &lookup->transfer;
+  if (!lookup->found) 
   {
-    perror("TCP upload bind"); close(listen_sock); 
-    free(info); 
-    return NULL;
+    char text[MAX_CMD_LENGTH];
+    snprintf(text, sizeof(text), "File '%s' not found in the repository.", transfer->filename);
+    send_control_text(lookup->control, &lookup->reply_addr, lookup->reply_port, text);
+    return;
   }
-  socklen_t addr_len = sizeof(listen_addr);
-  getsockname(listen_sock, (struct sockaddr*)&listen_addr, &addr_len);
-  int assigned_port = ntohs(listen_addr.sin_port);
-
-  char reply[MAX_CMD_LENGTH];
-  snprintf(reply, sizeof(reply), "READY_TO_SEND %s %d", info->filename, assigned_port);
-  int udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
-  struct sockaddr_in reply_addr = info->requester_addr;
-  reply_addr.sin_port = htons(info->reply_port);
-  sendto(udp_sock, reply, strlen(reply), 0, (struct sockaddr*)&reply_addr, sizeof(reply_addr));
-  close(udp_sock);
-
-  listen(listen_sock, 1);
-  int data_sock = accept(listen_sock, NULL, NULL);
-  close(listen_sock);
-  if (data_sock < 0) 
-  { 
-    perror("TCP accept"); 
-    free(info); 
-    return NULL; 
+  transfer->transfer_id = generate_transfer_id();
+  if (!register_pending_transfer(transfer)) 
+  {
+    send_control_text(lookup->control, &lookup->reply_addr, lookup->reply_port, BUSY_REPLY);
+    return;
   }
+  control_frame reply;
+  control_begin(&reply, CONTROL_READY_TO_SEND);
+  control_put_string(&reply, FIELD_NAME, transfer->filename);
+  control_put_u32(&reply, FIELD_PORT, TCP_FILE_TRANSFER_PORT);
+  control_put_u64(&reply, FIELD_TRANSFER_ID, transfer->transfer_id);
+  control_put_u64(&reply, FIELD_SIZE, transfer->filesize);
+  control_put_u32(&reply, FIELD_STREAMS, transfer->stream_count);
+  control_put_u64(&reply, FIELD_MTIME, transfer->mtime);
+  control_put_string(&reply, FIELD_CODEC, transfer->compress ? COMPRESSION_CODEC : "none");
+  // The stored checksum lets the requester verify the file as a whole, not just each stripe
+  if (transfer->expected_crc >= 0) control_put_u32(&reply, FIELD_CHECKSUM, (uint32_t)transfer->expected_crc);
+  send_control_reply(lookup->control, &lookup->reply_addr, lookup->reply_port, &reply);
+}
 
-  FILE* file = fopen(filepath, "rb");
-  if (!file) 
+// A listing is fetched over TCP: its id is registered like a transfer and the client connects to
+// the shared acceptor with a hello carrying it. Options in the request's text narrow the listing.
+void handle_listing_request(reactor_conn* control, const control_message* request, const struct sockaddr_in* sender_addr, const char* requester_ip, int records_port)
+{
+  if (!CONTROL_HAS(request, FIELD_TRANSFER_ID)) return;
+  pending_transfer transfer = { .direction = TRANSFER_LISTING, .transfer_id = request->transfer_id, .source_addr = sender_addr->sin_addr, .stream_count = 1, .list_all = control->is_su_listener };
+  strcpy(transfer.filename, "(listing)");
+  snprintf(transfer.sender_ip, sizeof(transfer.sender_ip), "%s", requester_ip);
+  char options[MAX_CMD_LENGTH], error[MAX_CMD_LENGTH];
+  strcpy(options, request->text);
+  if (!parse_listing_filter(options, &transfer.filter, error, sizeof(error))) 
   {
-    close(data_sock); 
-    free(info); 
-    return NULL;
+    send_control_text(control, sender_addr, records_port, error);
+    return;
   }
-  char buffer[MAX_CHUNK_SIZE];
-  size_t bytes_read;
-  while ((bytes_read = fread(buffer, 1, sizeof(buffer), file)) > 0) 
+  if (!register_pending_transfer(&transfer)) 
   {
-    if (send(data_sock, buffer, bytes_read, 0) < 0) 
-    { 
-      perror("TCP send"); 
-      break; 
-    }
+    send_control_text(control, sender_addr, records_port, BUSY_REPLY);
+    return;
   }
-  fclose(file);
-  close(data_sock);
+  control_frame reply;
+  control_begin(&reply, CONTROL_READY_TO_LIST);
+  control_put_u64(&reply, FIELD_TRANSFER_ID, transfer.transfer_id);
+  control_put_u32(&reply, FIELD_PORT, TCP_FILE_TRANSFER_PORT);
+  send_control_reply(control, sender_addr, records_port, &reply);
+}
 
-  pthread_mutex_lock(&G_DB_MUTEX);
-  sqlite3_stmt* stmt;
-  if (sqlite3_prepare_v2(G_DB, "DELETE FROM StoredFiles WHERE filename = ? AND owner_ip = ?;", -1, &stmt, 0) == SQLITE_OK) 
-  {
-    sqlite3_bind_text(stmt, 1, info->filename, -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 2, requester_ip, -1, SQLITE_STATIC);
-    if (sqlite3_step(stmt) != SQLITE_DONE) fprintf(stderr, "DB delete failed: %s\n", sqlite3_errmsg(G_DB));
-    else printf("DB record for '%s' deleted.\n", info->filename);
-    sqlite3_finalize(stmt);
-  }
-  pthread_mutex_unlock(&G_DB_MUTEX);
-  if (remove(filepath) == 0) printf("File '%s' deleted from disk.\n", filepath); 
-  else perror("remove");
-  
-  free(info);
-  return NULL;
+// A batch is announced once for all of its files and granted a single stream; what it holds is
+// only known as each file's header arrives on that stream.
+void handle_batch_request(reactor_conn* control, const control_message* request, const struct sockaddr_in* sender_addr, const char* sender_ip_str)
+{
+  if (!CONTROL_HAS(request, FIELD_COUNT) || !CONTROL_HAS(request, FIELD_SIZE) || !CONTROL_HAS(request, FIELD_SENDER_IP) || !CONTROL_HAS(request, FIELD_TRANSFER_ID) || request->count < 1) return;
+  pending_transfer transfer = { .direction = TRANSFER_BATCH, .transfer_id = request->transfer_id, .source_addr = sender_addr->sin_addr, .filesize = request->size, .stream_count = 1, .priority = PRIORITY_BULK };
+  snprintf(transfer.filename, sizeof(transfer.filename), "(batch of %d files)", request->count);
+  snprintf(transfer.sender_ip, sizeof(transfer.sender_ip), "%s", sender_ip_str);
+  control_frame reply;
+  if (register_pending_transfer(&transfer)) 
+  {
+    control_begin(&reply, CONTROL_READY_TO_RECEIVE);
+    control_put_u64(&reply, FIELD_TRANSFER_ID, transfer.transfer_id);
+    control_put_u32(&reply, FIELD_PORT, TCP_FILE_TRANSFER_PORT);
+  }
+  else 
+  {
+    control_begin(&reply, CONTROL_BUSY);
+    control_put_u64(&reply, FIELD_TRANSFER_ID, transfer.transfer_id);
+    fprintf(stderr, "At transfer limit, deferred a batch of %d files from %s.\n", request->count, sender_ip_str);
+  }
+  send_control_reply(control, sender_addr, 0, &reply);
 }
 
-// Listener logic
-void* listener_thread_func(void* arg) 
+// Acts on one control message, whether it came as a datagram or as a frame on a session; the
+// reply goes back the same way.
+void handle_control_message(reactor_conn* control, const control_message* message, const struct sockaddr_in* sender_addr, const char* sender_ip_str)
 {
-  listener_config* config = (listener_config*)arg;
-  int sock = socket(AF_INET, SOCK_DGRAM, 0);
-  struct sockaddr_in listen_addr = { .sin_family = AF_INET, .sin_addr.s_addr = INADDR_ANY, .sin_port = htons(config->port) };
-  if (bind(sock, (struct sockaddr*)&listen_addr, sizeof(listen_addr)) < 0) 
+  int reply_port = control->is_su_listener ? FBACK_PORT : CR_REPLY_PORT;
+  switch (message->type)
   {
-    perror("listener bind"); free(config); return NULL;
+    case CONTROL_REQUEST_UPLOAD:
+      handle_upload_request(control, message, sender_addr, sender_ip_str, false);
+      break;
+    case CONTROL_REQUEST_BATCH:
+      handle_batch_request(control, message, sender_addr, sender_ip_str);
+      break;
+    case CONTROL_FBACK:
+      handle_fback_request(control, message, sender_addr, sender_ip_str, reply_port);
+      break;
+    case CONTROL_LIST:
+      // The SU's listing covers every owner and is answered on its fsee port
+      handle_listing_request(control, message, sender_addr, sender_ip_str, control->is_su_listener ? FSEE_PORT : CR_REPLY_PORT);
+      break;
+    case CONTROL_CLEARDB:
+      if (control->is_su_listener) 
+      { 
+        metadata_op* op = new_metadata_op(METADATA_CLEAR, NULL, NULL);
+        if (op) submit_metadata(op);
+      }
+      break;
+    case CONTROL_TERMINATE:
+      if (control->is_su_listener) 
+      {
+        // The reactor stops after this wakeup and main settles the metadata queue before exiting
+        printf("\nTermination signal received. Shutting down server.\n"); 
+        G_EXIT_REQUEST = true;
+      }
+      break;
+    case CONTROL_IP_TABLE:
+    case CONTROL_NODE_ADD:
+    case CONTROL_NODE_REMOVE:
+      // Only the SU changes who belongs to the network
+      if (control->is_su_listener && sender_addr->sin_addr.s_addr == G_SU_ADDR.s_addr) 
+      {
+        membership_result result = apply_membership(message);
+        if (result == MEMBERSHIP_APPLIED) printf("Membership version %llu: %zu node(s) in the network.\n", (unsigned long long)G_MEMBERSHIP_VERSION, G_MEMBERS.count);
+        else if (result == MEMBERSHIP_BEHIND) request_table_pull(G_SU_ADDR);
+      }
+      break;
+    default:
+      break;
   }
-    
-  printf("UDP Listener started on port %d.\n", config->port);
-  char buffer[MAX_CMD_LENGTH];
-  while (!G_EXIT_REQUEST) 
+}
+
+void handle_control_datagrams(reactor_conn* control)
+{
+  uint8_t datagram[CONTROL_MAX_SIZE];
+  control_message message;
+  while (true) 
   {
     struct sockaddr_in sender_addr;
     socklen_t sender_len = sizeof(sender_addr);
-    ssize_t len = recvfrom(sock, buffer, sizeof(buffer) - 1, 0, (struct sockaddr*)&sender_addr, &sender_len);
-    if (len <= 0) continue;
-        
-    char sender_ip_str[MAX_IP_LENGTH];
-    inet_ntop(AF_INET, &sender_addr.sin_addr, sender_ip_str, sizeof(sender_ip_str));
-        
-    if (!is_ip_in_table(sender_ip_str)) 
+    ssize_t len = recvfrom(control->fd, datagram, sizeof(datagram), 0, (struct sockaddr*)&sender_addr, &sender_len);
+    if (len < 0 && errno == EINTR) continue;
+    if (len < 0) return;
+    if (len == 0) continue;
+    // Membership is checked on the binary address; the text form is made only for packets kept
+    if (!ip_set_contains(&G_MEMBERS, sender_addr.sin_addr)) 
     {
+      char sender_ip_str[MAX_IP_LENGTH];
+      inet_ntop(AF_INET, &sender_addr.sin_addr, sender_ip_str, sizeof(sender_ip_str));
       printf("SECURITY ALERT: Dropped packet from unauthorized IP: %s\n", sender_ip_str);
       continue;
     }
-    buffer[len] = '\0';
-    char buffer_copy[len + 1];
-    memcpy(buffer_copy, buffer, len + 1);
-    char* saveptr;
-    char* command = strtok_r(buffer_copy, " ", &saveptr);
-    if (!command) continue;
+    if (control_decode(datagram, len, &message) != len) continue;
+    if (message.type == CONTROL_ACK) 
+    {
+      if (CONTROL_HAS(&message, FIELD_MESSAGE_ID)) acknowledge_reply(&sender_addr, message.message_id);
+      continue;
+    }
+    if (!acknowledge_message(control->fd, &sender_addr, &message)) continue;
+    char sender_ip_str[MAX_IP_LENGTH];
+    inet_ntop(AF_INET, &sender_addr.sin_addr, sender_ip_str, sizeof(sender_ip_str));
+    handle_control_message(control, &message, &sender_addr, sender_ip_str);
+  }
+}
+
+// Closes data connections that stopped making progress (including announced-but-silent peers).
+// Parks a stream whose flow has run dry: the reactor stops watching it until its bucket has
+// refilled, when resume_throttled_conns picks it up again.
+bool conn_throttled(reactor_conn* conn)
+{
+  transfer_flow* flow = conn->transfer ? conn->transfer->flow : NULL;
+  if (!flow) return false;
+  refill_flow(flow);
+  if (flow->tokens >= 0) return false;
+  conn->throttled_until_ms = flow->refilled_ms + (long long)(-flow->tokens * 1000.0 / flow->rate) + 1;
+  reactor_set_events(conn, 0);
+  return true;
+}
 
-    if (strncmp(command, "REQUEST_UPLOAD", 14) == 0) 
+// Lets parked streams whose time has come carry on from where they stopped.
+void resume_throttled_conns(void)
+{
+  if (!G_SCHEDULER.flows) return;
+  long long now = monotonic_ms();
+  reactor_conn* conn = G_REACTOR.data_conns;
+  while (conn)
+  {
+    reactor_conn* next = conn->next;
+    if (conn->throttled_until_ms != 0 && conn->throttled_until_ms <= now)
     {
-      char filename[MAX_FILENAME_LENGTH], up_sender_ip[MAX_IP_LENGTH];
-      long long filesize;
-      if (sscanf(buffer, "REQUEST_UPLOAD %s %lld %s", filename, &filesize, up_sender_ip) == 3) 
+      conn->throttled_until_ms = 0;
+      conn->last_activity = time(NULL);
+      bool keep;
+      if (conn->state == DATA_SENDING) 
       {
-        tcp_download_info* info = malloc(sizeof(tcp_download_info));
-        strncpy(info->filename, filename, sizeof(info->filename) - 1);
-        strncpy(info->sender_ip, up_sender_ip, sizeof(info->sender_ip) - 1);
-        pthread_t download_tid;
-        pthread_create(&download_tid, NULL, tcp_download_thread, info);
-        pthread_detach(download_tid);
-      }
-    } 
-    
-    else if (config->is_su_listener) 
-    {
-      if (strcmp(command, "fsee") == 0) 
-      { 
-        send_file_records(&sender_addr, FSEE_PORT, true); 
-      }
-      else if (strcmp(command, "cleardb") == 0) 
-      { 
-        db_clear_all_records(); 
+        reactor_set_events(conn, EPOLLOUT);
+        keep = handle_data_writable(conn);
       }
-      else if (strcmp(command, "fback") == 0) 
+      else 
       {
-        char* filename = strtok_r(NULL, "", &saveptr);
-        if(filename) 
-        {
-          tcp_upload_info* info = malloc(sizeof(tcp_upload_info));
-          strncpy(info->filename, filename, sizeof(info->filename) - 1);
-          info->requester_addr = sender_addr;
-          info->reply_port = FBACK_PORT;
-          pthread_t upload_tid;
-          pthread_create(&upload_tid, NULL, tcp_upload_thread, info);
-          pthread_detach(upload_tid);
-        }
-      } 
-      else if (strncmp(command, "Connection", 10) == 0) 
-      {
-        printf("\nTermination signal received. Shutting down server.\n"); exit(0);
+        reactor_set_events(conn, EPOLLIN | EPOLLRDHUP);
+        keep = handle_data_readable(conn);
       }
-    } 
-    else 
-    { // Normal User Listener
-      if (strcmp(command, "seemyfiles") == 0) 
-      { 
-        send_file_records(&sender_addr, CR_REPLY_PORT, false); 
+      if (!keep) close_data_conn(conn);
+    }
+    conn = next;
+  }
+}
+
+// Shortens the reactor's wait to the first parked stream that is due.
+int next_resume_wait_ms(int wait)
+{
+  if (!G_SCHEDULER.flows) return wait;
+  long long now = monotonic_ms();
+  for (reactor_conn* conn = G_REACTOR.data_conns; conn; conn = conn->next)
+  {
+    if (conn->throttled_until_ms != 0 && conn->throttled_until_ms - now < wait) wait = conn->throttled_until_ms - now;
+  }
+  return wait < 0 ? 0 : wait;
+}
+
+void sweep_idle_data_conns(void)
+{
+  time_t now = time(NULL);
+  reactor_conn* conn = G_REACTOR.data_conns;
+  while (conn)
+  {
+    reactor_conn* next = conn->next;
+    if (conn->kind == CONN_SESSION && now - conn->last_activity > SESSION_IDLE_TIMEOUT)
+    {
+      // A live node sends heartbeats well within the timeout
+      fprintf(stderr, "Session went quiet, closing it.\n");
+      close_session(conn);
+    }
+    else if (conn->kind != CONN_SESSION && conn->state != DATA_CHECK_PREFIX && conn->state != DATA_AWAIT_RECORD && now - conn->last_activity > DATA_IDLE_TIMEOUT) 
+    {
+      fprintf(stderr, "Closing idle data connection for '%s'.\n", conn->transfer ? conn->transfer->filename : "(no hello)");
+      close_data_conn(conn);
+    }
+    conn = next;
+  }
+}
+
+// One epoll loop owns every control socket, the TCP acceptor and all data connections;
+// transfers advance only as their sockets become ready.
+void run_reactor(void)
+{
+  struct epoll_event events[REACTOR_MAX_EVENTS];
+  time_t last_sweep = time(NULL);
+  while (!G_EXIT_REQUEST)
+  {
+    int ready = epoll_wait(G_REACTOR.epoll_fd, events, REACTOR_MAX_EVENTS, next_resume_wait_ms(next_retransmit_wait_ms()));
+    if (ready < 0 && errno != EINTR) 
+    {
+      perror("epoll_wait");
+      break;
+    }
+    for (int i = 0; i < ready; ++i)
+    {
+      reactor_conn* conn = (reactor_conn*)events[i].data.ptr;
+      // Closed earlier in this batch, perhaps while handling another connection's event
+      if (conn->closed) continue;
+      if (conn->kind == CONN_CONTROL) handle_control_datagrams(conn);
+      else if (conn->kind == CONN_ACCEPTOR) accept_data_connections(conn);
+      else if (conn->kind == CONN_METADATA) finish_metadata_ops(conn);
+      else if (conn->kind == CONN_COMPLETIONS) run_completions(conn);
+      else if (conn->kind == CONN_SESSION)
+      {
+        conn->last_activity = time(NULL);
+        bool keep = !(events[i].events & EPOLLERR);
+        if (keep && (events[i].events & EPOLLOUT)) keep = flush_session(conn);
+        if (keep && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))) keep = handle_session_readable(conn);
+        if (!keep) close_session(conn);
       }
-      else if (strcmp(command, "fback") == 0) 
+      else
       {
-        char* filename = strtok_r(NULL, "", &saveptr);
-        if(filename) 
-        {
-          tcp_upload_info* info = malloc(sizeof(tcp_upload_info));
-          strncpy(info->filename, filename, sizeof(info->filename) - 1);
-          info->requester_addr = sender_addr;
-          info->reply_port = CR_REPLY_PORT;
-          pthread_t upload_tid;
-          pthread_create(&upload_tid, NULL, tcp_upload_thread, info);
-          pthread_detach(upload_tid);
-        }
+        // A parked stream still hears of errors; anything else waits for its bucket to refill
+        if (conn->throttled_until_ms != 0 && !(events[i].events & (EPOLLHUP | EPOLLERR))) continue;
+        conn->last_activity = time(NULL);
+        bool keep;
+        if (conn->state == DATA_SENDING) keep = !(events[i].events & (EPOLLHUP | EPOLLERR)) && handle_data_writable(conn);
+        else keep = handle_data_readable(conn);
+        if (!keep) close_data_conn(conn);
       }
     }
+    retransmit_control_replies();
+    resume_throttled_conns();
+    time_t now = time(NULL);
+    if (now != last_sweep) 
+    {
+      sweep_idle_data_conns();
+      expire_pending_transfers();
+      last_sweep = now;
+    }
+    free_retired_conns();
   }
-  close(sock);
-  free(config);
-  return NULL;
 }
 
 // Main
@@ -419,7 +3269,6 @@ int main()
   printf("Running Central Repository.\n");
   if (!initialize_database("repository.db")) return EXIT_FAILURE;
     
-  char iptable_buffer[1024];
   int ip_sock = socket(AF_INET, SOCK_DGRAM, 0);
   struct sockaddr_in listen_addr = { .sin_family = AF_INET, .sin_addr.s_addr = INADDR_ANY, .sin_port = htons(SU_IP_CR) };
   if (bind(ip_sock, (struct sockaddr*)&listen_addr, sizeof(listen_addr)) < 0) 
@@ -428,31 +3277,87 @@ int main()
     return EXIT_FAILURE;
   }
   printf("Waiting to receive IP table from Super User...\n");
-  ssize_t len = recvfrom(ip_sock, iptable_buffer, sizeof(iptable_buffer) - 1, 0, NULL, NULL);
-  close(ip_sock);
-  if (len < 0) 
-  { 
-    perror("recvfrom IP table"); 
-    return EXIT_FAILURE; 
+  // With DBIN_SU_IP set, a CR started after the SU asks it for the table instead of waiting
+  struct in_addr su_hint = env_su_addr();
+  struct timeval pull_wait = { .tv_sec = 0, .tv_usec = TABLE_PULL_INTERVAL_MS * 1000 };
+  setsockopt(ip_sock, SOL_SOCKET, SO_RCVTIMEO, &pull_wait, sizeof(pull_wait));
+  uint8_t datagram[CONTROL_MAX_SIZE];
+  while (G_MEMBERSHIP_VERSION == 0)
+  {
+    if (su_hint.s_addr != 0) request_table_pull(su_hint);
+    struct sockaddr_in su_addr;
+    socklen_t su_len = sizeof(su_addr);
+    control_message update;
+    ssize_t len = recvfrom(ip_sock, datagram, sizeof(datagram), 0, (struct sockaddr*)&su_addr, &su_len);
+    if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) 
+    { 
+      perror("recvfrom IP table"); 
+      close(ip_sock);
+      return EXIT_FAILURE; 
+    }
+    // Each chunk of a large table is acknowledged as it comes; the table is used once all are in
+    if (len > 0 && control_decode(datagram, len, &update) == len && acknowledge_message(ip_sock, &su_addr, &update)) apply_membership(&update);
   }
-  iptable_buffer[len] = '\0';
+  // The port is served again by the reactor below, so a table re-sent after a lost
+  // acknowledgement is acknowledged rather than refused
+  close(ip_sock);
   printf("IP Table received from Super User.\n");
-  parse_and_store_ip_table(iptable_buffer);
 
-  pthread_t su_tid, nu_tid;
-  listener_config *su_config = malloc(sizeof(listener_config));
-  su_config->port = SU_SENDTO_CR; su_config->is_su_listener = true;
-  listener_config *nu_config = malloc(sizeof(listener_config));
-  nu_config->port = NU_SENDTO_CR; nu_config->is_su_listener = false;
+  if (!start_worker_pool(env_int("DBIN_CR_WORKERS", DEFAULT_WORKER_COUNT, 1, 1024), env_int("DBIN_CR_QUEUE_DEPTH", DEFAULT_JOB_QUEUE_DEPTH, 1, 65536))) 
+  {
+    fprintf(stderr, "Failed to start worker pool.\n");
+    return EXIT_FAILURE;
+  }
+  if (!start_hashers(env_int("DBIN_CR_HASHERS", DEFAULT_HASHER_COUNT, 1, 64))) 
+  {
+    fprintf(stderr, "Failed to start upload hashers.\n");
+    return EXIT_FAILURE;
+  }
+  if (!start_metadata_writer(env_int("DBIN_CR_COMMIT_BATCH", DEFAULT_COMMIT_BATCH, 1, 65536), env_int("DBIN_CR_COMMIT_DELAY_MS", DEFAULT_COMMIT_DELAY_MS, 0, 1000))) 
+  {
+    fprintf(stderr, "Failed to start metadata writer.\n");
+    return EXIT_FAILURE;
+  }
 
-  pthread_create(&su_tid, NULL, listener_thread_func, su_config);
-  pthread_create(&nu_tid, NULL, listener_thread_func, nu_config);
+  G_MAX_STREAMS = env_int("DBIN_STREAMS", DEFAULT_STREAM_COUNT, 1, MAX_STREAMS);
+  G_COMPRESSION = env_int("DBIN_COMPRESS", 1, 0, 1) == 1;
+  G_SCHEDULER.global_rate = env_int("DBIN_RATE_LIMIT_KBPS", 0, 0, RATE_LIMIT_MAX_KBPS) * 1024LL;
+  G_SCHEDULER.peer_rate = env_int("DBIN_PEER_RATE_LIMIT_KBPS", 0, 0, RATE_LIMIT_MAX_KBPS) * 1024LL;
+  int metrics_port = env_int("DBIN_METRICS_PORT", 0, 0, 65535);
+  if (metrics_port > 0) start_metrics_endpoint(metrics_port);
+  crc32c_init();
+  G_REACTOR.max_transfers = env_int("DBIN_CR_MAX_TRANSFERS", DEFAULT_MAX_TRANSFERS, 1, MAX_PENDING_TRANSFERS);
+  G_REACTOR.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (G_REACTOR.epoll_fd < 0) 
+  {
+    perror("epoll_create1");
+    return EXIT_FAILURE;
+  }
+  if (!reactor_open_listener(CONN_CONTROL, SOCK_DGRAM, SU_SENDTO_CR, true) ||
+      !reactor_open_listener(CONN_CONTROL, SOCK_DGRAM, SU_IP_CR, true) ||
+      !reactor_open_listener(CONN_CONTROL, SOCK_DGRAM, NU_SENDTO_CR, false) ||
+      !reactor_open_listener(CONN_ACCEPTOR, SOCK_STREAM, TCP_FILE_TRANSFER_PORT, false)) 
+  {
+    return EXIT_FAILURE;
+  }
+  reactor_conn* metadata_conn = calloc(1, sizeof(reactor_conn));
+  metadata_conn->kind = CONN_METADATA;
+  metadata_conn->fd = G_METADATA.event_fd;
+  if (!reactor_add(metadata_conn, EPOLLIN)) return EXIT_FAILURE;
+  G_REACTOR.completed_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  reactor_conn* completions_conn = calloc(1, sizeof(reactor_conn));
+  completions_conn->kind = CONN_COMPLETIONS;
+  completions_conn->fd = G_REACTOR.completed_event_fd;
+  if (G_REACTOR.completed_event_fd < 0 || !reactor_add(completions_conn, EPOLLIN)) return EXIT_FAILURE;
 
   printf("All services started. Repository is online.\n");
+  run_reactor();
 
-  pthread_join(su_tid, NULL);
-  pthread_join(nu_tid, NULL);
-
+  stop_hashers();
+  stop_metadata_writer();
+  // Uploads still under way keep what they hold for their senders' next attempts
+  while (G_REACTOR.data_conns) close_data_conn(G_REACTOR.data_conns);
+  free_retired_conns();
   sqlite3_close(G_DB);
   printf("Shutting down.\n");
   return 0;
@@ -2,19 +2,31 @@
 		              //DBIN SUPER USER Program//                    
 //------------------------------------------------------------------------------------//
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <unistd.h>
+#include <time.h>
 #include <pthread.h>
+#include <errno.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
 #include <sys/select.h>
+#include <poll.h>
 #include <libgen.h>
 #include <ctype.h>
+#include <endian.h>
+#include <glob.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include "dbin_common.h"
 
 // Port Definitions
 #define SU_IP_NU 8100
@@ -27,221 +39,2331 @@
 #define TCP_FILE_TRANSFER_PORT 9000
 
 #define MAX_CHUNK_SIZE 4096
-#define MAX_IP_LENGTH 16
-#define MAX_CMD_LENGTH 512
-#define MAX_NODES 10
-#define MAX_FILENAME_LENGTH 256
 #define MAX_FILEPATH_LENGTH 512
+#define TRANSFER_MAGIC "DBTX"
+#define BATCH_FILE_MAGIC "DBFH"
+#define BATCH_PREFETCH_FILES 4
+#define HANDSHAKE_INITIAL_WAIT_MS 250
+#define HANDSHAKE_MAX_ATTEMPTS 5
+#define DATA_CONNECT_TIMEOUT 30
+#define DURABLE_REPLY_TIMEOUT 600
+#define RELAY_TALLY_TIMEOUT 600
+#define LISTING_BUFFER_SIZE 65536
+#define LISTING_TAIL_LENGTH 64
+#define LISTING_END_MARKER "End of listing:"
+#define MAX_ACTIVE_DOWNLOADS 32
+#define STREAM_BUFFER_SIZE 65536
+#define TRANSFER_VERDICT_OK 'K'
+#define TRANSFER_VERDICT_BAD 'X'
+#define SESSION_MAGIC "DBSS"
+#define SESSION_HEARTBEAT_MS 5000
+#define SESSION_TIMEOUT_MS 15000
+#define SESSION_RETRY_MS 2000
+#define SESSION_REPLY_WAIT_MS 5000
+#define SESSION_BUFFER_SIZE 8192
+#define SESSION_POOL_SIZE 8
+#define SESSION_POOL_IDLE_MS 20000
+#define CONTROL_RTO_INITIAL_MS 250
+#define CONTROL_RTO_MIN_MS 100
+#define CONTROL_RTO_MAX_MS 4000
+#define CONTROL_MAX_ATTEMPTS 6
+#define RECENT_MESSAGE_IDS 256
+#define MAX_RTT_ESTIMATES 256
+#define TABLE_NODES_PER_FRAME 128
+#define CONTROL_MULTICAST_GROUP "239.255.68.66"
+#define BROADCAST_BATCH 64
+#define RELAY_MAX_HOPS 64
+#define RATE_LIMIT_MAX_KBPS (1 << 30)
 
 // Global State 
-char G_IP_TABLE[MAX_NODES + 2][MAX_IP_LENGTH];
-int G_NUM_NODES_IN_TABLE = 0;
-volatile bool G_EXIT_REQUEST = false;
+// Who belongs to the network (see Membership). Only the main thread changes it, holding
+// G_MEMBERS_MUTEX, so it reads without the lock; threads answering a node's pull take it. Each
+// change bumps G_MEMBERSHIP_VERSION, which nodes use to notice a change they missed.
+ip_set G_MEMBERS;
+struct in_addr G_CR_ADDR;
+struct in_addr G_SU_ADDR;
+uint64_t G_MEMBERSHIP_VERSION = 0;
+pthread_mutex_t G_MEMBERS_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+bool G_COMPRESSION = true;
+// What 'stats' and the metrics endpoint report (see Metrics). An fback's handshake is timed from
+// G_FBACK_REQUESTED_US, set as the request goes out.
+node_metrics G_METRICS = 
+{ 
+  .handshake = { "dbin_handshake_seconds", "From announcing a transfer to the receiver's READY.", "handshake", 1e-6, 1e-3, "ms" },
+  .first_byte = { "dbin_first_byte_seconds", "From READY to the first payload byte at the receiving end.", "first byte", 1e-6, 1e-3, "ms" },
+  .throughput = { "dbin_transfer_throughput_bytes_per_second", "Payload rate of each completed transfer.", "throughput", 1024, 1.0 / 1024, "MiB/s" },
+  .histograms = { &G_METRICS.handshake, &G_METRICS.first_byte, &G_METRICS.throughput },
+};
+_Atomic long long G_FBACK_REQUESTED_US = 0;
+// Broadcasts go to CONTROL_MULTICAST_GROUP first until it turns out not to reach the nodes. Nodes
+// that only answered a re-sent copy are also sent their own in the first round from then on.
+bool G_MULTICAST = true;
+ip_set G_UNICAST_ONLY;
+
+// Inbound transfers already being served, so a re-sent REQUEST_UPLOAD is answered instead of re-spawned
+typedef struct { bool in_use; uint64_t transfer_id; int port; int stream_count; } active_download;
+active_download G_ACTIVE_DOWNLOADS[MAX_ACTIVE_DOWNLOADS];
+pthread_mutex_t G_ACTIVE_DOWNLOADS_MUTEX = PTHREAD_MUTEX_INITIALIZER;
 
 // Structs for thread arguments
+typedef struct { char ip[MAX_IP_LENGTH]; int port; } table_pull_request;
+typedef struct { const char* filepath; const char* filename; const char* self_ip; struct in_addr hops[RELAY_MAX_HOPS]; int hop_count; int delivered; bool started; } relay_chain;
 typedef struct { int nu_sock; int fsee_reply_sock; int fback_reply_sock; } listener_args;
-typedef struct { char filename[MAX_FILENAME_LENGTH]; char sender_ip[MAX_IP_LENGTH]; } tcp_download_info;
+typedef struct { char filename[MAX_FILENAME_LENGTH]; char sender_ip[MAX_IP_LENGTH]; uint64_t transfer_id; long long filesize; long long mtime; int stream_count; bool compress; int file_count; int reply_sock; struct sockaddr_in reply_addr; } tcp_download_info;
+
+// First frame on every TCP data connection, naming the announced transfer and which of its
+// stripes the stream carries
+typedef struct { char magic[4]; uint16_t stream_index; uint16_t stream_count; uint64_t transfer_id; } transfer_hello;
+
+// A batch sends many files back to back on one connection. Each file is framed by this header and
+// its name (name_length bytes, unterminated) and followed by its CRC32C; every field is big-endian.
+// A header with an empty name ends the batch, and the receiver answers with how many of the
+// files it kept, as a big-endian uint32.
+typedef struct { char magic[4]; uint32_t name_length; uint64_t size; uint64_t mtime; } batch_file_header;
+
+// One stripe of a transfer, sent or received on its own TCP connection. The receiving end answers
+// the hello with how many bytes of the stripe it already holds ('resume') as a big-endian uint64.
+// After the data the sender appends the CRC32C of the whole stripe (big-endian uint32) and the
+// receiver answers with a one-byte verdict, so neither side counts a stripe that arrived damaged.
+typedef struct 
+{ 
+  const char* peer_ip; 
+  int port; 
+  uint64_t transfer_id; 
+  int fd; 
+  const uint8_t* map; 
+  int index; 
+  int count; 
+  off_t offset; 
+  off_t length; 
+  off_t resume; 
+  off_t received; 
+  uint32_t crc; 
+  int sock; 
+  transfer_flow* flow; 
+  long long ready_us; 
+  long long first_byte_us; 
+  bool sending; 
+  bool compress; 
+  bool ok; 
+} stream_job;
+
+// Control messages that must arrive carry a FIELD_MESSAGE_ID and are answered with a CONTROL_ACK
+// naming it. The sender re-sends until acknowledged, waiting a timeout derived from the round
+// trips it has measured to that node (RFC 6298), and the receiver drops IDs it has already seen.
+typedef struct { struct in_addr addr; bool measured; int srtt_ms; int rttvar_ms; int rto_ms; } rtt_estimate;
+rtt_estimate G_RTT[MAX_RTT_ESTIMATES];
+int G_RTT_COUNT = 0;
+pthread_mutex_t G_RTT_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+uint64_t G_RECENT_IDS[RECENT_MESSAGE_IDS];
+int G_RECENT_NEXT = 0;
+pthread_mutex_t G_RECENT_IDS_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+
+// One node a broadcast is for, and whether it has acknowledged it yet
+typedef struct { struct sockaddr_in addr; bool acked; } broadcast_target;
+
+// A transfer announcement sent on the session, waiting for the CR's answer to its ID
+typedef struct reply_waiter { uint64_t transfer_id; control_message reply; bool answered; struct reply_waiter* next; } reply_waiter;
+
+// The long-lived TCP session with the CR. Commands and their replies travel on it as control frames
+// instead of one datagram each, heartbeats keep it open,
+// and data connections to the CR that finished cleanly wait here for the next transfer. The
+// session thread alone connects and closes 'sock', holding both locks while it does.
+typedef struct
+{
+  char cr_ip[MAX_IP_LENGTH];
+  int sock;
+  long long last_sent_ms;
+  long long last_heard_ms;
+  reply_waiter* waiters;
+  int idle_socks[SESSION_POOL_SIZE];
+  long long idle_since_ms[SESSION_POOL_SIZE];
+  int idle_count;
+  pthread_mutex_t mutex;
+  pthread_mutex_t send_mutex;
+  pthread_cond_t answered;
+} cr_session;
+cr_session G_CR_SESSION = { .sock = -1, .mutex = PTHREAD_MUTEX_INITIALIZER, .send_mutex = PTHREAD_MUTEX_INITIALIZER, .answered = PTHREAD_COND_INITIALIZER };
+
+// Function Prototypes
+int track_active_download(uint64_t transfer_id, int* port, int* stream_count);
+void set_active_download_port(uint64_t transfer_id, int port, int stream_count);
+void end_active_download(uint64_t transfer_id);
+void send_ready_reply(int reply_sock, const struct sockaddr_in* reply_addr, uint64_t transfer_id, int port, int stream_count, bool compress);
+bool is_ip_in_table(const char* ip_to_check);
+bool add_member_ip(const char* ip, struct in_addr* addr);
+bool receive_control(int sock, control_message* message, struct sockaddr_in* sender_addr);
+int control_rto_ms(struct in_addr addr);
+rtt_estimate* find_rtt_estimate(struct in_addr addr);
+void record_rtt_sample(struct in_addr addr, long long sample_ms);
+bool remember_message_id(uint64_t id);
+bool acknowledge_message(int sock, const struct sockaddr_in* sender_addr, const control_message* message);
+bool send_reliable(const char* dest_ip, int port, const control_frame* message);
+int parse_ready_reply(const control_message* reply, uint64_t transfer_id, int* stream_count, bool* compress);
+int await_ready_reply(int udp_sock, const struct sockaddr_in* peer_addr, uint64_t transfer_id, int wait_ms, int* stream_count, bool* compress);
+bool recv_all(int sock, void* buffer, size_t length);
+bool send_all(int sock, const void* buffer, size_t length);
+bool recv_all_within(int sock, void* buffer, size_t length, int seconds);
+transfer_flow* open_flow(transfer_priority priority, struct in_addr peer);
+void close_flow(transfer_flow* flow);
+size_t flow_quantum(transfer_flow* flow, size_t want);
+void throttle_flow(transfer_flow* flow, size_t bytes);
+void print_stats(void);
+bool send_file_zero_copy(int sock, int fd, const uint8_t* map, off_t offset, off_t count, uint32_t* crc, transfer_flow* flow);
+uint32_t combine_stripe_checksums(const stream_job* jobs, int count);
+int connect_data_stream(const char* peer_ip, int port, uint64_t transfer_id, int stream_index, int stream_count);
+bool load_resume_state(const char* part_path, long long filesize, long long mtime, int* stream_count, off_t* have);
+void save_resume_state(const char* part_path, long long filesize, long long mtime, int stream_count, const off_t* have);
+bool settle_partial_file(int fd, const char* part_path, const char* save_path, long long filesize, long long mtime, const stream_job* jobs, int stream_count);
+bool receive_range(int sock, int fd, off_t offset, off_t length, off_t* received, uint32_t* crc, transfer_flow* flow);
+bool send_range_compressed(int sock, int fd, off_t offset, off_t length, uint32_t* crc, transfer_flow* flow);
+bool receive_range_compressed(int sock, int fd, off_t offset, off_t length, off_t* received, uint32_t* crc, transfer_flow* flow);
+void* data_stream_thread(void* arg);
+bool run_data_streams(stream_job* jobs, int count);
+void execute_tcp_upload(const char* dest_ip, int port, const char* filepath, uint64_t transfer_id, int stream_count, bool compress);
+int request_transfer_port(const char* dest_ip, int port, const control_frame* command, uint64_t transfer_id, int* stream_count, bool* compress);
+void initiate_file_transfer(const char* dest_ip, int port, const char* filepath, const char* self_ip, bool offer_hash);
+bool is_batch_path(const char* path);
+int collect_batch_files(const char* path, glob_t* matches, const char*** files, long long* total_bytes);
+int open_prefetched(const char* path);
+bool send_batch_file(int sock, int fd, const char* name, const struct stat* file_stat, transfer_flow* flow);
+void execute_batch_upload(const char* dest_ip, int port, const char** files, int file_count, uint64_t transfer_id);
+void initiate_batch_transfer(const char* dest_ip, int port, const char* path, const char* self_ip);
+void execute_tcp_download(const char* source_ip, int port, const char* save_as_filename, uint64_t transfer_id, long long filesize, int offered_streams, long long mtime, bool compress, long long expected_crc);
+void receive_listing(const char* cr_ip, int port, uint64_t listing_id, const char* title);
+int connect_relay_hop(const char* filename, long long filesize, const char* origin_ip, const struct in_addr* hops, int hop_count, int* next_hop);
+void* relay_chain_thread(void* arg);
+void relay_to_all(const char* filepath, const char* self_ip);
+int compare_broadcast_targets(const void* a, const void* b);
+int collect_broadcast_targets(int nu_port, int cr_port, broadcast_target** targets);
+bool send_broadcast_multicast(int sock, const control_frame* frame, int nu_port, int cr_port);
+void send_broadcast_unicast(int sock, const broadcast_target* targets, int count, const control_frame* frame, const ip_set* only);
+int deliver_broadcast(broadcast_target* targets, int count, const control_frame* message, int nu_port, int cr_port);
+void broadcast_message(const control_frame* message, int nu_port, int cr_port);
+int build_table_chunks(control_frame** chunks);
+bool send_ip_table(const char* dest_ip, int port);
+void* table_pull_thread(void* arg);
+void answer_table_pull(struct in_addr node);
+bool change_membership(control_type type, struct in_addr addr, control_frame* update);
+void broadcast_ip_table(void);
+void add_node(const char* ip);
+void remove_node(const char* ip);
+int open_download_listener(int backlog, int* port);
+void* tcp_download_thread(void* arg);
+int receive_batch(int sock, const char* save_dir, transfer_flow* flow);
+void* batch_download_thread(void* arg);
+int session_connect(const char* cr_ip);
+bool session_send(const char* cr_ip, const control_frame* message);
+bool send_cr_command(const char* cr_ip, int port, const control_frame* message);
+bool session_exchange(const char* cr_ip, const control_frame* command, uint64_t transfer_id, int wait_ms, control_message* reply);
+bool session_deliver_reply(const control_message* message);
+int take_idle_data_socket(const char* peer_ip, int port);
+void release_data_socket(const char* peer_ip, int port, int sock, bool reusable);
+void expire_idle_data_sockets(bool all);
+void close_cr_session(void);
+void handle_cr_reply(const control_message* message, const char* cr_ip, const char* title);
+void* cr_reply_thread(void* arg);
+void* cr_session_thread(void* arg);
+void start_cr_session(const char* cr_ip);
+void* listener_thread_func(void* arg);
+
+// Returns 1 when the ID is newly tracked, 0 when it is already being served (its listening
+// port, or 0 while still binding, and its stream count are stored), and -1 when the table is full.
+int track_active_download(uint64_t transfer_id, int* port, int* stream_count)
+{
+  int result = -1;
+  pthread_mutex_lock(&G_ACTIVE_DOWNLOADS_MUTEX);
+  int free_slot = -1;
+  for (int i = 0; i < MAX_ACTIVE_DOWNLOADS && result < 0; ++i)
+  {
+    if (G_ACTIVE_DOWNLOADS[i].in_use && G_ACTIVE_DOWNLOADS[i].transfer_id == transfer_id) 
+    {
+      *port = G_ACTIVE_DOWNLOADS[i].port;
+      *stream_count = G_ACTIVE_DOWNLOADS[i].stream_count;
+      result = 0;
+    }
+    else if (!G_ACTIVE_DOWNLOADS[i].in_use && free_slot < 0) free_slot = i;
+  }
+  if (result < 0 && free_slot >= 0)
+  {
+    G_ACTIVE_DOWNLOADS[free_slot] = (active_download){ .in_use = true, .transfer_id = transfer_id, .port = 0 };
+    result = 1;
+  }
+  pthread_mutex_unlock(&G_ACTIVE_DOWNLOADS_MUTEX);
+  return result;
+}
+
+void set_active_download_port(uint64_t transfer_id, int port, int stream_count)
+{
+  pthread_mutex_lock(&G_ACTIVE_DOWNLOADS_MUTEX);
+  for (int i = 0; i < MAX_ACTIVE_DOWNLOADS; ++i)
+  {
+    if (G_ACTIVE_DOWNLOADS[i].in_use && G_ACTIVE_DOWNLOADS[i].transfer_id == transfer_id) 
+    {
+      G_ACTIVE_DOWNLOADS[i].port = port;
+      G_ACTIVE_DOWNLOADS[i].stream_count = stream_count;
+    }
+  }
+  pthread_mutex_unlock(&G_ACTIVE_DOWNLOADS_MUTEX);
+}
+
+void end_active_download(uint64_t transfer_id)
+{
+  pthread_mutex_lock(&G_ACTIVE_DOWNLOADS_MUTEX);
+  for (int i = 0; i < MAX_ACTIVE_DOWNLOADS; ++i)
+  {
+    if (G_ACTIVE_DOWNLOADS[i].in_use && G_ACTIVE_DOWNLOADS[i].transfer_id == transfer_id) G_ACTIVE_DOWNLOADS[i].in_use = false;
+  }
+  pthread_mutex_unlock(&G_ACTIVE_DOWNLOADS_MUTEX);
+}
+
+bool recv_all(int sock, void* buffer, size_t length)
+{
+  size_t received = 0;
+  while (received < length)
+  {
+    ssize_t n = recv(sock, (char*)buffer + received, length - received, 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    received += n;
+  }
+  return true;
+}
+
+bool send_all(int sock, const void* buffer, size_t length)
+{
+  size_t sent = 0;
+  while (sent < length)
+  {
+    ssize_t n = send(sock, (const char*)buffer + sent, length - sent, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    sent += n;
+  }
+  return true;
+}
+
+// For a reply the peer sends only after slow work of its own, such as committing an upload's
+// record or hearing back from the rest of a relay chain; the usual stall timeout is restored afterwards.
+bool recv_all_within(int sock, void* buffer, size_t length, int seconds)
+{
+  struct timeval wait = { .tv_sec = seconds, .tv_usec = 0 };
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+  bool ok = recv_all(sock, buffer, length);
+  struct timeval stall_timeout = { .tv_sec = DATA_CONNECT_TIMEOUT, .tv_usec = 0 };
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &stall_timeout, sizeof(stall_timeout));
+  return ok;
+}
+
+// Scheduling
+// Every transfer is a flow in a priority class: interactive (fback), bulk (fnu, fsu, fdel and
+// batches) or background (fall relays). DBIN_RATE_LIMIT_KBPS caps all of a node's transfers
+// together and DBIN_PEER_RATE_LIMIT_KBPS those with any one node. Active flows share each limit in
+// proportion to their class's weight, so an fback keeps most of the link while a backup runs,
+// and each flow's stripes draw on one token bucket that refills at the flow's share. With
+// neither limit set no flows are kept and transfers run unmetered.
+
+// Registers a transfer with 'peer'; NULL when no limit is set, which every caller treats as unmetered.
+transfer_flow* open_flow(transfer_priority priority, struct in_addr peer)
+{
+  if (G_SCHEDULER.global_rate == 0 && G_SCHEDULER.peer_rate == 0) return NULL;
+  transfer_flow* flow = calloc(1, sizeof(transfer_flow));
+  if (!flow) return NULL;
+  flow->priority = priority;
+  flow->peer = peer;
+  flow->refilled_ms = monotonic_ms();
+  pthread_mutex_lock(&G_SCHEDULER.mutex);
+  flow->next = G_SCHEDULER.flows;
+  G_SCHEDULER.flows = flow;
+  rebalance_flows();
+  pthread_mutex_unlock(&G_SCHEDULER.mutex);
+  return flow;
+}
+
+void close_flow(transfer_flow* flow)
+{
+  if (!flow) return;
+  pthread_mutex_lock(&G_SCHEDULER.mutex);
+  transfer_flow** link = &G_SCHEDULER.flows;
+  while (*link && *link != flow) link = &(*link)->next;
+  if (*link) *link = flow->next;
+  rebalance_flows();
+  pthread_mutex_unlock(&G_SCHEDULER.mutex);
+  free(flow);
+}
+
+// Caps one send or receive at the flow's quantum, so the bucket is checked often enough to follow
+// its share as other flows come and go.
+size_t flow_quantum(transfer_flow* flow, size_t want)
+{
+  if (!flow) return want;
+  pthread_mutex_lock(&G_SCHEDULER.mutex);
+  size_t quantum = rate_quantum(flow->rate);
+  pthread_mutex_unlock(&G_SCHEDULER.mutex);
+  return want < quantum ? want : quantum;
+}
+
+// Draws what was just moved from the flow's bucket and sleeps off any shortfall. Stripes of the
+// same flow share the bucket, so together they keep to the flow's rate.
+void throttle_flow(transfer_flow* flow, size_t bytes)
+{
+  if (!flow) return;
+  pthread_mutex_lock(&G_SCHEDULER.mutex);
+  long long now = monotonic_ms();
+  double burst = rate_quantum(flow->rate);
+  flow->tokens += (now - flow->refilled_ms) * flow->rate / 1000.0;
+  if (flow->tokens > burst) flow->tokens = burst;
+  flow->refilled_ms = now;
+  flow->tokens -= bytes;
+  long long wait_ms = flow->tokens < 0 ? (long long)(-flow->tokens * 1000.0 / flow->rate) + 1 : 0;
+  pthread_mutex_unlock(&G_SCHEDULER.mutex);
+  if (wait_ms > 0) usleep(wait_ms * 1000);
+}
+
+// stats: the same figures as the metrics endpoint, for a person at the terminal.
+void print_stats(void)
+{
+  printf("Transfers: %lld active, %llu completed, %llu failed\n", (long long)atomic_load(&G_METRICS.active_transfers), (unsigned long long)atomic_load(&G_METRICS.transfers_completed), (unsigned long long)atomic_load(&G_METRICS.transfers_failed));
+  printf("Payload: %.1f MiB sent, %.1f MiB received\n", atomic_load(&G_METRICS.bytes_sent) / 1048576.0, atomic_load(&G_METRICS.bytes_received) / 1048576.0);
+  for (size_t h = 0; h < METRIC_MAX_HISTOGRAMS && G_METRICS.histograms[h]; ++h)
+  {
+    metric_histogram* histogram = G_METRICS.histograms[h];
+    uint64_t count = atomic_load(&histogram->count);
+    printf("%-16s n=%llu", histogram->label, (unsigned long long)count);
+    if (count > 0) 
+    {
+      printf(" p50=%.1f p90=%.1f p99=%.1f max=%.1f %s", histogram_percentile(histogram, 0.5) * histogram->display_scale, histogram_percentile(histogram, 0.9) * histogram->display_scale,
+             histogram_percentile(histogram, 0.99) * histogram->display_scale, atomic_load(&histogram->max) * histogram->display_scale, histogram->display_unit);
+    }
+    printf("\n");
+  }
+}
+
+// TCP Transfer and Handshake Functions
+// Pushes 'count' bytes of 'fd' starting at 'offset' into 'sock' without staging them in user space.
+// sendfile(2) is tried first; splice(2) through a pipe covers sources sendfile refuses, and a
+// plain read/send loop is kept as the last resort. What is sent is added to 'crc', read back
+// through 'map' on the zero-copy paths; without a mapping only the copy loop can checksum.
+bool send_file_zero_copy(int sock, int fd, const uint8_t* map, off_t offset, off_t count, uint32_t* crc, transfer_flow* flow)
+{
+  off_t end = offset + count;
+  while (map && offset < end)
+  {
+    ssize_t sent = sendfile(sock, fd, &offset, flow_quantum(flow, (size_t)(end - offset)));
+    if (sent > 0) 
+    {
+      *crc = crc32c_update(*crc, map + offset - sent, sent);
+      throttle_flow(flow, sent);
+      metric_add(&G_METRICS.bytes_sent, sent);
+      continue;
+    }
+    if (sent < 0 && errno == EINTR) continue;
+    if (sent == 0) return false;
+    if (errno != EINVAL && errno != ENOSYS) 
+    { 
+      perror("sendfile"); 
+      return false; 
+    }
+    break;
+  }
+  if (offset >= end) return true;
+
+  int pipe_fds[2];
+  if (map && pipe(pipe_fds) == 0)
+  {
+    bool ok = true;
+    while (ok && offset < end)
+    {
+      ssize_t in_pipe = splice(fd, &offset, pipe_fds[1], NULL, flow_quantum(flow, (size_t)(end - offset)), SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (in_pipe <= 0) 
+      {
+        if (in_pipe < 0 && errno == EINTR) continue;
+        ok = false;
+        break;
+      }
+      *crc = crc32c_update(*crc, map + offset - in_pipe, in_pipe);
+      throttle_flow(flow, in_pipe);
+      metric_add(&G_METRICS.bytes_sent, in_pipe);
+      while (in_pipe > 0)
+      {
+        ssize_t out = splice(pipe_fds[0], NULL, sock, NULL, (size_t)in_pipe, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (out <= 0) 
+        { 
+          if (out < 0 && errno == EINTR) continue;
+          perror("splice"); 
+          close(pipe_fds[0]); close(pipe_fds[1]);
+          return false; 
+        }
+        in_pipe -= out;
+      }
+    }
+    close(pipe_fds[0]); close(pipe_fds[1]);
+    if (ok) return true;
+  }
+
+  char buffer[MAX_CHUNK_SIZE];
+  while (offset < end)
+  {
+    size_t want = (size_t)(end - offset) < sizeof(buffer) ? (size_t)(end - offset) : sizeof(buffer);
+    ssize_t bytes_read = pread(fd, buffer, flow_quantum(flow, want), offset);
+    if (bytes_read <= 0) return false;
+    *crc = crc32c_update(*crc, buffer, bytes_read);
+    // A short send would otherwise leave a gap in the stream that the offset has already passed
+    if (!send_all(sock, buffer, bytes_read)) 
+    { 
+      perror("TCP send"); 
+      return false; 
+    }
+    throttle_flow(flow, bytes_read);
+    metric_add(&G_METRICS.bytes_sent, bytes_read);
+    offset += bytes_read;
+  }
+  return true;
+}
+
+int connect_data_stream(const char* peer_ip, int port, uint64_t transfer_id, int stream_index, int stream_count)
+{
+  transfer_hello hello = { .stream_index = htons(stream_index), .stream_count = htons(stream_count), .transfer_id = htobe64(transfer_id) };
+  memcpy(hello.magic, TRANSFER_MAGIC, sizeof(hello.magic));
+  // A connection an earlier transfer left open skips the handshake and starts on a warm window
+  int sock = take_idle_data_socket(peer_ip, port);
+  if (sock >= 0 && send(sock, &hello, sizeof(hello), MSG_NOSIGNAL) == (ssize_t)sizeof(hello)) return sock;
+  if (sock >= 0) close(sock);
+  sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (sock < 0) 
+  { 
+    perror("TCP socket"); 
+    return -1; 
+  }
+  struct sockaddr_in peer_addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+  inet_pton(AF_INET, peer_ip, &peer_addr.sin_addr);
+  if (connect(sock, (struct sockaddr*)&peer_addr, sizeof(peer_addr)) < 0) 
+  {
+    perror("TCP connect"); close(sock); return -1;
+  }
+  // A stalled link ends the attempt (keeping what arrived) instead of hanging the stream forever
+  struct timeval stall_timeout = { .tv_sec = DATA_CONNECT_TIMEOUT, .tv_usec = 0 };
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &stall_timeout, sizeof(stall_timeout));
+  setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &stall_timeout, sizeof(stall_timeout));
+  if (send(sock, &hello, sizeof(hello), MSG_NOSIGNAL) != (ssize_t)sizeof(hello)) 
+  {
+    perror("TCP send hello"); close(sock); return -1;
+  }
+  return sock;
+}
+
+// Resume State
+// '<file>.part.meta' records how much of each stripe of '<file>.part' is already on disk, so a
+// later attempt at the same file (same size and modification time) continues where it stopped.
+bool load_resume_state(const char* part_path, long long filesize, long long mtime, int* stream_count, off_t* have)
+{
+  char meta_path[MAX_FILEPATH_LENGTH + 16];
+  snprintf(meta_path, sizeof(meta_path), "%s.meta", part_path);
+  FILE* meta = fopen(meta_path, "r");
+  if (!meta) return false;
+  long long saved_size, saved_mtime;
+  int saved_streams;
+  bool ok = fscanf(meta, "DBRESUME %lld %lld %d", &saved_size, &saved_mtime, &saved_streams) == 3 && saved_size == filesize && saved_mtime == mtime && saved_streams >= 1 && saved_streams <= MAX_STREAMS;
+  for (int i = 0; ok && i < saved_streams; ++i)
+  {
+    long long held;
+    off_t offset, length;
+    stripe_range(filesize, saved_streams, i, &offset, &length);
+    ok = fscanf(meta, "%lld", &held) == 1 && held >= 0 && held <= length;
+    if (ok) have[i] = held;
+  }
+  fclose(meta);
+  struct stat part_stat;
+  if (ok && (stat(part_path, &part_stat) < 0 || part_stat.st_size != filesize)) ok = false;
+  if (ok) *stream_count = saved_streams;
+  return ok;
+}
+
+void save_resume_state(const char* part_path, long long filesize, long long mtime, int stream_count, const off_t* have)
+{
+  char meta_path[MAX_FILEPATH_LENGTH + 16], temp_path[MAX_FILEPATH_LENGTH + 24];
+  snprintf(meta_path, sizeof(meta_path), "%s.meta", part_path);
+  snprintf(temp_path, sizeof(temp_path), "%s.tmp", meta_path);
+  FILE* meta = fopen(temp_path, "w");
+  if (!meta) 
+  { 
+    perror("fopen resume state"); 
+    return; 
+  }
+  fprintf(meta, "DBRESUME %lld %lld %d", filesize, mtime, stream_count);
+  for (int i = 0; i < stream_count; ++i) fprintf(meta, " %lld", (long long)have[i]);
+  fprintf(meta, "\n");
+  if (fclose(meta) == 0) rename(temp_path, meta_path);
+}
+
+// Flushes what the streams delivered, then either publishes the finished file or records the
+// per-stripe progress for a later resume. Returns true when the file is complete.
+bool settle_partial_file(int fd, const char* part_path, const char* save_path, long long filesize, long long mtime, const stream_job* jobs, int stream_count)
+{
+  off_t have[MAX_STREAMS];
+  long long held = 0;
+  bool complete = true;
+  fdatasync(fd);
+  close(fd);
+  for (int i = 0; i < stream_count; ++i)
+  {
+    have[i] = jobs[i].resume + jobs[i].received;
+    held += have[i];
+    complete = complete && have[i] == jobs[i].length;
+  }
+  char meta_path[MAX_FILEPATH_LENGTH + 16];
+  snprintf(meta_path, sizeof(meta_path), "%s.meta", part_path);
+  if (complete && rename(part_path, save_path) == 0)
+  {
+    remove(meta_path);
+    return true;
+  }
+  save_resume_state(part_path, filesize, mtime, stream_count, have);
+  fprintf(stderr, "'%s' interrupted; %lld of %lld bytes kept for resume.\n", save_path, held, filesize);
+  return false;
+}
+
+// Writes up to 'length' bytes from the socket at 'offset', so stripes can land in any order, and
+// counts what arrived in 'received' even when the stream breaks early.
+bool receive_range(int sock, int fd, off_t offset, off_t length, off_t* received, uint32_t* crc, transfer_flow* flow)
+{
+  char buffer[STREAM_BUFFER_SIZE];
+  off_t end = offset + length;
+  while (offset < end)
+  {
+    size_t want = (size_t)(end - offset) < sizeof(buffer) ? (size_t)(end - offset) : sizeof(buffer);
+    ssize_t n = recv(sock, buffer, flow_quantum(flow, want), 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    if (pwrite(fd, buffer, n, offset) != n) 
+    { 
+      perror("pwrite"); 
+      return false; 
+    }
+    throttle_flow(flow, n);
+    metric_add(&G_METRICS.bytes_received, n);
+    *crc = crc32c_update(*crc, buffer, n);
+    offset += n;
+    *received += n;
+  }
+  return true;
+}
+
+// Sends a range as compressed frames; chunks are read with pread so stripes can share the descriptor.
+bool send_range_compressed(int sock, int fd, off_t offset, off_t length, uint32_t* crc, transfer_flow* flow)
+{
+  uint8_t* raw = malloc(COMPRESS_CHUNK_SIZE);
+  uint8_t* frame = malloc(COMPRESS_FRAME_HEADER + COMPRESS_CHUNK_SIZE);
+  int incompressible_run = 0;
+  bool ok = raw && frame;
+  off_t end = offset + length;
+  while (ok && offset < end)
+  {
+    size_t want = (size_t)(end - offset) < COMPRESS_CHUNK_SIZE ? (size_t)(end - offset) : COMPRESS_CHUNK_SIZE;
+    ssize_t n = pread(fd, raw, want, offset);
+    if (n <= 0) 
+    {
+      ok = false;
+      break;
+    }
+    *crc = crc32c_update(*crc, raw, n);
+    size_t frame_length = encode_chunk(raw, n, frame, &incompressible_run);
+    ok = send_all(sock, frame, frame_length);
+    throttle_flow(flow, frame_length);
+    metric_add(&G_METRICS.bytes_sent, frame_length);
+    offset += n;
+  }
+  free(raw);
+  free(frame);
+  return ok;
+}
+
+// Counterpart of receive_range for compressed streams; 'received' only counts whole decoded
+// chunks, so a broken stream resumes at a chunk boundary.
+bool receive_range_compressed(int sock, int fd, off_t offset, off_t length, off_t* received, uint32_t* crc, transfer_flow* flow)
+{
+  uint8_t* packed = malloc(COMPRESS_CHUNK_SIZE);
+  uint8_t* raw = malloc(COMPRESS_CHUNK_SIZE);
+  bool ok = packed && raw;
+  off_t end = offset + length;
+  while (ok && offset < end)
+  {
+    uint32_t header[2];
+    if (!recv_all(sock, header, sizeof(header))) 
+    {
+      ok = false;
+      break;
+    }
+    size_t raw_length = ntohl(header[0]), packed_length = ntohl(header[1]);
+    ok = raw_length > 0 && raw_length <= COMPRESS_CHUNK_SIZE && (off_t)raw_length <= end - offset && packed_length <= raw_length && recv_all(sock, packed, packed_length);
+    if (ok && packed_length < raw_length && !(ok = lz_decompress(packed, packed_length, raw, raw_length))) fprintf(stderr, "Corrupt compressed frame received.\n");
+    if (ok && pwrite(fd, packed_length < raw_length ? raw : packed, raw_length, offset) != (ssize_t)raw_length) 
+    { 
+      perror("pwrite"); 
+      ok = false; 
+    }
+    if (!ok) break;
+    throttle_flow(flow, COMPRESS_FRAME_HEADER + packed_length);
+    metric_add(&G_METRICS.bytes_received, COMPRESS_FRAME_HEADER + packed_length);
+    *crc = crc32c_update(*crc, packed_length < raw_length ? raw : packed, raw_length);
+    offset += raw_length;
+    *received += raw_length;
+  }
+  free(packed);
+  free(raw);
+  return ok;
+}
+
+void* data_stream_thread(void* arg)
+{
+  stream_job* job = (stream_job*)arg;
+  if (job->sock < 0) job->sock = connect_data_stream(job->peer_ip, job->port, job->transfer_id, job->index, job->count);
+  if (job->sock < 0) 
+  {
+    job->ok = false;
+    return NULL;
+  }
+  uint64_t resume_frame;
+  uint32_t checksum_frame;
+  char verdict = 0;
+  job->crc = 0;
+  if (job->sending)
+  {
+    job->ok = recv_all(job->sock, &resume_frame, sizeof(resume_frame)) && be64toh(resume_frame) <= (uint64_t)job->length;
+    if (job->ok) 
+    {
+      // The checksum covers the whole stripe, including whatever an earlier attempt delivered
+      job->resume = be64toh(resume_frame);
+      if (job->map) job->crc = crc32c_update(0, job->map + job->offset, job->resume);
+      else job->ok = crc32c_file_range(job->fd, job->offset, job->resume, &job->crc);
+    }
+    if (job->ok && job->compress) job->ok = send_range_compressed(job->sock, job->fd, job->offset + job->resume, job->length - job->resume, &job->crc, job->flow);
+    else if (job->ok) job->ok = send_file_zero_copy(job->sock, job->fd, job->map, job->offset + job->resume, job->length - job->resume, &job->crc, job->flow);
+    checksum_frame = htonl(job->crc);
+    // The repository answers an upload's last stripe only once the file's record has committed
+    job->ok = job->ok && send_all(job->sock, &checksum_frame, sizeof(checksum_frame)) && recv_all_within(job->sock, &verdict, 1, DURABLE_REPLY_TIMEOUT) && verdict == TRANSFER_VERDICT_OK;
+    if (verdict == TRANSFER_VERDICT_BAD) fprintf(stderr, "Stream %d failed its checksum at the receiver.\n", job->index);
+  }
+  else
+  {
+    resume_frame = htobe64(job->resume);
+    job->ok = send(job->sock, &resume_frame, sizeof(resume_frame), MSG_NOSIGNAL) == (ssize_t)sizeof(resume_frame) && crc32c_file_range(job->fd, job->offset, job->resume, &job->crc);
+    // The first payload byte is timed as it arrives, without taking it off the socket
+    char first_byte;
+    if (job->ok && job->ready_us > 0 && job->length > job->resume && recv(job->sock, &first_byte, 1, MSG_PEEK) == 1) job->first_byte_us = monotonic_us();
+    if (job->ok && job->compress) job->ok = receive_range_compressed(job->sock, job->fd, job->offset + job->resume, job->length - job->resume, &job->received, &job->crc, job->flow);
+    else if (job->ok) job->ok = receive_range(job->sock, job->fd, job->offset + job->resume, job->length - job->resume, &job->received, &job->crc, job->flow);
+    if (job->ok && recv_all(job->sock, &checksum_frame, sizeof(checksum_frame)))
+    {
+      job->ok = ntohl(checksum_frame) == job->crc;
+      verdict = job->ok ? TRANSFER_VERDICT_OK : TRANSFER_VERDICT_BAD;
+      send(job->sock, &verdict, 1, MSG_NOSIGNAL);
+      if (!job->ok)
+      {
+        // Nothing in a damaged stripe can be trusted, so the next attempt sends all of it
+        fprintf(stderr, "Stream %d failed its checksum; its stripe will be sent again in full.\n", job->index);
+        job->resume = 0;
+        job->received = 0;
+      }
+    }
+    else job->ok = false;
+  }
+  release_data_socket(job->peer_ip, job->port, job->sock, job->ok);
+  job->sock = -1;
+  return NULL;
+}
+
+// The whole file's CRC32C, from the stripe checksums of a finished transfer.
+uint32_t combine_stripe_checksums(const stream_job* jobs, int count)
+{
+  uint32_t crc = 0;
+  for (int i = 0; i < count; ++i) crc = crc32c_combine(crc, jobs[i].crc, jobs[i].length);
+  return crc;
+}
+
+// Runs every stripe on its own thread (the first on the caller's) and reports whether all completed.
+bool run_data_streams(stream_job* jobs, int count)
+{
+  long long started_us = metrics_transfer_started();
+  pthread_t stream_tids[MAX_STREAMS];
+  bool started[MAX_STREAMS] = { false };
+  for (int i = 1; i < count; ++i) started[i] = pthread_create(&stream_tids[i], NULL, data_stream_thread, &jobs[i]) == 0;
+  data_stream_thread(&jobs[0]);
+  bool ok = jobs[0].ok;
+  for (int i = 1; i < count; ++i)
+  {
+    if (started[i]) pthread_join(stream_tids[i], NULL);
+    else data_stream_thread(&jobs[i]);
+    ok = ok && jobs[i].ok;
+  }
+  // Time to first byte is the earliest of the stripes', from when the receiving end was ready
+  long long bytes = 0, first_byte_us = 0;
+  for (int i = 0; i < count; ++i)
+  {
+    bytes += jobs[i].length - jobs[i].resume;
+    if (jobs[i].first_byte_us > 0 && (first_byte_us == 0 || jobs[i].first_byte_us < first_byte_us)) first_byte_us = jobs[i].first_byte_us;
+  }
+  if (first_byte_us > 0) histogram_record(&G_METRICS.first_byte, first_byte_us - jobs[0].ready_us);
+  metrics_transfer_finished(started_us, bytes, ok);
+  return ok;
+}
+
+void execute_tcp_upload(const char* dest_ip, int port, const char* filepath, uint64_t transfer_id, int stream_count, bool compress) 
+{
+  int fd = open(filepath, O_RDONLY);
+  struct stat file_stat;
+  if (fd < 0 || fstat(fd, &file_stat) < 0) 
+  { 
+    perror("open"); 
+    if (fd >= 0) close(fd);
+    return; 
+  }
+  // sendfile and splice take explicit offsets, so every stripe can share the one descriptor; the
+  // checksums read the same pages through a mapping instead of copying them out
+  const uint8_t* map = file_stat.st_size > 0 ? mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0) : NULL;
+  if (map == MAP_FAILED) map = NULL;
+  struct in_addr dest_addr = { .s_addr = 0 };
+  inet_pton(AF_INET, dest_ip, &dest_addr);
+  transfer_flow* flow = open_flow(PRIORITY_BULK, dest_addr);
+  stream_job jobs[MAX_STREAMS];
+  for (int i = 0; i < stream_count; ++i)
+  {
+    jobs[i] = (stream_job){ .peer_ip = dest_ip, .port = port, .transfer_id = transfer_id, .fd = fd, .map = map, .index = i, .count = stream_count, .sock = -1, .flow = flow, .sending = true, .compress = compress };
+    stripe_range(file_stat.st_size, stream_count, i, &jobs[i].offset, &jobs[i].length);
+  }
+  bool sent_all = run_data_streams(jobs, stream_count);
+  close_flow(flow);
+  if (map) munmap((void*)map, file_stat.st_size);
+  close(fd);
+  long long skipped = 0;
+  for (int i = 0; i < stream_count; ++i) skipped += jobs[i].resume;
+  if (skipped > 0) printf("Resumed: %lld of %lld bytes were already at the receiver.\n", skipped, (long long)file_stat.st_size);
+  if (sent_all) printf("File transfer complete.\n");
+  else fprintf(stderr, "File transfer incomplete.\n");
+}
+
+void send_ready_reply(int reply_sock, const struct sockaddr_in* reply_addr, uint64_t transfer_id, int port, int stream_count, bool compress)
+{
+  control_frame reply;
+  control_begin(&reply, CONTROL_READY_TO_RECEIVE);
+  control_put_u64(&reply, FIELD_TRANSFER_ID, transfer_id);
+  control_put_u32(&reply, FIELD_PORT, port);
+  control_put_u32(&reply, FIELD_STREAMS, stream_count);
+  control_put_string(&reply, FIELD_CODEC, compress ? COMPRESSION_CODEC : "none");
+  send_control(reply_sock, reply_addr, &reply);
+}
+
+bool is_ip_in_table(const char* ip_to_check) 
+{
+  struct in_addr addr;
+  return inet_pton(AF_INET, ip_to_check, &addr) == 1 && ip_set_contains(&G_MEMBERS, addr);
+}
+
+// Adds an address typed at startup, reporting one that is not IPv4.
+bool add_member_ip(const char* ip, struct in_addr* addr)
+{
+  if (inet_pton(AF_INET, ip, addr) != 1) 
+  {
+    fprintf(stderr, "'%s' is not a valid IPv4 address.\n", ip);
+    return false;
+  }
+  if (!ip_set_add(&G_MEMBERS, *addr)) 
+  {
+    perror("membership set");
+    return false;
+  }
+  return true;
+}
+
+// Receives one datagram. Returns false unless it held exactly one valid frame.
+bool receive_control(int sock, control_message* message, struct sockaddr_in* sender_addr)
+{
+  uint8_t datagram[CONTROL_MAX_SIZE];
+  socklen_t sender_len = sizeof(*sender_addr);
+  ssize_t len = recvfrom(sock, datagram, sizeof(datagram), 0, (struct sockaddr*)sender_addr, &sender_len);
+  return len > 0 && control_decode(datagram, len, message) == len;
+}
+
+// Reliable Control Messages
+// The retransmit timeout for a node, from its round-trip estimate once one has been measured.
+int control_rto_ms(struct in_addr addr)
+{
+  int rto = CONTROL_RTO_INITIAL_MS;
+  pthread_mutex_lock(&G_RTT_MUTEX);
+  for (int i = 0; i < G_RTT_COUNT; ++i) 
+  {
+    if (G_RTT[i].addr.s_addr != addr.s_addr) continue;
+    rto = G_RTT[i].rto_ms;
+    break;
+  }
+  pthread_mutex_unlock(&G_RTT_MUTEX);
+  return rto;
+}
+
+// Returns the node's estimate, adding an unmeasured one if there is room. G_RTT_MUTEX must be held.
+rtt_estimate* find_rtt_estimate(struct in_addr addr)
+{
+  for (int i = 0; i < G_RTT_COUNT; ++i) 
+  {
+    if (G_RTT[i].addr.s_addr == addr.s_addr) return &G_RTT[i];
+  }
+  if (G_RTT_COUNT == MAX_RTT_ESTIMATES) return NULL;
+  rtt_estimate* estimate = &G_RTT[G_RTT_COUNT++];
+  *estimate = (rtt_estimate){ .addr = addr, .rto_ms = CONTROL_RTO_INITIAL_MS };
+  return estimate;
+}
+
+// Folds one round trip into the node's smoothed estimate and derives its retransmit timeout. Only
+// exchanges answered on their first send are sampled, since an answer to a re-sent message could
+// belong to either copy.
+void record_rtt_sample(struct in_addr addr, long long sample_ms)
+{
+  pthread_mutex_lock(&G_RTT_MUTEX);
+  rtt_estimate* estimate = find_rtt_estimate(addr);
+  if (estimate && !estimate->measured) 
+  {
+    estimate->srtt_ms = sample_ms;
+    estimate->rttvar_ms = sample_ms / 2;
+    estimate->measured = true;
+  }
+  else if (estimate)
+  {
+    long long deviation = estimate->srtt_ms > sample_ms ? estimate->srtt_ms - sample_ms : sample_ms - estimate->srtt_ms;
+    estimate->rttvar_ms = (3 * estimate->rttvar_ms + deviation) / 4;
+    estimate->srtt_ms = (7 * estimate->srtt_ms + sample_ms) / 8;
+  }
+  if (estimate)
+  {
+    int rto = estimate->srtt_ms + 4 * estimate->rttvar_ms;
+    estimate->rto_ms = rto < CONTROL_RTO_MIN_MS ? CONTROL_RTO_MIN_MS : rto > CONTROL_RTO_MAX_MS ? CONTROL_RTO_MAX_MS : rto;
+  }
+  pthread_mutex_unlock(&G_RTT_MUTEX);
+}
+
+// Returns false if the ID was seen recently, so a re-sent message is acted on only once.
+bool remember_message_id(uint64_t id)
+{
+  bool fresh = true;
+  pthread_mutex_lock(&G_RECENT_IDS_MUTEX);
+  for (int i = 0; i < RECENT_MESSAGE_IDS && fresh; ++i) 
+  {
+    if (G_RECENT_IDS[i] == id) fresh = false;
+  }
+  if (fresh)
+  {
+    G_RECENT_IDS[G_RECENT_NEXT] = id;
+    G_RECENT_NEXT = (G_RECENT_NEXT + 1) % RECENT_MESSAGE_IDS;
+  }
+  pthread_mutex_unlock(&G_RECENT_IDS_MUTEX);
+  return fresh;
+}
+
+// Acknowledges a message that carries an ID. Returns false for a duplicate, which has already been
+// acted on; messages without an ID pass through.
+bool acknowledge_message(int sock, const struct sockaddr_in* sender_addr, const control_message* message)
+{
+  if (!CONTROL_HAS(message, FIELD_MESSAGE_ID)) return true;
+  control_frame ack;
+  control_begin(&ack, CONTROL_ACK);
+  control_put_u64(&ack, FIELD_MESSAGE_ID, message->message_id);
+  send_control(sock, sender_addr, &ack);
+  return remember_message_id(message->message_id);
+}
+
+// Sends a datagram that must arrive. It is re-sent with a doubling timeout, starting from the
+// node's measured one, until the node acknowledges it. Returns false if it never did.
+bool send_reliable(const char* dest_ip, int port, const control_frame* message)
+{
+  uint64_t id = generate_transfer_id();
+  control_frame datagram = *message;
+  control_put_u64(&datagram, FIELD_MESSAGE_ID, id);
+  if (datagram.invalid) return false;
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0) 
+  {
+    perror("UDP socket");
+    return false;
+  }
+  struct sockaddr_in dest_addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+  inet_pton(AF_INET, dest_ip, &dest_addr.sin_addr);
+
+  bool acknowledged = false;
+  int rto_ms = control_rto_ms(dest_addr.sin_addr);
+  long long first_sent_ms = monotonic_ms();
+  for (int attempt = 0; attempt < CONTROL_MAX_ATTEMPTS && !acknowledged; ++attempt)
+  {
+    send_control(sock, &dest_addr, &datagram);
+    long long deadline = monotonic_ms() + rto_ms;
+    long long remaining;
+    while (!acknowledged && (remaining = deadline - monotonic_ms()) > 0)
+    {
+      struct pollfd pfd = { .fd = sock, .events = POLLIN };
+      if (poll(&pfd, 1, (int)remaining) <= 0) continue;
+      control_message reply;
+      struct sockaddr_in from_addr;
+      if (!receive_control(sock, &reply, &from_addr) || from_addr.sin_addr.s_addr != dest_addr.sin_addr.s_addr) continue;
+      acknowledged = reply.type == CONTROL_ACK && CONTROL_HAS(&reply, FIELD_MESSAGE_ID) && reply.message_id == id;
+    }
+    if (acknowledged && attempt == 0) record_rtt_sample(dest_addr.sin_addr, monotonic_ms() - first_sent_ms);
+    rto_ms = rto_ms * 2 > CONTROL_RTO_MAX_MS ? CONTROL_RTO_MAX_MS : rto_ms * 2;
+  }
+  close(sock);
+  return acknowledged;
+}
+
+// Reads the receiver's answer to a transfer announcement: the TCP port it names (with the stream
+// count and codec it granted), -2 for BUSY, -3 if it already holds the offered content, or -1 if
+// the message answers something else.
+int parse_ready_reply(const control_message* reply, uint64_t transfer_id, int* stream_count, bool* compress)
+{
+  if (!CONTROL_HAS(reply, FIELD_TRANSFER_ID) || reply->transfer_id != transfer_id) return -1;
+  if (reply->type == CONTROL_READY_TO_RECEIVE && CONTROL_HAS(reply, FIELD_PORT)) 
+  {
+    *stream_count = reply->streams;
+    *compress = strcmp(reply->codec, COMPRESSION_CODEC) == 0;
+    return reply->port;
+  }
+  if (reply->type == CONTROL_BUSY) return -2;
+  if (reply->type == CONTROL_STORED) return -3;
+  return -1;
+}
+
+// Waits up to 'wait_ms' for the receiver's READY_TO_RECEIVE for this transfer and returns the
+// TCP port it names (with the stream count and codec it granted), -2 if the receiver answered BUSY, -3 if
+// it already holds the offered content, or -1 if nothing arrived in time.
+int await_ready_reply(int udp_sock, const struct sockaddr_in* peer_addr, uint64_t transfer_id, int wait_ms, int* stream_count, bool* compress)
+{
+  long long deadline = monotonic_ms() + wait_ms;
+  long long remaining;
+  while ((remaining = deadline - monotonic_ms()) > 0)
+  {
+    struct pollfd pfd = { .fd = udp_sock, .events = POLLIN };
+    if (poll(&pfd, 1, (int)remaining) <= 0) continue;
+    control_message reply;
+    struct sockaddr_in from_addr;
+    if (!receive_control(udp_sock, &reply, &from_addr) || from_addr.sin_addr.s_addr != peer_addr->sin_addr.s_addr) continue;
+    int tcp_port = parse_ready_reply(&reply, transfer_id, stream_count, compress);
+    if (tcp_port != -1) return tcp_port;
+  }
+  return -1;
+}
+
+// Sends a transfer announcement until the receiver names the TCP port it listens on. The CR is
+// asked on its session when one is open, where nothing is lost and only a BUSY answer is worth
+// asking again. Otherwise the request goes over UDP, and unanswered requests are re-sent with
+// exponential backoff from the receiver's measured timeout; a BUSY receiver is asked again after
+// the same wait. Returns what
+// parse_ready_reply made of the last answer, or -1 when none came.
+int request_transfer_port(const char* dest_ip, int port, const control_frame* command, uint64_t transfer_id, int* stream_count, bool* compress)
+{
+  if (command->invalid) return -1;
+  long long started_us = monotonic_us();
+  control_message reply;
+  int session_wait_ms = HANDSHAKE_INITIAL_WAIT_MS;
+  for (int attempt = 0; attempt < HANDSHAKE_MAX_ATTEMPTS; ++attempt, session_wait_ms *= 2) 
+  {
+    if (!session_exchange(dest_ip, command, transfer_id, SESSION_REPLY_WAIT_MS, &reply)) break;
+    int tcp_port = parse_ready_reply(&reply, transfer_id, stream_count, compress);
+    if (tcp_port != -2 || attempt + 1 == HANDSHAKE_MAX_ATTEMPTS) 
+    {
+      if (tcp_port > 0) histogram_record(&G_METRICS.handshake, monotonic_us() - started_us);
+      return tcp_port;
+    }
+    usleep(session_wait_ms * 1000);
+  }
+
+  int udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in dest_addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+  inet_pton(AF_INET, dest_ip, &dest_addr.sin_addr);
+
+  int tcp_port = -1;
+  int wait_ms = control_rto_ms(dest_addr.sin_addr);
+  for (int attempt = 0; attempt < HANDSHAKE_MAX_ATTEMPTS && (tcp_port == -1 || tcp_port == -2); ++attempt, wait_ms *= 2) 
+  {
+    long long sent_ms = monotonic_ms();
+    send_control(udp_sock, &dest_addr, command);
+    tcp_port = await_ready_reply(udp_sock, &dest_addr, transfer_id, wait_ms, stream_count, compress);
+    if (tcp_port != -1 && attempt == 0) record_rtt_sample(dest_addr.sin_addr, monotonic_ms() - sent_ms);
+    if (tcp_port == -2 && attempt + 1 < HANDSHAKE_MAX_ATTEMPTS) usleep(wait_ms * 1000);
+  }
+  close(udp_sock);
+  if (tcp_port > 0) histogram_record(&G_METRICS.handshake, monotonic_us() - started_us);
+  return tcp_port;
+}
+
+// Announces the upload over UDP and connects as soon as the receiver answers with the port it
+// is listening on. With 'offer_hash'
+// the file's SHA-256 is announced too, so a repository already holding it can skip the data.
+// Compression is offered only when a sample of the file shrinks; the receiver has the final say.
+void initiate_file_transfer(const char* dest_ip, int port, const char* filepath, const char* self_ip, bool offer_hash) 
+{
+  struct stat file_stat;
+  if (stat(filepath, &file_stat) < 0) 
+  { 
+    perror("stat"); 
+    return; 
+  }
+    
+  const char* filename = basename((char*)filepath);
+  uint64_t transfer_id = generate_transfer_id();
+  int offered_streams = streams_for_size(file_stat.st_size);
+  char content_hash[SHA256_HEX_LENGTH + 1] = "";
+  if (offer_hash && !sha256_file(filepath, content_hash)) content_hash[0] = '\0';
+  bool offer_compression = false;
+  int sample_fd = G_COMPRESSION ? open(filepath, O_RDONLY) : -1;
+  if (sample_fd >= 0) 
+  {
+    offer_compression = sample_compressible(sample_fd, file_stat.st_size);
+    close(sample_fd);
+  }
+  control_frame command;
+  control_begin(&command, CONTROL_REQUEST_UPLOAD);
+  control_put_string(&command, FIELD_NAME, filename);
+  control_put_u64(&command, FIELD_SIZE, file_stat.st_size);
+  control_put_ip(&command, FIELD_SENDER_IP, self_ip);
+  control_put_u64(&command, FIELD_TRANSFER_ID, transfer_id);
+  control_put_u32(&command, FIELD_STREAMS, offered_streams);
+  control_put_u64(&command, FIELD_MTIME, file_stat.st_mtime);
+  if (content_hash[0]) control_put_hash(&command, FIELD_HASH, content_hash);
+  control_put_string(&command, FIELD_CODEC, offer_compression ? COMPRESSION_CODEC : "none");
+
+  int stream_count = 1;
+  bool compress = false;
+  int tcp_port = request_transfer_port(dest_ip, port, &command, transfer_id, &stream_count, &compress);
+  if (tcp_port == -2) 
+  {
+    printf("%s is busy, upload of '%s' not started. Retry later.\n", dest_ip, filename);
+    return;
+  }
+  if (tcp_port == -3) 
+  {
+    printf("'%s' is already held by %s; stored without sending any data.\n", filename, dest_ip);
+    return;
+  }
+  if (tcp_port < 0) 
+  {
+    printf("No reply from %s for '%s', upload aborted.\n", dest_ip, filename);
+    return;
+  }
+    
+  // A receiver holding a partial copy keeps that copy's stripe layout, which may differ from our offer
+  if (stream_count < 1 || stream_count > MAX_STREAMS) stream_count = 1;
+  printf("Upload request for '%s' accepted. Sending on TCP port %d over %d stream(s)%s...\n", filename, tcp_port, stream_count, compress ? ", compressed" : "");
+  execute_tcp_upload(dest_ip, tcp_port, filepath, transfer_id, stream_count, compress);
+}
+
+// Batches
+// A directory, or a path with glob characters that names no existing file, is sent as a batch.
+bool is_batch_path(const char* path)
+{
+  struct stat path_stat;
+  if (stat(path, &path_stat) == 0) return S_ISDIR(path_stat.st_mode);
+  return strpbrk(path, "*?[") != NULL;
+}
+
+// Expands a directory (its regular files, without descending into subdirectories) or a glob into
+// the files of a batch, in name order. Returns how many there are; the paths belong to 'matches'.
+int collect_batch_files(const char* path, glob_t* matches, const char*** files, long long* total_bytes)
+{
+  char pattern[MAX_FILEPATH_LENGTH + 4];
+  struct stat path_stat;
+  if (stat(path, &path_stat) == 0 && S_ISDIR(path_stat.st_mode)) snprintf(pattern, sizeof(pattern), "%s/*", path);
+  else snprintf(pattern, sizeof(pattern), "%s", path);
+  *matches = (glob_t){ 0 };
+  *files = NULL;
+  *total_bytes = 0;
+  if (glob(pattern, 0, NULL, matches) != 0 || !(*files = calloc(matches->gl_pathc, sizeof(char*)))) return 0;
+  int count = 0;
+  for (size_t i = 0; i < matches->gl_pathc; ++i)
+  {
+    struct stat file_stat;
+    if (stat(matches->gl_pathv[i], &file_stat) < 0 || !S_ISREG(file_stat.st_mode)) continue;
+    (*files)[count++] = matches->gl_pathv[i];
+    *total_bytes += file_stat.st_size;
+  }
+  return count;
+}
+
+// Opens a batch file and has the kernel start reading it in, so its pages are cached by the time
+// its turn on the wire comes.
+int open_prefetched(const char* path)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd >= 0) posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+  return fd;
+}
+
+// Sends one framed file of a batch: its header and name, the data, then its CRC32C.
+bool send_batch_file(int sock, int fd, const char* name, const struct stat* file_stat, transfer_flow* flow)
+{
+  batch_file_header header = { .name_length = htonl(strlen(name)), .size = htobe64(file_stat->st_size), .mtime = htobe64(file_stat->st_mtime) };
+  memcpy(header.magic, BATCH_FILE_MAGIC, sizeof(header.magic));
+  const uint8_t* map = file_stat->st_size > 0 ? mmap(NULL, file_stat->st_size, PROT_READ, MAP_SHARED, fd, 0) : NULL;
+  if (map == MAP_FAILED) map = NULL;
+  uint32_t crc = 0;
+  bool ok = send_all(sock, &header, sizeof(header)) && send_all(sock, name, strlen(name)) && send_file_zero_copy(sock, fd, map, 0, file_stat->st_size, &crc, flow);
+  if (map) munmap((void*)map, file_stat->st_size);
+  uint32_t crc_frame = htonl(crc);
+  return ok && send_all(sock, &crc_frame, sizeof(crc_frame));
+}
+
+// Streams the files of a batch back to back on one connection. TCP_CORK packs small files into
+// full segments, and the next few files are opened and read ahead while the current one is on
+// the wire, so the disk seldom holds up the socket.
+void execute_batch_upload(const char* dest_ip, int port, const char** files, int file_count, uint64_t transfer_id)
+{
+  int sock = connect_data_stream(dest_ip, port, transfer_id, 0, 1);
+  if (sock < 0) return;
+  struct in_addr dest_addr = { .s_addr = 0 };
+  inet_pton(AF_INET, dest_ip, &dest_addr);
+  transfer_flow* flow = open_flow(PRIORITY_BULK, dest_addr);
+  long long started_us = metrics_transfer_started();
+  int cork = 1;
+  setsockopt(sock, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+  int ahead[BATCH_PREFETCH_FILES];
+  for (int i = 0; i < BATCH_PREFETCH_FILES; ++i) ahead[i] = i < file_count ? open_prefetched(files[i]) : -1;
+
+  int sent = 0;
+  long long sent_bytes = 0;
+  bool ok = true;
+  for (int i = 0; i < file_count && ok; ++i)
+  {
+    int fd = ahead[i % BATCH_PREFETCH_FILES];
+    ahead[i % BATCH_PREFETCH_FILES] = i + BATCH_PREFETCH_FILES < file_count ? open_prefetched(files[i + BATCH_PREFETCH_FILES]) : -1;
+    const char* name = strrchr(files[i], '/');
+    name = name ? name + 1 : files[i];
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) < 0 || strlen(name) >= MAX_FILENAME_LENGTH) 
+    {
+      fprintf(stderr, "Skipped '%s'.\n", files[i]);
+      if (fd >= 0) close(fd);
+      continue;
+    }
+    ok = send_batch_file(sock, fd, name, &file_stat, flow);
+    close(fd);
+    if (ok)
+    {
+      sent++;
+      sent_bytes += file_stat.st_size;
+    }
+  }
+  for (int i = 0; i < BATCH_PREFETCH_FILES; ++i) if (ahead[i] >= 0) close(ahead[i]);
+
+  batch_file_header end = { 0 };
+  memcpy(end.magic, BATCH_FILE_MAGIC, sizeof(end.magic));
+  ok = ok && send_all(sock, &end, sizeof(end));
+  cork = 0;
+  setsockopt(sock, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+  // The repository counts a file as kept only once its record has committed
+  uint32_t kept_frame;
+  ok = ok && recv_all_within(sock, &kept_frame, sizeof(kept_frame), DURABLE_REPLY_TIMEOUT);
+  close_flow(flow);
+  metrics_transfer_finished(started_us, sent_bytes, ok);
+  if (ok) printf("Batch complete: %d of %d file(s) sent (%lld bytes), %u stored by %s.\n", sent, file_count, sent_bytes, ntohl(kept_frame), dest_ip);
+  else fprintf(stderr, "Batch to %s interrupted after %d of %d file(s).\n", dest_ip, sent, file_count);
+  release_data_socket(dest_ip, port, sock, ok);
+}
+
+// Sends a directory's files, or whatever a glob matches, as one batch: a single announcement and
+// a single connection however many files it holds.
+void initiate_batch_transfer(const char* dest_ip, int port, const char* path, const char* self_ip)
+{
+  glob_t matches;
+  const char** files;
+  long long total_bytes;
+  int file_count = collect_batch_files(path, &matches, &files, &total_bytes);
+  if (file_count == 0) printf("No files to send in '%s'.\n", path);
+  else
+  {
+    uint64_t transfer_id = generate_transfer_id();
+    control_frame command;
+    control_begin(&command, CONTROL_REQUEST_BATCH);
+    control_put_u32(&command, FIELD_COUNT, file_count);
+    control_put_u64(&command, FIELD_SIZE, total_bytes);
+    control_put_ip(&command, FIELD_SENDER_IP, self_ip);
+    control_put_u64(&command, FIELD_TRANSFER_ID, transfer_id);
+    int stream_count = 1;
+    bool compress = false;
+    int tcp_port = request_transfer_port(dest_ip, port, &command, transfer_id, &stream_count, &compress);
+    if (tcp_port == -2) printf("%s is busy, batch '%s' not started. Retry later.\n", dest_ip, path);
+    else if (tcp_port < 0) printf("No reply from %s for batch '%s', not sent.\n", dest_ip, path);
+    else 
+    {
+      printf("Batch of %d file(s) (%lld bytes) accepted. Sending on TCP port %d...\n", file_count, total_bytes, tcp_port);
+      execute_batch_upload(dest_ip, tcp_port, files, file_count, transfer_id);
+    }
+  }
+  free(files);
+  globfree(&matches);
+}
+
+void execute_tcp_download(const char* source_ip, int port, const char* save_as_filename, uint64_t transfer_id, long long filesize, int offered_streams, long long mtime, bool compress, long long expected_crc) 
+{
+  long long ready_us = monotonic_us();
+  mkdir("su_downloads", 0755);
+  char save_path[MAX_FILEPATH_LENGTH], part_path[MAX_FILEPATH_LENGTH + 8];
+  snprintf(save_path, sizeof(save_path), "su_downloads/%s", save_as_filename);
+  snprintf(part_path, sizeof(part_path), "%s.part", save_path);
+
+  // Reuse an interrupted download of the same stored copy if its layout fits the CR's offer
+  off_t have[MAX_STREAMS] = { 0 };
+  int stream_count = grant_stream_count(offered_streams);
+  int saved_streams;
+  if (load_resume_state(part_path, filesize, mtime, &saved_streams, have) && saved_streams <= offered_streams) stream_count = saved_streams;
+  else memset(have, 0, sizeof(have));
+  int fd = open(part_path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0 || ftruncate(fd, filesize) < 0) 
+  { 
+    perror("open for download"); 
+    if (fd >= 0) close(fd);
+    return; 
+  }
+  save_resume_state(part_path, filesize, mtime, stream_count, have);
+
+  // The CR serves fbacks on its shared acceptor; each stream names the transfer and its stripe
+  struct in_addr source_addr = { .s_addr = 0 };
+  inet_pton(AF_INET, source_ip, &source_addr);
+  transfer_flow* flow = open_flow(PRIORITY_INTERACTIVE, source_addr);
+  stream_job jobs[MAX_STREAMS];
+  for (int i = 0; i < stream_count; ++i)
+  {
+    jobs[i] = (stream_job){ .peer_ip = source_ip, .port = port, .transfer_id = transfer_id, .fd = fd, .index = i, .count = stream_count, .resume = have[i], .sock = -1, .flow = flow, .ready_us = ready_us, .sending = false, .compress = compress };
+    stripe_range(filesize, stream_count, i, &jobs[i].offset, &jobs[i].length);
+  }
+  bool received_all = run_data_streams(jobs, stream_count);
+  close_flow(flow);
+  // The stripes checked out one by one; the CR's stored checksum also catches a copy damaged on its disk
+  if (received_all && expected_crc >= 0 && combine_stripe_checksums(jobs, stream_count) != (uint32_t)expected_crc)
+  {
+    close(fd);
+    remove(part_path);
+    char meta_path[MAX_FILEPATH_LENGTH + 16];
+    snprintf(meta_path, sizeof(meta_path), "%s.meta", part_path);
+    remove(meta_path);
+    fprintf(stderr, "'%s' does not match the checksum the CR stored for it; discarded.\n", save_path);
+    return;
+  }
+  if (settle_partial_file(fd, part_path, save_path, filesize, mtime, jobs, stream_count)) printf("File download complete. Saved as '%s'.\n", save_path);
+}
+
+// Prints a listing the CR streams over TCP. A complete listing ends with the CR's end line, so
+// one that stops short of it is flagged rather than passed off as the whole catalogue.
+void receive_listing(const char* cr_ip, int port, uint64_t listing_id, const char* title)
+{
+  int sock = connect_data_stream(cr_ip, port, listing_id, 0, 1);
+  if (sock < 0) return;
+  char* buffer = malloc(LISTING_BUFFER_SIZE);
+  if (!buffer) 
+  {
+    close(sock);
+    return;
+  }
+  char tail[LISTING_TAIL_LENGTH + 1];
+  size_t tail_length = 0;
+  printf("\n--- CR Reply (%s) ---\n", title);
+  while (true)
+  {
+    ssize_t n = recv(sock, buffer, LISTING_BUFFER_SIZE, 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    fwrite(buffer, 1, n, stdout);
+    size_t keep = (size_t)n < LISTING_TAIL_LENGTH ? (size_t)n : LISTING_TAIL_LENGTH;
+    if (tail_length + keep > LISTING_TAIL_LENGTH) 
+    {
+      size_t drop = tail_length + keep - LISTING_TAIL_LENGTH;
+      memmove(tail, tail + drop, tail_length - drop);
+      tail_length -= drop;
+    }
+    memcpy(tail + tail_length, buffer + n - keep, keep);
+    tail_length += keep;
+  }
+  tail[tail_length] = '\0';
+  close(sock);
+  free(buffer);
+  if (!strstr(tail, LISTING_END_MARKER)) printf("(The listing was cut off before its end.)\n");
+  printf("\n> ");
+  fflush(stdout);
+}
+
+// Binds a TCP listener for an inbound transfer, preferring the well-known port but taking any free
+// one while that is busy with another transfer. Returns the socket, or -1.
+int open_download_listener(int backlog, int* port)
+{
+  int listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+  int opt = 1;
+  setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+  struct sockaddr_in listen_addr = { .sin_family = AF_INET, .sin_addr.s_addr = INADDR_ANY, .sin_port = htons(TCP_FILE_TRANSFER_PORT) };
+  if (bind(listen_sock, (struct sockaddr*)&listen_addr, sizeof(listen_addr)) < 0) 
+  {
+    listen_addr.sin_port = htons(0);
+    if (bind(listen_sock, (struct sockaddr*)&listen_addr, sizeof(listen_addr)) < 0) 
+    {
+      perror("TCP download bind"); 
+      close(listen_sock); 
+      return -1;
+    }
+  }
+  socklen_t addr_len = sizeof(listen_addr);
+  getsockname(listen_sock, (struct sockaddr*)&listen_addr, &addr_len);
+  *port = ntohs(listen_addr.sin_port);
+  listen(listen_sock, backlog);
+  return listen_sock;
+}
+
+void* tcp_download_thread(void* arg) 
+{
+  tcp_download_info* info = (tcp_download_info*)arg;
+  mkdir("su_recv_from_nu", 0755);
+  char save_path[MAX_FILEPATH_LENGTH];
+  snprintf(save_path, sizeof(save_path), "su_recv_from_nu/%s", info->filename);
+  char part_path[MAX_FILEPATH_LENGTH + 8];
+  snprintf(part_path, sizeof(part_path), "%s.part", save_path);
+
+  // A partial copy left by an interrupted attempt fixes the stripe layout and what we already hold
+  off_t have[MAX_STREAMS] = { 0 };
+  int saved_streams;
+  if (load_resume_state(part_path, info->filesize, info->mtime, &saved_streams, have)) info->stream_count = saved_streams;
+  else memset(have, 0, sizeof(have));
+
+  int assigned_port;
+  int listen_sock = open_download_listener(info->stream_count, &assigned_port);
+  if (listen_sock < 0) 
+  {
+    end_active_download(info->transfer_id); 
+    free(info); 
+    return NULL;
+  }
+  set_active_download_port(info->transfer_id, assigned_port, info->stream_count);
+  send_ready_reply(info->reply_sock, &info->reply_addr, info->transfer_id, assigned_port, info->stream_count, info->compress);
+  long long ready_us = monotonic_us();
+
+  // Collect one connection per granted stripe; the hello says which stripe each one carries
+  struct timeval accept_timeout = { .tv_sec = DATA_CONNECT_TIMEOUT, .tv_usec = 0 };
+  setsockopt(listen_sock, SOL_SOCKET, SO_RCVTIMEO, &accept_timeout, sizeof(accept_timeout));
+  stream_job jobs[MAX_STREAMS];
+  for (int i = 0; i < info->stream_count; ++i) jobs[i] = (stream_job){ .index = i, .count = info->stream_count, .resume = have[i], .sock = -1, .ready_us = ready_us, .sending = false, .compress = info->compress };
+  int accepted = 0;
+  while (accepted < info->stream_count)
+  {
+    int data_sock = accept(listen_sock, NULL, NULL);
+    if (data_sock < 0) 
+    { 
+      perror("TCP accept"); 
+      break; 
+    }
+    transfer_hello hello;
+    int stream_index = -1;
+    if (recv_all(data_sock, &hello, sizeof(hello)) && memcmp(hello.magic, TRANSFER_MAGIC, sizeof(hello.magic)) == 0 && be64toh(hello.transfer_id) == info->transfer_id && 
+        ntohs(hello.stream_count) == info->stream_count) stream_index = ntohs(hello.stream_index);
+    if (stream_index < 0 || stream_index >= info->stream_count || jobs[stream_index].sock >= 0) 
+    {
+      fprintf(stderr, "Dropped data connection for an unknown transfer.\n");
+      close(data_sock); 
+      continue; 
+    }
+    setsockopt(data_sock, SOL_SOCKET, SO_RCVTIMEO, &accept_timeout, sizeof(accept_timeout));
+    jobs[stream_index].sock = data_sock;
+    accepted++;
+  }
+  close(listen_sock);
+  end_active_download(info->transfer_id);
+  if (accepted < info->stream_count) 
+  {
+    for (int i = 0; i < info->stream_count; ++i) if (jobs[i].sock >= 0) close(jobs[i].sock);
+    free(info); 
+    return NULL; 
+  }
+
+  int fd = open(part_path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0 || ftruncate(fd, info->filesize) < 0) 
+  { 
+    perror("open download"); 
+    if (fd >= 0) close(fd);
+    for (int i = 0; i < info->stream_count; ++i) close(jobs[i].sock);
+    free(info); 
+    return NULL; 
+  }
+  save_resume_state(part_path, info->filesize, info->mtime, info->stream_count, have);
+  transfer_flow* flow = open_flow(PRIORITY_BULK, info->reply_addr.sin_addr);
+  for (int i = 0; i < info->stream_count; ++i)
+  {
+    jobs[i].fd = fd;
+    stripe_range(info->filesize, info->stream_count, i, &jobs[i].offset, &jobs[i].length);
+    jobs[i].flow = flow;
+  }
+  run_data_streams(jobs, info->stream_count);
+  close_flow(flow);
+  if (!settle_partial_file(fd, part_path, save_path, info->filesize, info->mtime, jobs, info->stream_count)) 
+  {
+    free(info);
+    return NULL;
+  }
+  printf("File '%s' received from %s.\n", info->filename, info->sender_ip);
+  free(info);
+  return NULL;
+}
+
+// Reads framed files until the end-of-batch header and answers with how many were kept. Each
+// file lands in '<name>.part' and is renamed into place once its checksum matches. Returns the
+// count kept, or -1 when the stream broke off or went out of step; files before that stay.
+int receive_batch(int sock, const char* save_dir, transfer_flow* flow)
+{
+  int kept = 0;
+  char name[MAX_FILENAME_LENGTH];
+  batch_file_header header;
+  while (recv_all(sock, &header, sizeof(header)))
+  {
+    uint32_t name_length = ntohl(header.name_length);
+    if (memcmp(header.magic, BATCH_FILE_MAGIC, sizeof(header.magic)) != 0 || name_length >= sizeof(name)) break;
+    if (name_length == 0)
+    {
+      uint32_t kept_frame = htonl(kept);
+      send_all(sock, &kept_frame, sizeof(kept_frame));
+      return kept;
+    }
+    if (!recv_all(sock, name, name_length)) break;
+    name[name_length] = '\0';
+    // Files land flat in the save directory, so a name that could climb out of it is refused
+    if (strlen(name) != name_length || strchr(name, '/') || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) break;
+    char save_path[MAX_FILEPATH_LENGTH], part_path[MAX_FILEPATH_LENGTH + 8];
+    snprintf(save_path, sizeof(save_path), "%s/%s", save_dir, name);
+    snprintf(part_path, sizeof(part_path), "%s.part", save_path);
+    int fd = open(part_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) 
+    { 
+      perror("open batch file"); 
+      break; 
+    }
+    off_t received = 0;
+    uint32_t crc = 0, crc_frame = 0;
+    bool ok = receive_range(sock, fd, 0, (off_t)be64toh(header.size), &received, &crc, flow) && recv_all(sock, &crc_frame, sizeof(crc_frame));
+    struct timespec times[2] = { { .tv_nsec = UTIME_OMIT }, { .tv_sec = (time_t)be64toh(header.mtime) } };
+    futimens(fd, times);
+    close(fd);
+    if (!ok) 
+    {
+      remove(part_path);
+      fprintf(stderr, "Batch ended inside '%s', which is discarded.\n", name);
+      return -1;
+    }
+    if (ntohl(crc_frame) != crc || rename(part_path, save_path) < 0) 
+    {
+      remove(part_path);
+      fprintf(stderr, "'%s' failed its checksum, discarded.\n", name);
+      continue;
+    }
+    kept++;
+  }
+  fprintf(stderr, "Batch stream broke off or went out of step; files received before that are kept.\n");
+  return -1;
+}
+
+// Serves one announced batch: a single connection carries all of its files.
+void* batch_download_thread(void* arg)
+{
+  tcp_download_info* info = (tcp_download_info*)arg;
+  const char* save_dir = "su_recv_from_nu";
+  mkdir(save_dir, 0755);
+  int assigned_port;
+  int listen_sock = open_download_listener(1, &assigned_port);
+  if (listen_sock < 0) 
+  {
+    end_active_download(info->transfer_id); 
+    free(info); 
+    return NULL;
+  }
+  set_active_download_port(info->transfer_id, assigned_port, 1);
+  send_ready_reply(info->reply_sock, &info->reply_addr, info->transfer_id, assigned_port, 1, false);
+
+  struct timeval stall_timeout = { .tv_sec = DATA_CONNECT_TIMEOUT, .tv_usec = 0 };
+  setsockopt(listen_sock, SOL_SOCKET, SO_RCVTIMEO, &stall_timeout, sizeof(stall_timeout));
+  int data_sock;
+  while ((data_sock = accept(listen_sock, NULL, NULL)) >= 0)
+  {
+    transfer_hello hello;
+    setsockopt(data_sock, SOL_SOCKET, SO_RCVTIMEO, &stall_timeout, sizeof(stall_timeout));
+    if (recv_all(data_sock, &hello, sizeof(hello)) && memcmp(hello.magic, TRANSFER_MAGIC, sizeof(hello.magic)) == 0 && be64toh(hello.transfer_id) == info->transfer_id && ntohs(hello.stream_count) == 1) break;
+    fprintf(stderr, "Dropped data connection for an unknown transfer.\n");
+    close(data_sock);
+  }
+  if (data_sock < 0) perror("TCP accept");
+  close(listen_sock);
+  end_active_download(info->transfer_id);
+  if (data_sock >= 0)
+  {
+    transfer_flow* flow = open_flow(PRIORITY_BULK, info->reply_addr.sin_addr);
+    long long started_us = metrics_transfer_started();
+    int kept = receive_batch(data_sock, save_dir, flow);
+    close_flow(flow);
+    metrics_transfer_finished(started_us, 0, kept >= 0);
+    if (kept >= 0) printf("Batch from %s: %d of %d file(s) stored in '%s'.\n", info->sender_ip, kept, info->file_count, save_dir);
+    close(data_sock);
+  }
+  free(info);
+  return NULL;
+}
+
+// Relay
+// fall sends one file to every NU down chains of up to RELAY_MAX_HOPS NUs. The SU sends it once
+// to the head of each chain, and each NU stores it while passing it on to the next, so the SU's
+// uplink carries the file once per chain rather than once per NU. Each hop is asked with a
+// REQUEST_RELAY naming the hops after it, and answers the checksum with how many NUs, itself
+// included, stored the file, as a big-endian uint32.
+
+// Asks the chain's hops in order, from *next_hop on, to take the file, skipping any that do not
+// answer. Returns the data stream to the first that does, past its resume frame, with *next_hop
+// just after it; -1 when none did.
+int connect_relay_hop(const char* filename, long long filesize, const char* origin_ip, const struct in_addr* hops, int hop_count, int* next_hop)
+{
+  while (*next_hop < hop_count)
+  {
+    char hop_ip[MAX_IP_LENGTH];
+    inet_ntop(AF_INET, &hops[(*next_hop)++], hop_ip, sizeof(hop_ip));
+    uint64_t transfer_id = generate_transfer_id();
+    control_frame command;
+    control_begin(&command, CONTROL_REQUEST_RELAY);
+    control_put_string(&command, FIELD_NAME, filename);
+    control_put_u64(&command, FIELD_SIZE, filesize);
+    control_put_ip(&command, FIELD_SENDER_IP, origin_ip);
+    control_put_u64(&command, FIELD_TRANSFER_ID, transfer_id);
+    for (int i = *next_hop; i < hop_count; ++i) control_put_addr(&command, FIELD_NODE, hops[i]);
+    int stream_count = 1;
+    bool compress = false;
+    int tcp_port = request_transfer_port(hop_ip, SU_SENDTO_NU, &command, transfer_id, &stream_count, &compress);
+    int sock = tcp_port > 0 ? connect_data_stream(hop_ip, tcp_port, transfer_id, 0, 1) : -1;
+    uint64_t resume_frame;
+    if (sock >= 0 && recv_all(sock, &resume_frame, sizeof(resume_frame))) return sock;
+    if (sock >= 0) close(sock);
+    fprintf(stderr, "Relay: %s did not take '%s'; passing it to the next NU.\n", hop_ip, filename);
+  }
+  return -1;
+}
+
+// Sends the file down one chain and records how many of its NUs stored it. A head that breaks off
+// is replaced by the next NU, which is sent the file from the start.
+void* relay_chain_thread(void* arg)
+{
+  relay_chain* chain = (relay_chain*)arg;
+  int fd = open(chain->filepath, O_RDONLY);
+  struct stat file_stat;
+  if (fd < 0 || fstat(fd, &file_stat) < 0) 
+  { 
+    perror("open"); 
+    if (fd >= 0) close(fd);
+    return NULL; 
+  }
+  const uint8_t* map = file_stat.st_size > 0 ? mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0) : NULL;
+  if (map == MAP_FAILED) map = NULL;
+  long long started_us = metrics_transfer_started();
+  bool relayed = false;
+  int next_hop = 0;
+  while (!relayed && next_hop < chain->hop_count)
+  {
+    int sock = connect_relay_hop(chain->filename, file_stat.st_size, chain->self_ip, chain->hops, chain->hop_count, &next_hop);
+    if (sock < 0) break;
+    transfer_flow* flow = open_flow(PRIORITY_BACKGROUND, chain->hops[next_hop - 1]);
+    uint32_t crc = 0;
+    bool sent = send_file_zero_copy(sock, fd, map, 0, file_stat.st_size, &crc, flow);
+    close_flow(flow);
+    uint32_t checksum_frame = htonl(crc);
+    uint32_t delivered;
+    sent = sent && send_all(sock, &checksum_frame, sizeof(checksum_frame));
+    // The tally comes only once every NU in the chain has stored the file
+    if (sent && recv_all_within(sock, &delivered, sizeof(delivered), RELAY_TALLY_TIMEOUT)) chain->delivered = ntohl(delivered);
+    close(sock);
+    relayed = sent;
+    if (!relayed) fprintf(stderr, "Relay: the chain's head broke off '%s'; passing it to the next NU.\n", chain->filename);
+  }
+  metrics_transfer_finished(started_us, relayed ? file_stat.st_size : 0, relayed);
+  if (map) munmap((void*)map, file_stat.st_size);
+  close(fd);
+  return NULL;
+}
 
-// Function Prototypes
-void trim_whitespace(char *str);
-bool is_ip_in_table(const char* ip_to_check);
-void execute_tcp_upload(const char* dest_ip, int port, const char* filepath);
-void initiate_file_transfer(const char* dest_ip, int port, const char* filepath, const char* self_ip);
-void execute_tcp_download(const char* source_ip, int port, const char* save_as_filename);
-void broadcast_message(const char* message, int nu_port, int cr_port);
-void* tcp_download_thread(void* arg);
-void* listener_thread_func(void* arg);
+// fall: splits the NUs into as few chains as RELAY_MAX_HOPS allows, of even length, and runs them
+// side by side.
+void relay_to_all(const char* filepath, const char* self_ip)
+{
+  struct stat file_stat;
+  if (stat(filepath, &file_stat) < 0 || !S_ISREG(file_stat.st_mode)) 
+  {
+    printf("Error: '%s' is not a file; fall sends a single file.\n", filepath);
+    return;
+  }
+  int nu_count = 0;
+  for (size_t i = 0; i < G_MEMBERS.capacity; ++i) 
+  {
+    uint32_t node = G_MEMBERS.slots[i];
+    if (node != 0 && node != G_CR_ADDR.s_addr && node != G_SU_ADDR.s_addr) nu_count++;
+  }
+  if (nu_count == 0) 
+  {
+    printf("There are no NUs in the network.\n");
+    return;
+  }
+  int chain_count = (nu_count + RELAY_MAX_HOPS - 1) / RELAY_MAX_HOPS;
+  relay_chain* chains = calloc(chain_count, sizeof(relay_chain));
+  if (!chains) return;
+  char path_copy[MAX_FILEPATH_LENGTH];
+  strncpy(path_copy, filepath, sizeof(path_copy) - 1);
+  path_copy[sizeof(path_copy) - 1] = '\0';
+  const char* filename = basename(path_copy);
+  int placed = 0;
+  for (size_t i = 0; i < G_MEMBERS.capacity; ++i) 
+  {
+    struct in_addr node = { .s_addr = G_MEMBERS.slots[i] };
+    if (node.s_addr == 0 || node.s_addr == G_CR_ADDR.s_addr || node.s_addr == G_SU_ADDR.s_addr) continue;
+    relay_chain* chain = &chains[placed++ % chain_count];
+    chain->hops[chain->hop_count++] = node;
+  }
+  printf("Relaying '%s' to %d NU(s) over %d chain(s)...\n", filename, nu_count, chain_count);
+  long long started_ms = monotonic_ms();
+  pthread_t* chain_tids = calloc(chain_count, sizeof(pthread_t));
+  for (int c = 0; c < chain_count; ++c) 
+  {
+    chains[c].filepath = filepath;
+    chains[c].filename = filename;
+    chains[c].self_ip = self_ip;
+    if (!chain_tids || pthread_create(&chain_tids[c], NULL, relay_chain_thread, &chains[c]) != 0) relay_chain_thread(&chains[c]);
+    else chains[c].started = true;
+  }
+  int delivered = 0;
+  for (int c = 0; c < chain_count; ++c) 
+  {
+    if (chains[c].started) pthread_join(chain_tids[c], NULL);
+    delivered += chains[c].delivered;
+  }
+  printf("'%s' stored by %d of %d NU(s) in %.1f s.\n", filename, delivered, nu_count, (monotonic_ms() - started_ms) / 1000.0);
+  free(chain_tids);
+  free(chains);
+}
 
-// Utility Functions 
-void trim_whitespace(char *str) 
+// Broadcast logic
+int compare_broadcast_targets(const void* a, const void* b)
 {
-  if (!str) return;
-  char *end = str + strlen(str) - 1;
-  while (end >= str && isspace((unsigned char)*end)) end--;
-  *(end + 1) = '\0';
-  char *start = str;
-  while (*start && isspace((unsigned char)*start)) start++;
-  memmove(str, start, strlen(start) + 1);
+  uint32_t left = ntohl(((const broadcast_target*)a)->addr.sin_addr.s_addr);
+  uint32_t right = ntohl(((const broadcast_target*)b)->addr.sin_addr.s_addr);
+  return left < right ? -1 : left > right;
 }
 
-bool is_ip_in_table(const char* ip_to_check) 
+// Lists every NU and the CR as targets on their ports; the caller frees the list. Returns the
+// count, or -1 if out of memory.
+int collect_broadcast_targets(int nu_port, int cr_port, broadcast_target** targets)
 {
-  for (int i = 0; i < G_NUM_NODES_IN_TABLE; ++i) 
+  if (!(*targets = malloc((G_MEMBERS.count + 1) * sizeof(broadcast_target)))) return -1;
+  int count = 0;
+  for (size_t i = 0; i < G_MEMBERS.capacity; ++i) 
   {
-    if (strcmp(G_IP_TABLE[i], ip_to_check) == 0) return true;
+    struct in_addr node = { .s_addr = G_MEMBERS.slots[i] };
+    if (node.s_addr == 0 || node.s_addr == G_SU_ADDR.s_addr) continue;
+    int port = node.s_addr == G_CR_ADDR.s_addr ? cr_port : nu_port;
+    (*targets)[count++] = (broadcast_target){ .addr = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr = node } };
   }
-  return false;
+  return count;
 }
 
-// TCP Transfer and Handshake Functions
-void execute_tcp_upload(const char* dest_ip, int port, const char* filepath) 
+// Sends the frame once to the control multicast group on each port, out of the SU's own
+// interface. Returns false when the group cannot be sent to from here.
+bool send_broadcast_multicast(int sock, const control_frame* frame, int nu_port, int cr_port)
 {
-  FILE* file = fopen(filepath, "rb");
-  if (!file) 
-  { 
-    perror("fopen"); return; 
+  if (setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &G_SU_ADDR, sizeof(G_SU_ADDR)) < 0) return false;
+  struct sockaddr_in group_addr = { .sin_family = AF_INET, .sin_port = htons(nu_port) };
+  inet_pton(AF_INET, CONTROL_MULTICAST_GROUP, &group_addr.sin_addr);
+  bool sent = send_control(sock, &group_addr, frame);
+  group_addr.sin_port = htons(cr_port);
+  return send_control(sock, &group_addr, frame) && sent;
+}
+
+// Sends the frame to every target not yet acknowledged, or only to those in 'only' when it is
+// given, BROADCAST_BATCH datagrams per sendmmsg(2).
+void send_broadcast_unicast(int sock, const broadcast_target* targets, int count, const control_frame* frame, const ip_set* only)
+{
+  struct iovec payload = { .iov_base = (void*)frame->data, .iov_len = frame->length };
+  struct mmsghdr batch[BROADCAST_BATCH];
+  int next = 0;
+  while (next < count)
+  {
+    int queued = 0;
+    for (; next < count && queued < BROADCAST_BATCH; ++next)
+    {
+      if (targets[next].acked || (only && !ip_set_contains(only, targets[next].addr.sin_addr))) continue;
+      batch[queued++] = (struct mmsghdr){ .msg_hdr = { .msg_name = (void*)&targets[next].addr, .msg_namelen = sizeof(struct sockaddr_in), .msg_iov = &payload, .msg_iovlen = 1 } };
+    }
+    // sendmmsg stops at the first datagram that fails; that one is left to the next round
+    for (int sent = 0; sent < queued; )
+    {
+      int result = sendmmsg(sock, batch + sent, queued - sent, 0);
+      if (result > 0) sent += result;
+      else if (errno != EINTR) sent++;
+    }
   }
-  int sock = socket(AF_INET, SOCK_STREAM, 0);
+}
+
+// Delivers one frame to every target under a single message ID, marking each that acknowledged,
+// and returns how many did. The first round goes to the multicast group while it works; later
+// rounds re-send only to the silent targets. Acknowledgements from all targets are collected in
+// the same wait, so a round costs one timeout however many nodes there are.
+int deliver_broadcast(broadcast_target* targets, int count, const control_frame* message, int nu_port, int cr_port)
+{
+  uint64_t id = generate_transfer_id();
+  control_frame datagram = *message;
+  control_put_u64(&datagram, FIELD_MESSAGE_ID, id);
+  if (datagram.invalid || count <= 0) return 0;
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
   if (sock < 0) 
-  { 
-    perror("TCP socket"); fclose(file); return; 
+  {
+    perror("UDP socket");
+    return 0;
   }
-  struct sockaddr_in dest_addr = { .sin_family = AF_INET, .sin_port = htons(port) };
-  inet_pton(AF_INET, dest_ip, &dest_addr.sin_addr);
-
-  if (connect(sock, (struct sockaddr*)&dest_addr, sizeof(dest_addr)) < 0) 
+  qsort(targets, count, sizeof(broadcast_target), compare_broadcast_targets);
+  // A round waits as long as the slowest node needs
+  int rto_ms = CONTROL_RTO_MIN_MS;
+  for (int i = 0; i < count; ++i) 
   {
-    perror("TCP connect"); fclose(file); close(sock); return;
+    int node_rto_ms = control_rto_ms(targets[i].addr.sin_addr);
+    if (node_rto_ms > rto_ms) rto_ms = node_rto_ms;
   }
-  char buffer[MAX_CHUNK_SIZE];
-  size_t bytes_read;
-  while ((bytes_read = fread(buffer, 1, sizeof(buffer), file)) > 0) 
+
+  bool multicast = G_MULTICAST && send_broadcast_multicast(sock, &datagram, nu_port, cr_port);
+  int acked = 0, acked_by_multicast = 0;
+  long long first_sent_ms = monotonic_ms();
+  for (int attempt = 0; attempt < CONTROL_MAX_ATTEMPTS && acked < count; ++attempt)
   {
-    if (send(sock, buffer, bytes_read, 0) < 0) 
-    { 
-      perror("TCP send"); 
-      break; 
+    send_broadcast_unicast(sock, targets, count, &datagram, attempt == 0 && multicast ? &G_UNICAST_ONLY : NULL);
+    long long deadline = monotonic_ms() + rto_ms;
+    long long remaining;
+    while (acked < count && (remaining = deadline - monotonic_ms()) > 0)
+    {
+      struct pollfd pfd = { .fd = sock, .events = POLLIN };
+      if (poll(&pfd, 1, (int)remaining) <= 0) continue;
+      control_message reply;
+      broadcast_target sender = { .acked = false };
+      if (!receive_control(sock, &reply, &sender.addr) || reply.type != CONTROL_ACK || !CONTROL_HAS(&reply, FIELD_MESSAGE_ID) || reply.message_id != id) continue;
+      broadcast_target* target = bsearch(&sender, targets, count, sizeof(broadcast_target), compare_broadcast_targets);
+      if (!target || target->acked) continue;
+      target->acked = true;
+      acked++;
+      if (attempt > 0 && multicast) ip_set_add(&G_UNICAST_ONLY, sender.addr.sin_addr);
+      if (attempt > 0) continue;
+      record_rtt_sample(sender.addr.sin_addr, monotonic_ms() - first_sent_ms);
+      if (multicast) acked_by_multicast++;
     }
+    rto_ms = rto_ms * 2 > CONTROL_RTO_MAX_MS ? CONTROL_RTO_MAX_MS : rto_ms * 2;
   }
-  fclose(file);
   close(sock);
-  printf("File transfer complete.\n");
+  // A group that cannot be sent to, or that reached nobody while unicast did, costs a round for nothing
+  if (G_MULTICAST && (!multicast || (acked_by_multicast == 0 && acked > 0))) 
+  {
+    G_MULTICAST = false;
+    fprintf(stderr, "Multicast group %s does not reach the nodes; broadcasting by unicast.\n", CONTROL_MULTICAST_GROUP);
+  }
+  return acked;
 }
 
-void initiate_file_transfer(const char* dest_ip, int port, const char* filepath, const char* self_ip) 
+// Delivers the message reliably to every NU and the CR, naming any node that never acknowledged it.
+void broadcast_message(const control_frame* message, int nu_port, int cr_port) 
 {
-  struct stat file_stat;
-  if (stat(filepath, &file_stat) < 0) 
-  { 
-    perror("stat"); 
-    return; 
+  broadcast_target* targets;
+  int count = collect_broadcast_targets(nu_port, cr_port, &targets);
+  if (count < 0) return;
+  if (deliver_broadcast(targets, count, message, nu_port, cr_port) < count) 
+  {
+    for (int i = 0; i < count; ++i) 
+    {
+      if (targets[i].acked) continue;
+      char node_ip[MAX_IP_LENGTH];
+      inet_ntop(AF_INET, &targets[i].addr.sin_addr, node_ip, sizeof(node_ip));
+      bool is_cr = targets[i].addr.sin_addr.s_addr == G_CR_ADDR.s_addr;
+      fprintf(stderr, "%s %s did not acknowledge the message.\n", is_cr ? "CR" : "NU", node_ip);
+    }
   }
-    
-  const char* filename = basename((char*)filepath);
-  char command[512];
-  snprintf(command, sizeof(command), "REQUEST_UPLOAD %s %lld %s", filename, (long long)file_stat.st_size, self_ip);
+  free(targets);
+}
 
-  int udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
-  struct sockaddr_in dest_addr = { .sin_family = AF_INET, .sin_port = htons(port) };
-  inet_pton(AF_INET, dest_ip, &dest_addr.sin_addr);
-  sendto(udp_sock, command, strlen(command), 0, (struct sockaddr*)&dest_addr, sizeof(dest_addr));
-  close(udp_sock);
-    
-  printf("Upload request sent for '%s'. Waiting for peer to connect to TCP port %d...\n", filename, TCP_FILE_TRANSFER_PORT);
-    
-  // Delay for server to start its TCP listener
-    sleep(1);
-    
-  // Immediately try to connect and upload the file via TCP
-  execute_tcp_upload(dest_ip, TCP_FILE_TRANSFER_PORT, filepath);
+// Builds the whole table as IP_TABLE chunks of up to TABLE_NODES_PER_FRAME NUs. Each names the
+// version, its index, the chunk count, the CR and the SU. Returns the chunk count, 0 if out of memory.
+int build_table_chunks(control_frame** chunks)
+{
+  pthread_mutex_lock(&G_MEMBERS_MUTEX);
+  size_t nu_count = 0;
+  for (size_t i = 0; i < G_MEMBERS.capacity; ++i) 
+  {
+    uint32_t node = G_MEMBERS.slots[i];
+    if (node != 0 && node != G_CR_ADDR.s_addr && node != G_SU_ADDR.s_addr) nu_count++;
+  }
+  int chunk_count = nu_count == 0 ? 1 : (int)((nu_count + TABLE_NODES_PER_FRAME - 1) / TABLE_NODES_PER_FRAME);
+  if (!(*chunks = malloc(chunk_count * sizeof(control_frame)))) 
+  {
+    pthread_mutex_unlock(&G_MEMBERS_MUTEX);
+    return 0;
+  }
+  for (int c = 0; c < chunk_count; ++c) 
+  {
+    control_begin(&(*chunks)[c], CONTROL_IP_TABLE);
+    control_put_u64(&(*chunks)[c], FIELD_VERSION, G_MEMBERSHIP_VERSION);
+    control_put_u32(&(*chunks)[c], FIELD_CHUNK, c);
+    control_put_u32(&(*chunks)[c], FIELD_COUNT, chunk_count);
+    control_put_addr(&(*chunks)[c], FIELD_CR_ADDR, G_CR_ADDR);
+    control_put_addr(&(*chunks)[c], FIELD_SU_ADDR, G_SU_ADDR);
+  }
+  size_t placed = 0;
+  for (size_t i = 0; i < G_MEMBERS.capacity; ++i) 
+  {
+    struct in_addr node = { .s_addr = G_MEMBERS.slots[i] };
+    if (node.s_addr == 0 || node.s_addr == G_CR_ADDR.s_addr || node.s_addr == G_SU_ADDR.s_addr) continue;
+    control_put_addr(&(*chunks)[placed++ / TABLE_NODES_PER_FRAME], FIELD_NODE, node);
+  }
+  pthread_mutex_unlock(&G_MEMBERS_MUTEX);
+  return chunk_count;
 }
 
-void execute_tcp_download(const char* source_ip, int port, const char* save_as_filename) 
+// Sends one node the whole table. Each chunk waits for its acknowledgement, so they arrive in order.
+bool send_ip_table(const char* dest_ip, int port)
 {
-  int sock = socket(AF_INET, SOCK_STREAM, 0);
-  if (sock < 0) 
-  { 
-    perror("TCP socket"); 
-    return; 
+  control_frame* chunks;
+  int chunk_count = build_table_chunks(&chunks);
+  bool delivered = chunk_count > 0;
+  for (int c = 0; c < chunk_count && delivered; ++c) delivered = send_reliable(dest_ip, port, &chunks[c]);
+  if (chunk_count > 0) free(chunks);
+  return delivered;
+}
+
+// Answers a pull off the listener thread, since each chunk waits for its acknowledgement.
+void* table_pull_thread(void* arg)
+{
+  table_pull_request* pull = (table_pull_request*)arg;
+  if (!send_ip_table(pull->ip, pull->port)) fprintf(stderr, "%s asked for the IP table but did not acknowledge it.\n", pull->ip);
+  free(pull);
+  return NULL;
+}
+
+// A node that started late or missed a change asks for the whole table; only members are answered.
+void answer_table_pull(struct in_addr node)
+{
+  pthread_mutex_lock(&G_MEMBERS_MUTEX);
+  bool member = ip_set_contains(&G_MEMBERS, node);
+  bool is_cr = node.s_addr == G_CR_ADDR.s_addr;
+  pthread_mutex_unlock(&G_MEMBERS_MUTEX);
+  table_pull_request* pull = calloc(1, sizeof(table_pull_request));
+  if (!pull) return;
+  inet_ntop(AF_INET, &node, pull->ip, sizeof(pull->ip));
+  if (!member || node.s_addr == G_SU_ADDR.s_addr) 
+  {
+    printf("\nSECURITY ALERT: Ignored IP table request from %s, which is not in the network.\n> ", pull->ip);
+    fflush(stdout);
+    free(pull);
+    return;
+  }
+  pull->port = is_cr ? SU_IP_CR : SU_IP_NU;
+  pthread_t pull_tid;
+  if (pthread_create(&pull_tid, NULL, table_pull_thread, pull) != 0) 
+  {
+    free(pull);
+    return;
   }
-  struct sockaddr_in source_addr = { .sin_family = AF_INET, .sin_port = htons(port) };
-  inet_pton(AF_INET, source_ip, &source_addr.sin_addr);
+  pthread_detach(pull_tid);
+}
+
+// Adds or removes one NU under the lock and builds the change for the other nodes, carrying the
+// version it produces. Returns false if nothing changed.
+bool change_membership(control_type type, struct in_addr addr, control_frame* update)
+{
+  pthread_mutex_lock(&G_MEMBERS_MUTEX);
+  bool changed = type == CONTROL_NODE_REMOVE ? ip_set_remove(&G_MEMBERS, addr) : ip_set_add(&G_MEMBERS, addr);
+  if (changed) G_MEMBERSHIP_VERSION++;
+  uint64_t version = G_MEMBERSHIP_VERSION;
+  pthread_mutex_unlock(&G_MEMBERS_MUTEX);
+  if (!changed) return false;
+  control_begin(update, type);
+  control_put_u64(update, FIELD_VERSION, version);
+  control_put_addr(update, FIELD_NODE, addr);
+  return true;
+}
 
-  if (connect(sock, (struct sockaddr*)&source_addr, sizeof(source_addr)) < 0) 
+// Sends every node the whole table, one chunk at a time to all of them. A node that missed a chunk
+// is left out of the rest, since it would drop them anyway, and can pull the table later.
+void broadcast_ip_table(void)
+{
+  control_frame* chunks;
+  int chunk_count = build_table_chunks(&chunks);
+  broadcast_target* targets;
+  int count = chunk_count > 0 ? collect_broadcast_targets(SU_IP_NU, SU_IP_CR, &targets) : -1;
+  if (count < 0) 
   {
-    perror("TCP connect for download"); close(sock); return;
+    if (chunk_count > 0) free(chunks);
+    return;
   }
-  mkdir("su_downloads", 0755);
-  char save_path[MAX_FILEPATH_LENGTH];
-  snprintf(save_path, sizeof(save_path), "su_downloads/%s", save_as_filename);
-  FILE* file = fopen(save_path, "wb");
-  if (!file) 
-  { 
-    perror("fopen for download"); close(sock); 
-    return; 
+  // Targets that acknowledged every chunk so far are kept at the front
+  int reached = count;
+  for (int c = 0; c < chunk_count && reached > 0; ++c) 
+  {
+    for (int i = 0; i < reached; ++i) targets[i].acked = false;
+    deliver_broadcast(targets, reached, &chunks[c], SU_IP_NU, SU_IP_CR);
+    int kept = 0;
+    for (int i = 0; i < reached; ++i) 
+    {
+      if (!targets[i].acked) continue;
+      broadcast_target swapped = targets[kept];
+      targets[kept++] = targets[i];
+      targets[i] = swapped;
+    }
+    reached = kept;
+  }
+  for (int i = reached; i < count; ++i) 
+  {
+    char node_ip[MAX_IP_LENGTH];
+    inet_ntop(AF_INET, &targets[i].addr.sin_addr, node_ip, sizeof(node_ip));
+    bool is_cr = targets[i].addr.sin_addr.s_addr == G_CR_ADDR.s_addr;
+    fprintf(stderr, "%s %s did not acknowledge the IP table.\n", is_cr ? "CR" : "NU", node_ip);
   }
+  free(targets);
+  free(chunks);
+}
 
-  char buffer[MAX_CHUNK_SIZE];
-  ssize_t bytes_received;
-  while ((bytes_received = recv(sock, buffer, sizeof(buffer), 0)) > 0) 
+// Admits an NU while the network runs: it is sent the whole table, then the CR and the other NUs
+// are told of it.
+void add_node(const char* ip)
+{
+  struct in_addr addr;
+  if (inet_pton(AF_INET, ip, &addr) != 1) 
   {
-    fwrite(buffer, 1, bytes_received, file);
+    printf("Error: '%s' is not a valid IPv4 address.\n", ip);
+    return;
   }
-  fclose(file);
-  close(sock);
-  printf("File download complete. Saved as '%s'.\n", save_path);
+  if (ip_set_contains(&G_MEMBERS, addr)) 
+  {
+    printf("%s is already in the network.\n", ip);
+    return;
+  }
+  control_frame update;
+  if (!change_membership(CONTROL_NODE_ADD, addr, &update)) 
+  {
+    perror("membership set");
+    return;
+  }
+  // An NU that is not running yet keeps its place and can pull the table when it starts
+  if (!send_ip_table(ip, SU_IP_NU)) 
+  {
+    char su_ip[MAX_IP_LENGTH];
+    inet_ntop(AF_INET, &G_SU_ADDR, su_ip, sizeof(su_ip));
+    printf("NU %s did not acknowledge the IP table. Start it with DBIN_SU_IP=%s to pull it.\n", ip, su_ip);
+  }
+  broadcast_message(&update, SU_IP_NU, SU_IP_CR);
+  printf("NU %s added to the network.\n", ip);
 }
 
-void* tcp_download_thread(void* arg) 
+// Drops an NU from the network; the CR refuses its packets, connections and session from then on.
+// The NU itself is told to shut down rather than keep retrying a CR that turns it away.
+void remove_node(const char* ip)
 {
-  tcp_download_info* info = (tcp_download_info*)arg;
-  int listen_sock = socket(AF_INET, SOCK_STREAM, 0);
-  int opt = 1;
-  setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+  struct in_addr addr;
+  inet_pton(AF_INET, ip, &addr);
+  if (addr.s_addr == G_CR_ADDR.s_addr || addr.s_addr == G_SU_ADDR.s_addr) 
+  {
+    printf("The CR and the Super User cannot be removed.\n");
+    return;
+  }
+  control_frame update;
+  if (!change_membership(CONTROL_NODE_REMOVE, addr, &update)) return;
+  broadcast_message(&update, SU_IP_NU, SU_IP_CR);
+  control_frame terminate;
+  control_begin(&terminate, CONTROL_TERMINATE);
+  if (!send_reliable(ip, SU_SENDTO_NU, &terminate)) printf("NU %s did not acknowledge the shutdown.\n", ip);
+  printf("NU %s removed from the network.\n", ip);
+}
 
-  struct sockaddr_in listen_addr = { .sin_family = AF_INET, .sin_addr.s_addr = INADDR_ANY, .sin_port = htons(TCP_FILE_TRANSFER_PORT) };
-  if (bind(listen_sock, (struct sockaddr*)&listen_addr, sizeof(listen_addr)) < 0) 
+// CR Session
+int session_connect(const char* cr_ip)
+{
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (sock < 0) return -1;
+  // An unreachable CR costs one retry interval instead of stalling the session thread
+  struct timeval send_timeout = { .tv_sec = SESSION_RETRY_MS / 1000, .tv_usec = 0 };
+  setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+  struct sockaddr_in cr_addr = { .sin_family = AF_INET, .sin_port = htons(TCP_FILE_TRANSFER_PORT) };
+  inet_pton(AF_INET, cr_ip, &cr_addr.sin_addr);
+  transfer_hello hello = { 0 };
+  memcpy(hello.magic, SESSION_MAGIC, sizeof(hello.magic));
+  int nodelay = 1;
+  if (connect(sock, (struct sockaddr*)&cr_addr, sizeof(cr_addr)) < 0 || setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) < 0 || 
+      send(sock, &hello, sizeof(hello), MSG_NOSIGNAL) != (ssize_t)sizeof(hello)) 
   {
-    perror("TCP download bind"); close(listen_sock); free(info); 
-    return NULL;
+    close(sock);
+    return -1;
   }
-  listen(listen_sock, 1);
-    
-  int data_sock = accept(listen_sock, NULL, NULL);
-  close(listen_sock);
-  if (data_sock < 0) 
-  { 
-    perror("TCP accept"); 
-    free(info); 
-    return NULL; 
+  return sock;
+}
+
+// Sends one frame on the session, if it is open and leads to 'cr_ip'. A failed send shuts the
+// socket down, so the session thread notices at once and reconnects.
+bool session_send(const char* cr_ip, const control_frame* message)
+{
+  bool sent = false;
+  if (message->invalid) return sent;
+  pthread_mutex_lock(&G_CR_SESSION.send_mutex);
+  if (G_CR_SESSION.sock >= 0 && strcmp(cr_ip, G_CR_SESSION.cr_ip) == 0) 
+  {
+    sent = send_all(G_CR_SESSION.sock, message->data, message->length);
+    if (sent) G_CR_SESSION.last_sent_ms = monotonic_ms();
+    else shutdown(G_CR_SESSION.sock, SHUT_RDWR);
   }
+  pthread_mutex_unlock(&G_CR_SESSION.send_mutex);
+  return sent;
+}
 
-  mkdir("su_recv_from_nu", 0755);
-  char save_path[MAX_FILEPATH_LENGTH];
-  snprintf(save_path, sizeof(save_path), "su_recv_from_nu/%s", info->filename);
-    
-  FILE* file = fopen(save_path, "wb");
-  if (!file) 
-  { 
-    perror("fopen download"); 
-    close(data_sock); free(info); 
-    return NULL; 
+// A command for the CR goes on the session when it is up, and as a reliable datagram otherwise.
+// Returns false if the CR never acknowledged it.
+bool send_cr_command(const char* cr_ip, int port, const control_frame* message)
+{
+  return session_send(cr_ip, message) || send_reliable(cr_ip, port, message);
+}
+
+// Sends a transfer announcement on the session and waits up to 'wait_ms' for the CR's answer to
+// its ID. Returns false when there is no session to 'cr_ip' or no answer came.
+bool session_exchange(const char* cr_ip, const control_frame* command, uint64_t transfer_id, int wait_ms, control_message* reply)
+{
+  reply_waiter waiter = { .transfer_id = transfer_id };
+  pthread_mutex_lock(&G_CR_SESSION.mutex);
+  waiter.next = G_CR_SESSION.waiters;
+  G_CR_SESSION.waiters = &waiter;
+  pthread_mutex_unlock(&G_CR_SESSION.mutex);
+
+  bool sent = session_send(cr_ip, command);
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += wait_ms / 1000;
+  deadline.tv_nsec += (long)(wait_ms % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) 
+  {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
   }
-    
-  char buffer[MAX_CHUNK_SIZE];
-  ssize_t bytes_received;
-  while ((bytes_received = recv(data_sock, buffer, sizeof(buffer), 0)) > 0) 
+  pthread_mutex_lock(&G_CR_SESSION.mutex);
+  // A session lost meanwhile wakes its waiters, which then fall back to UDP
+  while (sent && !waiter.answered && G_CR_SESSION.sock >= 0)
   {
-    fwrite(buffer, 1, bytes_received, file);
+    if (pthread_cond_timedwait(&G_CR_SESSION.answered, &G_CR_SESSION.mutex, &deadline) == ETIMEDOUT) break;
   }
-  fclose(file);
-  close(data_sock);
-  printf("File '%s' received from %s.\n", info->filename, info->sender_ip);
-  free(info);
-  return NULL;
+  reply_waiter** link = &G_CR_SESSION.waiters;
+  while (*link != &waiter) link = &(*link)->next;
+  *link = waiter.next;
+  pthread_mutex_unlock(&G_CR_SESSION.mutex);
+  if (waiter.answered) *reply = waiter.reply;
+  return waiter.answered;
 }
 
-// Broadcast logic
-void broadcast_message(const char* message, int nu_port, int cr_port) 
+// Hands an answer to a transfer announcement to whoever is waiting for it. Returns false for
+// any other message.
+bool session_deliver_reply(const control_message* message)
 {
-  int sock = socket(AF_INET, SOCK_DGRAM, 0);
-  if (sock < 0) 
-  { 
-    perror("broadcast socket"); 
-    return; 
+  if (message->type != CONTROL_READY_TO_RECEIVE && message->type != CONTROL_BUSY && message->type != CONTROL_STORED) return false;
+  if (!CONTROL_HAS(message, FIELD_TRANSFER_ID)) return true;
+  bool delivered = false;
+  pthread_mutex_lock(&G_CR_SESSION.mutex);
+  for (reply_waiter* waiter = G_CR_SESSION.waiters; waiter && !delivered; waiter = waiter->next)
+  {
+    if (waiter->transfer_id == message->transfer_id && !waiter->answered) 
+    {
+      waiter->reply = *message;
+      waiter->answered = true;
+      delivered = true;
+    }
   }
-    
-  int num_normal_users = G_NUM_NODES_IN_TABLE - 2;
-  for (int i = 0; i < num_normal_users; ++i) 
+  if (delivered) pthread_cond_broadcast(&G_CR_SESSION.answered);
+  pthread_mutex_unlock(&G_CR_SESSION.mutex);
+  // A late answer to a request that already gave up needs no further handling
+  return true;
+}
+
+// Returns a pooled data connection to the CR for the next transfer, or -1 when there is none.
+int take_idle_data_socket(const char* peer_ip, int port)
+{
+  int sock = -1;
+  if (port != TCP_FILE_TRANSFER_PORT) return sock;
+  pthread_mutex_lock(&G_CR_SESSION.mutex);
+  while (sock < 0 && G_CR_SESSION.idle_count > 0 && strcmp(peer_ip, G_CR_SESSION.cr_ip) == 0)
   {
-    struct sockaddr_in nu_addr = { .sin_family = AF_INET, .sin_port = htons(nu_port) };
-    inet_pton(AF_INET, G_IP_TABLE[i], &nu_addr.sin_addr);
-    sendto(sock, message, strlen(message), 0, (struct sockaddr*)&nu_addr, sizeof(nu_addr));
+    sock = G_CR_SESSION.idle_socks[--G_CR_SESSION.idle_count];
+    // Nothing is due on an idle connection, so one that reads as ready was closed by the CR
+    struct pollfd pfd = { .fd = sock, .events = POLLIN | POLLRDHUP };
+    if (poll(&pfd, 1, 0) != 0) 
+    {
+      close(sock);
+      sock = -1;
+    }
   }
-  struct sockaddr_in cr_addr = { .sin_family = AF_INET, .sin_port = htons(cr_port) };
-  inet_pton(AF_INET, G_IP_TABLE[num_normal_users], &cr_addr.sin_addr);
-  sendto(sock, message, strlen(message), 0, (struct sockaddr*)&cr_addr, sizeof(cr_addr));
-  close(sock);
+  pthread_mutex_unlock(&G_CR_SESSION.mutex);
+  return sock;
+}
+
+// Keeps a data connection to the CR whose transfer finished cleanly for the next one, and closes
+// any other.
+void release_data_socket(const char* peer_ip, int port, int sock, bool reusable)
+{
+  pthread_mutex_lock(&G_CR_SESSION.mutex);
+  if (reusable && peer_ip && port == TCP_FILE_TRANSFER_PORT && strcmp(peer_ip, G_CR_SESSION.cr_ip) == 0 && G_CR_SESSION.idle_count < SESSION_POOL_SIZE) 
+  {
+    G_CR_SESSION.idle_since_ms[G_CR_SESSION.idle_count] = monotonic_ms();
+    G_CR_SESSION.idle_socks[G_CR_SESSION.idle_count++] = sock;
+    sock = -1;
+  }
+  pthread_mutex_unlock(&G_CR_SESSION.mutex);
+  if (sock >= 0) close(sock);
+}
+
+// Closes pooled connections before the CR's own idle sweep would (or all of them), oldest first.
+void expire_idle_data_sockets(bool all)
+{
+  long long now = monotonic_ms();
+  pthread_mutex_lock(&G_CR_SESSION.mutex);
+  int expired = 0;
+  while (expired < G_CR_SESSION.idle_count && (all || now - G_CR_SESSION.idle_since_ms[expired] > SESSION_POOL_IDLE_MS)) close(G_CR_SESSION.idle_socks[expired++]);
+  G_CR_SESSION.idle_count -= expired;
+  memmove(G_CR_SESSION.idle_socks, G_CR_SESSION.idle_socks + expired, G_CR_SESSION.idle_count * sizeof(int));
+  memmove(G_CR_SESSION.idle_since_ms, G_CR_SESSION.idle_since_ms + expired, G_CR_SESSION.idle_count * sizeof(long long));
+  pthread_mutex_unlock(&G_CR_SESSION.mutex);
+}
+
+void close_cr_session(void)
+{
+  pthread_mutex_lock(&G_CR_SESSION.mutex);
+  pthread_mutex_lock(&G_CR_SESSION.send_mutex);
+  close(G_CR_SESSION.sock);
+  G_CR_SESSION.sock = -1;
+  pthread_mutex_unlock(&G_CR_SESSION.send_mutex);
+  pthread_cond_broadcast(&G_CR_SESSION.answered);
+  pthread_mutex_unlock(&G_CR_SESSION.mutex);
+  // Data connections to a CR that went away are unlikely to have survived it
+  expire_idle_data_sockets(true);
+}
+
+// Acts on a reply from the CR. 'title' names the command it answers when the port it came on
+// tells; replies on the session carry no such hint.
+void handle_cr_reply(const control_message* message, const char* cr_ip, const char* title)
+{
+  if (message->type == CONTROL_READY_TO_SEND && CONTROL_HAS(message, FIELD_NAME) && CONTROL_HAS(message, FIELD_PORT) && CONTROL_HAS(message, FIELD_TRANSFER_ID) && CONTROL_HAS(message, FIELD_SIZE)) 
+  {
+    long long expected_crc = CONTROL_HAS(message, FIELD_CHECKSUM) ? (long long)message->checksum : -1;
+    // An fback's handshake runs from the request to this READY; with several outstanding, from the latest
+    long long requested_us = atomic_exchange(&G_FBACK_REQUESTED_US, 0);
+    if (requested_us > 0) histogram_record(&G_METRICS.handshake, monotonic_us() - requested_us);
+    execute_tcp_download(cr_ip, message->port, message->name, message->transfer_id, message->size, message->streams, message->mtime, strcmp(message->codec, COMPRESSION_CODEC) == 0, expected_crc);
+  } 
+  else if (message->type == CONTROL_READY_TO_LIST && CONTROL_HAS(message, FIELD_TRANSFER_ID) && CONTROL_HAS(message, FIELD_PORT)) 
+  {
+    receive_listing(cr_ip, message->port, message->transfer_id, "fsee");
+  }
+  else if (message->type == CONTROL_TEXT) 
+  {
+    if (title) printf("\n--- CR Reply (%s) ---\n%s\n> ", title, message->text);
+    else printf("\n--- CR Reply ---\n%s\n> ", message->text);
+    fflush(stdout);
+  }
+}
+
+// Replies may start a download, so each is handled off the session thread.
+void* cr_reply_thread(void* arg)
+{
+  control_message* message = (control_message*)arg;
+  handle_cr_reply(message, G_CR_SESSION.cr_ip, NULL);
+  free(message);
+  return NULL;
+}
+
+// Keeps the session with the CR open: reconnects when it drops, sends a heartbeat when it has
+// been quiet and gives up on a CR that stops answering them. Replies to transfer announcements
+// go to their waiters; anything else is handled like a datagram from the CR.
+void* cr_session_thread(void* arg)
+{
+  (void)arg;
+  char* buffer = malloc(SESSION_BUFFER_SIZE);
+  size_t buffered = 0;
+  long long next_attempt_ms = 0;
+  bool lost = false;
+  while (buffer && !G_EXIT_REQUEST)
+  {
+    expire_idle_data_sockets(false);
+    if (G_CR_SESSION.sock < 0)
+    {
+      if (monotonic_ms() < next_attempt_ms) 
+      {
+        usleep(200 * 1000);
+        continue;
+      }
+      next_attempt_ms = monotonic_ms() + SESSION_RETRY_MS;
+      int sock = session_connect(G_CR_SESSION.cr_ip);
+      if (sock < 0) continue;
+      pthread_mutex_lock(&G_CR_SESSION.mutex);
+      pthread_mutex_lock(&G_CR_SESSION.send_mutex);
+      G_CR_SESSION.sock = sock;
+      G_CR_SESSION.last_sent_ms = G_CR_SESSION.last_heard_ms = monotonic_ms();
+      pthread_mutex_unlock(&G_CR_SESSION.send_mutex);
+      pthread_mutex_unlock(&G_CR_SESSION.mutex);
+      buffered = 0;
+      if (lost) 
+      {
+        printf("\nSession with CR %s restored.\n> ", G_CR_SESSION.cr_ip);
+        fflush(stdout);
+      }
+      lost = false;
+      continue;
+    }
+
+    bool alive = true;
+    struct pollfd pfd = { .fd = G_CR_SESSION.sock, .events = POLLIN };
+    if (poll(&pfd, 1, 1000) > 0)
+    {
+      ssize_t n = recv(G_CR_SESSION.sock, buffer + buffered, SESSION_BUFFER_SIZE - buffered, 0);
+      if (n <= 0 && !(n < 0 && errno == EINTR)) alive = false;
+      if (n > 0) 
+      {
+        buffered += n;
+        G_CR_SESSION.last_heard_ms = monotonic_ms();
+      }
+      size_t offset = 0;
+      int frame_length = 0;
+      control_message message;
+      while (alive && (frame_length = control_decode((const uint8_t*)buffer + offset, buffered - offset, &message)) > 0)
+      {
+        offset += frame_length;
+        if (message.type == CONTROL_PONG || session_deliver_reply(&message)) continue;
+        control_message* copy = malloc(sizeof(control_message));
+        pthread_t reply_tid;
+        if (!copy) continue;
+        *copy = message;
+        if (pthread_create(&reply_tid, NULL, cr_reply_thread, copy) == 0) pthread_detach(reply_tid);
+        else free(copy);
+      }
+      if (frame_length < 0) alive = false;
+      memmove(buffer, buffer + offset, buffered - offset);
+      buffered -= offset;
+    }
+    long long now = monotonic_ms();
+    if (alive && now - G_CR_SESSION.last_heard_ms > SESSION_TIMEOUT_MS) alive = false;
+    if (alive && now - G_CR_SESSION.last_sent_ms >= SESSION_HEARTBEAT_MS) 
+    {
+      control_frame ping;
+      control_begin(&ping, CONTROL_PING);
+      alive = session_send(G_CR_SESSION.cr_ip, &ping);
+    }
+    if (!alive)
+    {
+      close_cr_session();
+      printf("\nSession with CR %s lost; commands go over UDP until it is back.\n> ", G_CR_SESSION.cr_ip);
+      fflush(stdout);
+      lost = true;
+      next_attempt_ms = now + SESSION_RETRY_MS;
+    }
+  }
+  free(buffer);
+  return NULL;
+}
+
+void start_cr_session(const char* cr_ip)
+{
+  strncpy(G_CR_SESSION.cr_ip, cr_ip, sizeof(G_CR_SESSION.cr_ip) - 1);
+  pthread_t session_tid;
+  if (pthread_create(&session_tid, NULL, cr_session_thread, NULL) == 0) pthread_detach(session_tid);
 }
 
 // Listening logic
@@ -265,59 +2387,78 @@ void* listener_thread_func(void* arg)
 
     if (FD_ISSET(args->nu_sock, &read_fds)) 
     {
-      char buffer[MAX_CMD_LENGTH];
-      ssize_t len = recvfrom(args->nu_sock, buffer, sizeof(buffer) - 1, 0, NULL, NULL);
-      if (len > 0) 
+      control_message request;
+      struct sockaddr_in request_addr;
+      if (receive_control(args->nu_sock, &request, &request_addr) && acknowledge_message(args->nu_sock, &request_addr, &request)) 
       {
-        buffer[len] = '\0';
-        char filename[MAX_FILENAME_LENGTH], sender_ip[MAX_IP_LENGTH];
-        long long filesize;
-        if (sscanf(buffer, "REQUEST_UPLOAD %s %lld %s", filename, &filesize, sender_ip) == 3) 
+        int known_port = 0, stream_count = 1;
+        if (request.type == CONTROL_REQUEST_UPLOAD && CONTROL_HAS(&request, FIELD_NAME) && CONTROL_HAS(&request, FIELD_SIZE) && CONTROL_HAS(&request, FIELD_SENDER_IP) && CONTROL_HAS(&request, FIELD_TRANSFER_ID)) 
         {
-          tcp_download_info* info = malloc(sizeof(tcp_download_info));
-          strncpy(info->filename, filename, sizeof(info->filename) - 1);
-          strncpy(info->sender_ip, sender_ip, sizeof(info->sender_ip) - 1);
-          pthread_t download_tid;
-          pthread_create(&download_tid, NULL, tcp_download_thread, info);
-          pthread_detach(download_tid);
+          bool compress = G_COMPRESSION && strcmp(request.codec, COMPRESSION_CODEC) == 0;
+          // A repeated request means our READY was lost; answer it again rather than start a second receiver
+          int tracked = track_active_download(request.transfer_id, &known_port, &stream_count);
+          if (tracked == 0 && known_port > 0) send_ready_reply(args->nu_sock, &request_addr, request.transfer_id, known_port, stream_count, compress);
+          else if (tracked == 1) 
+          {
+            tcp_download_info* info = calloc(1, sizeof(tcp_download_info));
+            snprintf(info->filename, sizeof(info->filename), "%s", request.name);
+            snprintf(info->sender_ip, sizeof(info->sender_ip), "%s", request.sender_ip);
+            info->transfer_id = request.transfer_id;
+            info->filesize = request.size;
+            info->mtime = request.mtime;
+            info->stream_count = grant_stream_count(request.streams);
+            info->compress = compress;
+            info->reply_sock = args->nu_sock;
+            info->reply_addr = request_addr;
+            pthread_t download_tid;
+            pthread_create(&download_tid, NULL, tcp_download_thread, info);
+            pthread_detach(download_tid);
+          }
+        }
+        else if (request.type == CONTROL_TABLE_PULL) answer_table_pull(request_addr.sin_addr);
+        else if (request.type == CONTROL_REQUEST_BATCH && CONTROL_HAS(&request, FIELD_COUNT) && CONTROL_HAS(&request, FIELD_SIZE) && CONTROL_HAS(&request, FIELD_SENDER_IP) && CONTROL_HAS(&request, FIELD_TRANSFER_ID) && request.count > 0) 
+        {
+          int tracked = track_active_download(request.transfer_id, &known_port, &stream_count);
+          if (tracked == 0 && known_port > 0) send_ready_reply(args->nu_sock, &request_addr, request.transfer_id, known_port, 1, false);
+          else if (tracked == 1) 
+          {
+            tcp_download_info* info = calloc(1, sizeof(tcp_download_info));
+            snprintf(info->sender_ip, sizeof(info->sender_ip), "%s", request.sender_ip);
+            info->transfer_id = request.transfer_id;
+            info->filesize = request.size;
+            info->file_count = request.count;
+            info->stream_count = 1;
+            info->reply_sock = args->nu_sock;
+            info->reply_addr = request_addr;
+            pthread_t download_tid;
+            pthread_create(&download_tid, NULL, batch_download_thread, info);
+            pthread_detach(download_tid);
+          }
         }
       }
     }
         
     if (FD_ISSET(args->fsee_reply_sock, &read_fds)) 
     {
-      char buffer[MAX_CHUNK_SIZE];
-      ssize_t len = recvfrom(args->fsee_reply_sock, buffer, sizeof(buffer) - 1, 0, NULL, NULL);
-      if (len > 0) 
+      control_message reply;
+      struct sockaddr_in sender_addr;
+      if (receive_control(args->fsee_reply_sock, &reply, &sender_addr) && acknowledge_message(args->fsee_reply_sock, &sender_addr, &reply)) 
       {
-        buffer[len] = '\0';
-        printf("\n--- CR Reply (fsee) ---\n%s\n> ", buffer);
-        fflush(stdout);
+        char cr_ip[MAX_IP_LENGTH];
+        inet_ntop(AF_INET, &sender_addr.sin_addr, cr_ip, sizeof(cr_ip));
+        handle_cr_reply(&reply, cr_ip, "fsee");
       }
     }
         
     if (FD_ISSET(args->fback_reply_sock, &read_fds)) 
     {
-      char buffer[MAX_CMD_LENGTH];
+      control_message reply;
       struct sockaddr_in sender_addr;
-      socklen_t sender_len = sizeof(sender_addr);
-      ssize_t len = recvfrom(args->fback_reply_sock, buffer, sizeof(buffer) - 1, 0, (struct sockaddr*)&sender_addr, &sender_len);
-      if (len > 0) 
+      if (receive_control(args->fback_reply_sock, &reply, &sender_addr) && acknowledge_message(args->fback_reply_sock, &sender_addr, &reply)) 
       {
-        buffer[len] = '\0';
-        char cr_ip[MAX_IP_LENGTH], filename[MAX_FILENAME_LENGTH];
-        int tcp_port;
+        char cr_ip[MAX_IP_LENGTH];
         inet_ntop(AF_INET, &sender_addr.sin_addr, cr_ip, sizeof(cr_ip));
-
-        if (sscanf(buffer, "READY_TO_SEND %s %d", filename, &tcp_port) == 2) 
-        {
-          execute_tcp_download(cr_ip, tcp_port, filename);
-        } 
-        else 
-        {
-          printf("\n--- CR Reply (fback) ---\n%s\n> ", buffer);
-          fflush(stdout);
-        }
+        handle_cr_reply(&reply, cr_ip, "fback");
       }
     }
   }
@@ -328,13 +2469,21 @@ void* listener_thread_func(void* arg)
 int main() 
 {
   printf("Running Super User.\n\n");
+  G_MAX_STREAMS = env_int("DBIN_STREAMS", DEFAULT_STREAM_COUNT, 1, MAX_STREAMS);
+  G_COMPRESSION = env_int("DBIN_COMPRESS", 1, 0, 1) == 1;
+  G_MULTICAST = env_int("DBIN_MULTICAST", 1, 0, 1) == 1;
+  G_SCHEDULER.global_rate = env_int("DBIN_RATE_LIMIT_KBPS", 0, 0, RATE_LIMIT_MAX_KBPS) * 1024LL;
+  G_SCHEDULER.peer_rate = env_int("DBIN_PEER_RATE_LIMIT_KBPS", 0, 0, RATE_LIMIT_MAX_KBPS) * 1024LL;
+  int metrics_port = env_int("DBIN_METRICS_PORT", 0, 0, 65535);
+  if (metrics_port > 0) start_metrics_endpoint(metrics_port);
+  crc32c_init();
   int num_normal_users = 0;
   char input_buffer[MAX_CMD_LENGTH];
 
-  printf("Enter the number of Normal Users (max %d): ", MAX_NODES);
+  printf("Enter the number of Normal Users: ");
   fgets(input_buffer, sizeof(input_buffer), stdin);
   num_normal_users = atoi(input_buffer);
-  if (num_normal_users < 0 || num_normal_users > MAX_NODES) 
+  if (num_normal_users < 0) 
   {
     fprintf(stderr, "Invalid number of users.\n"); 
     return EXIT_FAILURE;
@@ -346,35 +2495,33 @@ int main()
     printf("  IP of NU %d: ", i + 1);
     fgets(input_buffer, sizeof(input_buffer), stdin);
     input_buffer[strcspn(input_buffer, "\n")] = 0;
-    strncpy(G_IP_TABLE[i], input_buffer, MAX_IP_LENGTH - 1);
-    G_IP_TABLE[i][MAX_IP_LENGTH - 1] = '\0';
+    struct in_addr nu_addr;
+    if (!add_member_ip(input_buffer, &nu_addr)) return EXIT_FAILURE;
   }
 
+  char cr_ip[MAX_IP_LENGTH];
   printf("Enter Central Repository IP address: ");
   fgets(input_buffer, sizeof(input_buffer), stdin);
   input_buffer[strcspn(input_buffer, "\n")] = 0;
-  strncpy(G_IP_TABLE[num_normal_users], input_buffer, MAX_IP_LENGTH - 1);
-  G_IP_TABLE[num_normal_users][MAX_IP_LENGTH - 1] = '\0';
+  strncpy(cr_ip, input_buffer, MAX_IP_LENGTH - 1);
+  cr_ip[MAX_IP_LENGTH - 1] = '\0';
+  if (!add_member_ip(cr_ip, &G_CR_ADDR)) return EXIT_FAILURE;
 
+  char self_ip[MAX_IP_LENGTH];
   printf("Enter this Super User machine's correct network IP: ");
   fgets(input_buffer, sizeof(input_buffer), stdin);
   input_buffer[strcspn(input_buffer, "\n")] = 0;
-  strncpy(G_IP_TABLE[num_normal_users + 1], input_buffer, MAX_IP_LENGTH - 1);
-  G_IP_TABLE[num_normal_users + 1][MAX_IP_LENGTH - 1] = '\0';
-  printf("Super User IP has been set to: %s\n", G_IP_TABLE[num_normal_users + 1]);
+  strncpy(self_ip, input_buffer, MAX_IP_LENGTH - 1);
+  self_ip[MAX_IP_LENGTH - 1] = '\0';
+  if (!add_member_ip(self_ip, &G_SU_ADDR)) return EXIT_FAILURE;
+  printf("Super User IP has been set to: %s\n", self_ip);
 
-  G_NUM_NODES_IN_TABLE = num_normal_users + 2;
-  char* self_ip = G_IP_TABLE[num_normal_users + 1];
-    
-  char iptable_message[1024] = "IP Table:\n";
-  for (int i = 0; i < G_NUM_NODES_IN_TABLE; ++i) 
-  {
-    strncat(iptable_message, G_IP_TABLE[i], sizeof(iptable_message) - strlen(iptable_message) - 1);
-    strncat(iptable_message, "\n", sizeof(iptable_message) - strlen(iptable_message) - 1);
-  }
+  // Versions start from the clock, so a restarted SU's tables supersede the ones it sent before
+  G_MEMBERSHIP_VERSION = (uint64_t)time(NULL) << 16;
   printf("\nBroadcasting IP table to all nodes...\n");
-  broadcast_message(iptable_message, SU_IP_NU, SU_IP_CR);
+  broadcast_ip_table();
   sleep(1);
+  start_cr_session(cr_ip);
 
   listener_args args;
   struct sockaddr_in nu_addr = { .sin_family = AF_INET, .sin_addr.s_addr = INADDR_ANY, .sin_port = htons(NU_SENDTO_SU) };
@@ -410,7 +2557,7 @@ int main()
   pthread_t listener_tid;
   pthread_create(&listener_tid, NULL, listener_thread_func, &args);
 
-  printf("\nCommands: fnu, fdel, fsee, fback, cleardb, kall\n> ");
+  printf("\nCommands: fnu, fall, fdel, fsee, fback, cleardb, addnode, rmnode, stats, kall\n> ");
   while (!G_EXIT_REQUEST && fgets(input_buffer, sizeof(input_buffer), stdin)) 
   {
     input_buffer[strcspn(input_buffer, "\n")] = 0;
@@ -421,11 +2568,21 @@ int main()
       printf("> "); 
       continue; 
     }
+    // fall takes no address; the rest of the line is the file
+    if (strcmp(command, "fall") == 0) 
+    {
+      char* path = strtok_r(NULL, "", &saveptr);
+      if (path) relay_to_all(path, self_ip);
+      else printf("Usage: fall <filepath>\n");
+      printf("> ");
+      continue;
+    }
 
     char* ip = strtok_r(NULL, " ", &saveptr);
     char* file = strtok_r(NULL, "", &saveptr);
 
-    if (ip && !is_ip_in_table(ip)) 
+    // addnode names an address that is not in the network yet
+    if (ip && strcmp(command, "addnode") != 0 && !is_ip_in_table(ip)) 
     {
       printf("Error: IP '%s' is not in the network.\n", ip);
     }
@@ -434,13 +2591,15 @@ int main()
     {
       if (strcmp(command, "fnu") == 0) 
       {
-        if (ip && file) initiate_file_transfer(ip, SU_SENDTO_NU, file, self_ip);
-        else printf("Usage: fnu <nu_ip> <filepath>\n");
+        if (ip && file && is_batch_path(file)) initiate_batch_transfer(ip, SU_SENDTO_NU, file, self_ip);
+        else if (ip && file) initiate_file_transfer(ip, SU_SENDTO_NU, file, self_ip, false);
+        else printf("Usage: fnu <nu_ip> <filepath|directory|glob>\n");
       } 
       else if (strcmp(command, "fdel") == 0) 
       {
-        if (ip && file) initiate_file_transfer(ip, SU_SENDTO_CR, file, self_ip);
-        else printf("Usage: fdel <cr_ip> <filepath>\n");
+        if (ip && file && is_batch_path(file)) initiate_batch_transfer(ip, SU_SENDTO_CR, file, self_ip);
+        else if (ip && file) initiate_file_transfer(ip, SU_SENDTO_CR, file, self_ip, true);
+        else printf("Usage: fdel <cr_ip> <filepath|directory|glob>\n");
       } 
       else if (strcmp(command, "fsee") == 0 || strcmp(command, "cleardb") == 0 || strcmp(command, "fback") == 0) 
       {
@@ -452,15 +2611,26 @@ int main()
           } 
           else 
           {
-            char msg[MAX_CMD_LENGTH];
-            if (file) snprintf(msg, sizeof(msg), "%s %s", command, file);
-            else snprintf(msg, sizeof(msg), "%s", command);
-            int sock = socket(AF_INET, SOCK_DGRAM, 0);
-            struct sockaddr_in cr_addr = { .sin_family = AF_INET, .sin_port = htons(SU_SENDTO_CR) };
-            inet_pton(AF_INET, ip, &cr_addr.sin_addr);
-            sendto(sock, msg, strlen(msg), 0, (struct sockaddr*)&cr_addr, sizeof(cr_addr));
-            close(sock);
-            printf("Request for '%s' sent to CR.\n", command);
+            control_frame request;
+            // fback names the codecs we accept, so the CR may compress what it sends back
+            if (strcmp(command, "fback") == 0) 
+            {
+              control_begin(&request, CONTROL_FBACK);
+              control_put_string(&request, FIELD_NAME, file);
+              control_put_string(&request, FIELD_CODEC, G_COMPRESSION ? COMPRESSION_CODEC : "none");
+            }
+            // A listing id asks for the listing over TCP, which has no size limit; any options go with it
+            else if (strcmp(command, "fsee") == 0) 
+            {
+              control_begin(&request, CONTROL_LIST);
+              control_put_u64(&request, FIELD_TRANSFER_ID, generate_transfer_id());
+              if (file) control_put_string(&request, FIELD_TEXT, file);
+            }
+            else control_begin(&request, CONTROL_CLEARDB);
+            if (!request.invalid && strcmp(command, "fback") == 0) atomic_store(&G_FBACK_REQUESTED_US, monotonic_us());
+            if (request.invalid) printf("Request for '%s' is too long to send.\n", command);
+            else if (send_cr_command(ip, SU_SENDTO_CR, &request)) printf("Request for '%s' sent to CR.\n", command);
+            else printf("CR %s did not acknowledge '%s'.\n", ip, command);
           }
         } 
         else 
@@ -468,10 +2638,22 @@ int main()
           printf("Usage: %s <cr_ip> [args]\n", command);
         }
       } 
+      else if (strcmp(command, "addnode") == 0 || strcmp(command, "rmnode") == 0) 
+      {
+        if (ip && strcmp(command, "addnode") == 0) add_node(ip);
+        else if (ip) remove_node(ip);
+        else printf("Usage: %s <nu_ip>\n", command);
+      } 
+      else if (strcmp(command, "stats") == 0) 
+      {
+        print_stats();
+      } 
       else if (strcmp(command, "kall") == 0) 
       {
         printf("Sending termination signal...\n");
-        broadcast_message("Connection Terminated.", SU_SENDTO_NU, SU_SENDTO_CR);
+        control_frame terminate;
+        control_begin(&terminate, CONTROL_TERMINATE);
+        broadcast_message(&terminate, SU_SENDTO_NU, SU_SENDTO_CR);
         G_EXIT_REQUEST = true;
       } 
       else 
@@ -0,0 +1,950 @@
+//------------------------------------------------------------------------------------//
+	              		//DBIN COMMON CODE//
+//------------------------------------------------------------------------------------//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <errno.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "dbin_common.h"
+
+// Global Variables
+volatile bool G_EXIT_REQUEST = false;
+int G_MAX_STREAMS = DEFAULT_STREAM_COUNT;
+transfer_scheduler G_SCHEDULER = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+// Utility Functions
+void trim_whitespace(char *str) 
+{
+  if (!str) return;
+  char *end = str + strlen(str) - 1;
+  while (end >= str && isspace((unsigned char)*end)) end--;
+  *(end + 1) = '\0';
+  char *start = str;
+  while (*start && isspace((unsigned char)*start)) start++;
+  memmove(str, start, strlen(start) + 1);
+}
+
+int env_int(const char* name, int fallback, int min, int max)
+{
+  const char* value = getenv(name);
+  if (!value || !*value) return fallback;
+  int parsed = atoi(value);
+  if (parsed < min || parsed > max) 
+  {
+    fprintf(stderr, "Ignoring %s=%s (allowed range %d-%d).\n", name, value, min, max);
+    return fallback;
+  }
+  return parsed;
+}
+
+uint64_t generate_transfer_id(void)
+{
+  uint64_t id = 0;
+  FILE* urandom = fopen("/dev/urandom", "rb");
+  if (!urandom || fread(&id, sizeof(id), 1, urandom) != 1) id = ((uint64_t)time(NULL) << 32) ^ ((uint64_t)getpid() << 16) ^ (uint64_t)rand();
+  if (urandom) fclose(urandom);
+  return id;
+}
+
+long long monotonic_ms(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+long long monotonic_us(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// SHA-256 (FIPS 180-4), kept local so the programs need no crypto library
+static const uint32_t SHA256_K[64] = 
+{
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define SHA256_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256_init(sha256_ctx* ctx)
+{
+  static const uint32_t initial_state[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+  memcpy(ctx->state, initial_state, sizeof(initial_state));
+  ctx->length = 0;
+  ctx->buffered = 0;
+}
+
+void sha256_block(sha256_ctx* ctx, const uint8_t* block)
+{
+  uint32_t w[64];
+  for (int i = 0; i < 16; ++i) w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 | (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+  for (int i = 16; i < 64; ++i)
+  {
+    uint32_t s0 = SHA256_ROTR(w[i - 15], 7) ^ SHA256_ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = SHA256_ROTR(w[i - 2], 17) ^ SHA256_ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+  uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+  uint32_t e = ctx->state[4], f = ctx->state[5], g = ctx->state[6], h = ctx->state[7];
+  for (int i = 0; i < 64; ++i)
+  {
+    uint32_t t1 = h + (SHA256_ROTR(e, 6) ^ SHA256_ROTR(e, 11) ^ SHA256_ROTR(e, 25)) + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+    uint32_t t2 = (SHA256_ROTR(a, 2) ^ SHA256_ROTR(a, 13) ^ SHA256_ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+    h = g; g = f; f = e; e = d + t1;
+    d = c; c = b; b = a; a = t1 + t2;
+  }
+  ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+  ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+void sha256_update(sha256_ctx* ctx, const void* data, size_t length)
+{
+  const uint8_t* bytes = (const uint8_t*)data;
+  ctx->length += length;
+  if (ctx->buffered > 0)
+  {
+    size_t take = 64 - ctx->buffered < length ? 64 - ctx->buffered : length;
+    memcpy(ctx->buffer + ctx->buffered, bytes, take);
+    ctx->buffered += take;
+    bytes += take;
+    length -= take;
+    if (ctx->buffered < 64) return;
+    sha256_block(ctx, ctx->buffer);
+    ctx->buffered = 0;
+  }
+  for (; length >= 64; bytes += 64, length -= 64) sha256_block(ctx, bytes);
+  memcpy(ctx->buffer, bytes, length);
+  ctx->buffered = length;
+}
+
+// Writes the digest as 64 lowercase hex characters plus a terminator.
+void sha256_final_hex(sha256_ctx* ctx, char* hex)
+{
+  uint64_t bit_length = ctx->length * 8;
+  uint8_t padding[72] = { 0x80 };
+  size_t pad_length = (ctx->buffered < 56 ? 56 : 120) - ctx->buffered;
+  for (int i = 0; i < 8; ++i) padding[pad_length + i] = (uint8_t)(bit_length >> (56 - 8 * i));
+  sha256_update(ctx, padding, pad_length + 8);
+  for (int i = 0; i < 8; ++i) snprintf(hex + i * 8, 9, "%08x", ctx->state[i]);
+}
+
+bool sha256_file(const char* path, char* hex)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+  sha256_ctx ctx;
+  sha256_init(&ctx);
+  char* buffer = malloc(HASH_BUFFER_SIZE);
+  ssize_t n = -1;
+  while (buffer && (n = read(fd, buffer, HASH_BUFFER_SIZE)) > 0) sha256_update(&ctx, buffer, n);
+  free(buffer);
+  close(fd);
+  if (n < 0) return false;
+  sha256_final_hex(&ctx, hex);
+  return true;
+}
+
+// CRC32C (Castagnoli). SSE4.2 has an instruction for it; other CPUs use slicing-by-8 tables.
+// Values chain like zlib's crc32: crc32c_update(crc32c_update(0, a), b) is the CRC of a then b.
+uint32_t G_CRC32C_TABLE[8][256];
+bool G_CRC32C_HARDWARE = false;
+
+void crc32c_init(void)
+{
+  for (uint32_t i = 0; i < 256; ++i)
+  {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; ++bit) crc = (crc >> 1) ^ (CRC32C_POLYNOMIAL & (0u - (crc & 1)));
+    G_CRC32C_TABLE[0][i] = crc;
+  }
+  for (uint32_t i = 0; i < 256; ++i)
+  {
+    for (int k = 1; k < 8; ++k) G_CRC32C_TABLE[k][i] = (G_CRC32C_TABLE[k - 1][i] >> 8) ^ G_CRC32C_TABLE[0][G_CRC32C_TABLE[k - 1][i] & 0xff];
+  }
+#if defined(__x86_64__)
+  G_CRC32C_HARDWARE = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+uint32_t crc32c_software(uint32_t crc, const uint8_t* data, size_t length)
+{
+  for (; length >= 8; data += 8, length -= 8)
+  {
+    uint32_t low, high;
+    memcpy(&low, data, sizeof(low));
+    memcpy(&high, data + 4, sizeof(high));
+    low = le32toh(low) ^ crc;
+    high = le32toh(high);
+    crc = G_CRC32C_TABLE[7][low & 0xff] ^ G_CRC32C_TABLE[6][(low >> 8) & 0xff] ^ G_CRC32C_TABLE[5][(low >> 16) & 0xff] ^ G_CRC32C_TABLE[4][low >> 24] ^
+          G_CRC32C_TABLE[3][high & 0xff] ^ G_CRC32C_TABLE[2][(high >> 8) & 0xff] ^ G_CRC32C_TABLE[1][(high >> 16) & 0xff] ^ G_CRC32C_TABLE[0][high >> 24];
+  }
+  while (length--) crc = (crc >> 8) ^ G_CRC32C_TABLE[0][(crc ^ *data++) & 0xff];
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) uint32_t crc32c_hardware(uint32_t crc, const uint8_t* data, size_t length)
+{
+  uint64_t crc64 = crc;
+  for (; length >= 8; data += 8, length -= 8)
+  {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    crc64 = __builtin_ia32_crc32di(crc64, word);
+  }
+  crc = (uint32_t)crc64;
+  while (length--) crc = __builtin_ia32_crc32qi(crc, *data++);
+  return crc;
+}
+#endif
+
+uint32_t crc32c_update(uint32_t crc, const void* data, size_t length)
+{
+  crc = ~crc;
+#if defined(__x86_64__)
+  if (G_CRC32C_HARDWARE) return ~crc32c_hardware(crc, data, length);
+#endif
+  return ~crc32c_software(crc, data, length);
+}
+
+// Multiplies a GF(2) 32x32 matrix by a vector, for crc32c_combine.
+uint32_t gf2_matrix_times(const uint32_t* matrix, uint32_t vector)
+{
+  uint32_t sum = 0;
+  for (; vector; vector >>= 1, matrix++) if (vector & 1) sum ^= *matrix;
+  return sum;
+}
+
+void gf2_matrix_square(uint32_t* square, const uint32_t* matrix)
+{
+  for (int n = 0; n < 32; ++n) square[n] = gf2_matrix_times(matrix, matrix[n]);
+}
+
+// CRC of A followed by B, given crc(A), crc(B) and B's length (the zlib method), so per-stripe
+// checksums add up to the whole file's without reading it again.
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, long long length2)
+{
+  if (length2 <= 0) return crc1;
+  uint32_t even[32], odd[32];
+  odd[0] = CRC32C_POLYNOMIAL;
+  for (int n = 1, row = 1; n < 32; ++n, row <<= 1) odd[n] = row;
+  gf2_matrix_square(even, odd);
+  gf2_matrix_square(odd, even);
+  do
+  {
+    gf2_matrix_square(even, odd);
+    if (length2 & 1) crc1 = gf2_matrix_times(even, crc1);
+    length2 >>= 1;
+    if (!length2) break;
+    gf2_matrix_square(odd, even);
+    if (length2 & 1) crc1 = gf2_matrix_times(odd, crc1);
+    length2 >>= 1;
+  } while (length2);
+  return crc1 ^ crc2;
+}
+
+// Checksums bytes already on disk, e.g. the part of a stripe an earlier attempt delivered.
+bool crc32c_file_range(int fd, off_t offset, off_t length, uint32_t* crc)
+{
+  uint8_t* buffer = malloc(HASH_BUFFER_SIZE);
+  bool ok = buffer != NULL;
+  while (ok && length > 0)
+  {
+    ssize_t n = pread(fd, buffer, length < HASH_BUFFER_SIZE ? (size_t)length : HASH_BUFFER_SIZE, offset);
+    ok = n > 0;
+    if (!ok) break;
+    *crc = crc32c_update(*crc, buffer, n);
+    offset += n;
+    length -= n;
+  }
+  free(buffer);
+  return ok;
+}
+
+// Compression: a small LZ77 codec in the LZ4 style, kept local like SHA-256. Data travels as
+// frames of {uint32 raw_length; uint32 packed_length} (big-endian) plus payload; a frame whose
+// packed length equals its raw length carries the chunk as-is.
+void lz_emit_length(uint8_t* dst, size_t* out, size_t length)
+{
+  for (; length >= 255; length -= 255) dst[(*out)++] = 255;
+  dst[(*out)++] = (uint8_t)length;
+}
+
+// Appends one sequence (literals, then a back-reference unless match_length is 0). Returns
+// false if it would not fit in 'capacity'.
+bool lz_emit_sequence(uint8_t* dst, size_t capacity, size_t* out, const uint8_t* literals, size_t literal_length, size_t match_length, size_t match_offset)
+{
+  size_t extra = match_length ? match_length - LZ_MIN_MATCH : 0;
+  if (*out + 1 + literal_length / 255 + 1 + literal_length + 2 + extra / 255 + 1 > capacity) return false;
+  dst[(*out)++] = (uint8_t)((literal_length < 15 ? literal_length : 15) << 4 | (extra < 15 ? extra : 15));
+  if (literal_length >= 15) lz_emit_length(dst, out, literal_length - 15);
+  memcpy(dst + *out, literals, literal_length);
+  *out += literal_length;
+  if (!match_length) return true;
+  dst[(*out)++] = (uint8_t)(match_offset & 0xff);
+  dst[(*out)++] = (uint8_t)(match_offset >> 8);
+  if (extra >= 15) lz_emit_length(dst, out, extra - 15);
+  return true;
+}
+
+// Compresses up to COMPRESS_CHUNK_SIZE bytes; returns the packed size, or 0 if it would not fit
+// in 'capacity'. Misses widen the search step, so incompressible input costs little.
+size_t lz_compress(const uint8_t* src, size_t length, uint8_t* dst, size_t capacity)
+{
+  uint16_t table[1 << LZ_HASH_BITS];
+  memset(table, 0, sizeof(table));
+  size_t in = 0, anchor = 0, out = 0, misses = 0;
+  while (in + LZ_MIN_MATCH <= length)
+  {
+    uint32_t sequence, candidate_sequence;
+    memcpy(&sequence, src + in, sizeof(sequence));
+    uint32_t slot = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+    size_t candidate = table[slot];
+    table[slot] = (uint16_t)in;
+    memcpy(&candidate_sequence, src + candidate, sizeof(candidate_sequence));
+    if (candidate >= in || candidate_sequence != sequence) 
+    {
+      in += 1 + (misses++ >> 6);
+      continue;
+    }
+    size_t match_length = LZ_MIN_MATCH;
+    while (in + match_length < length && src[candidate + match_length] == src[in + match_length]) match_length++;
+    if (!lz_emit_sequence(dst, capacity, &out, src + anchor, in - anchor, match_length, in - candidate)) return 0;
+    in += match_length;
+    anchor = in;
+    misses = 0;
+  }
+  if (!lz_emit_sequence(dst, capacity, &out, src + anchor, length - anchor, 0, 0)) return 0;
+  return out;
+}
+
+bool lz_decompress(const uint8_t* src, size_t length, uint8_t* dst, size_t raw_length)
+{
+  size_t in = 0, out = 0;
+  while (in < length)
+  {
+    uint8_t token = src[in++];
+    size_t literal_length = token >> 4, match_length = token & 15;
+    if (literal_length == 15) 
+    {
+      uint8_t more;
+      do 
+      {
+        if (in >= length) return false;
+        more = src[in++];
+        literal_length += more;
+      } while (more == 255);
+    }
+    if (literal_length > length - in || literal_length > raw_length - out) return false;
+    memcpy(dst + out, src + in, literal_length);
+    in += literal_length;
+    out += literal_length;
+    if (in == length) break;
+    if (length - in < 2) return false;
+    size_t offset = src[in] | (size_t)src[in + 1] << 8;
+    in += 2;
+    if (match_length == 15) 
+    {
+      uint8_t more;
+      do 
+      {
+        if (in >= length) return false;
+        more = src[in++];
+        match_length += more;
+      } while (more == 255);
+    }
+    match_length += LZ_MIN_MATCH;
+    if (offset == 0 || offset > out || match_length > raw_length - out) return false;
+    for (size_t i = 0; i < match_length; ++i, ++out) dst[out] = dst[out - offset];
+  }
+  return out == raw_length;
+}
+
+// Frames one chunk, compressing it unless recent chunks refused to shrink; after a run of
+// incompressible chunks only every COMPRESS_REPROBE_INTERVAL-th one is tried again.
+size_t encode_chunk(const uint8_t* raw, size_t raw_length, uint8_t* frame, int* incompressible_run)
+{
+  size_t packed_length = 0;
+  if (*incompressible_run < COMPRESS_GIVE_UP_CHUNKS || *incompressible_run % COMPRESS_REPROBE_INTERVAL == 0)
+  {
+    packed_length = lz_compress(raw, raw_length, frame + COMPRESS_FRAME_HEADER, raw_length - raw_length / 16 - 1);
+  }
+  if (packed_length == 0)
+  {
+    memcpy(frame + COMPRESS_FRAME_HEADER, raw, raw_length);
+    packed_length = raw_length;
+    (*incompressible_run)++;
+  }
+  else *incompressible_run = 0;
+  uint32_t header[2] = { htonl((uint32_t)raw_length), htonl((uint32_t)packed_length) };
+  memcpy(frame, header, sizeof(header));
+  return COMPRESS_FRAME_HEADER + packed_length;
+}
+
+// Compresses a few chunks spread over the file and reports whether they shrank enough to be
+// worth compressing the whole transfer.
+bool sample_compressible(int fd, long long filesize)
+{
+  if (filesize < COMPRESS_MIN_FILE_SIZE) return false;
+  uint8_t* raw = malloc(COMPRESS_CHUNK_SIZE);
+  uint8_t* packed = malloc(COMPRESS_CHUNK_SIZE);
+  long long raw_total = 0, packed_total = 0;
+  for (int i = 0; raw && packed && i < COMPRESS_SAMPLE_CHUNKS; ++i)
+  {
+    long long span = filesize > COMPRESS_CHUNK_SIZE ? filesize - COMPRESS_CHUNK_SIZE : 0;
+    ssize_t n = pread(fd, raw, COMPRESS_CHUNK_SIZE, (off_t)(span * i / (COMPRESS_SAMPLE_CHUNKS - 1)));
+    if (n <= 0) break;
+    size_t packed_length = lz_compress(raw, n, packed, n);
+    raw_total += n;
+    packed_total += packed_length ? (long long)packed_length : n;
+  }
+  free(raw);
+  free(packed);
+  return raw_total > 0 && packed_total * 100 <= raw_total * (100 - COMPRESS_MIN_SAVING_PERCENT);
+}
+
+// Scheduling
+// Each program opens and closes its own flows; the sharing of the limits between them is common.
+// The weights are those of the interactive, bulk and background classes.
+static const int PRIORITY_WEIGHTS[] = { 16, 4, 1 };
+
+// How much a flow moves between checks of its bucket, and the most it may save up while idle.
+size_t rate_quantum(double rate)
+{
+  double quantum = rate / RATE_SLICES_PER_SECOND;
+  if (quantum < RATE_MIN_QUANTUM) return RATE_MIN_QUANTUM;
+  return quantum > RATE_MAX_QUANTUM ? RATE_MAX_QUANTUM : (size_t)quantum;
+}
+
+// Recomputes every flow's rate; called with the scheduler locked whenever a flow starts or ends.
+// The per-node limit caps each flow first, then the overall limit is filled by weight, so a flow
+// held below its share by its node's limit leaves the rest to the others.
+void rebalance_flows(void)
+{
+  for (transfer_flow* flow = G_SCHEDULER.flows; flow; flow = flow->next)
+  {
+    int peer_weight = 0;
+    for (transfer_flow* other = G_SCHEDULER.flows; other; other = other->next) 
+    {
+      if (other->peer.s_addr == flow->peer.s_addr) peer_weight += PRIORITY_WEIGHTS[other->priority];
+    }
+    flow->rate = G_SCHEDULER.peer_rate > 0 ? (double)G_SCHEDULER.peer_rate * PRIORITY_WEIGHTS[flow->priority] / peer_weight : 0;
+    flow->settled = G_SCHEDULER.global_rate == 0;
+  }
+  double remaining = G_SCHEDULER.global_rate;
+  bool settled_any = true;
+  while (settled_any)
+  {
+    settled_any = false;
+    int weight = 0;
+    for (transfer_flow* flow = G_SCHEDULER.flows; flow; flow = flow->next) if (!flow->settled) weight += PRIORITY_WEIGHTS[flow->priority];
+    for (transfer_flow* flow = G_SCHEDULER.flows; flow; flow = flow->next)
+    {
+      if (flow->settled || flow->rate == 0 || flow->rate > remaining * PRIORITY_WEIGHTS[flow->priority] / weight) continue;
+      flow->settled = settled_any = true;
+      remaining -= flow->rate;
+    }
+    if (settled_any) continue;
+    for (transfer_flow* flow = G_SCHEDULER.flows; flow; flow = flow->next) if (!flow->settled) flow->rate = remaining * PRIORITY_WEIGHTS[flow->priority] / weight;
+  }
+}
+
+// Metrics
+// Counters are relaxed atomics, so the transfer paths count without taking a lock. Latencies and
+// throughputs go into HDR-style histograms: 32 linear sub-buckets per power of two keep every
+// recorded value to about 3% from single units up to the full 64-bit range, in fixed space.
+void metric_add(_Atomic uint64_t* counter, uint64_t amount)
+{
+  atomic_fetch_add_explicit(counter, amount, memory_order_relaxed);
+}
+
+size_t histogram_index(uint64_t value)
+{
+  if (value < HISTOGRAM_SUB_BUCKETS) return value;
+  int exponent = 63 - __builtin_clzll(value);
+  return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS + ((value >> (exponent - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+// The smallest value that lands in bucket 'index'.
+uint64_t histogram_bucket_floor(size_t index)
+{
+  if (index < HISTOGRAM_SUB_BUCKETS) return index;
+  int exponent = index / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+  return (uint64_t)(HISTOGRAM_SUB_BUCKETS + index % HISTOGRAM_SUB_BUCKETS) << (exponent - HISTOGRAM_SUB_BITS);
+}
+
+void histogram_record(metric_histogram* histogram, uint64_t value)
+{
+  atomic_fetch_add_explicit(&histogram->buckets[histogram_index(value)], 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&histogram->sum, value, memory_order_relaxed);
+  uint64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+  while (value > max && !atomic_compare_exchange_weak_explicit(&histogram->max, &max, value, memory_order_relaxed, memory_order_relaxed));
+}
+
+// The highest value in the bucket holding the given quantile, capped at the largest value seen.
+// Buckets are read while others may still record, so a quantile is as of roughly that moment.
+uint64_t histogram_percentile(metric_histogram* histogram, double quantile)
+{
+  uint64_t count = atomic_load_explicit(&histogram->count, memory_order_relaxed);
+  uint64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+  if (count == 0) return 0;
+  uint64_t target = (uint64_t)(quantile * count + 0.999999);
+  if (target == 0) target = 1;
+  uint64_t seen = 0;
+  for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i)
+  {
+    seen += atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+    if (seen < target) continue;
+    uint64_t highest = i + 1 < HISTOGRAM_BUCKETS ? histogram_bucket_floor(i + 1) - 1 : UINT64_MAX;
+    return highest < max ? highest : max;
+  }
+  return max;
+}
+
+// Brackets one transfer for the metrics: the active gauge, its outcome and, when it completed,
+// the rate its payload moved at ('bytes' is what this attempt carried, not what a resume skipped).
+long long metrics_transfer_started(void)
+{
+  atomic_fetch_add_explicit(&G_METRICS.active_transfers, 1, memory_order_relaxed);
+  return monotonic_us();
+}
+
+void metrics_transfer_finished(long long started_us, long long bytes, bool ok)
+{
+  atomic_fetch_sub_explicit(&G_METRICS.active_transfers, 1, memory_order_relaxed);
+  metric_add(ok ? &G_METRICS.transfers_completed : &G_METRICS.transfers_failed, 1);
+  long long elapsed_us = monotonic_us() - started_us;
+  if (ok && bytes > 0 && elapsed_us > 0) histogram_record(&G_METRICS.throughput, (uint64_t)(bytes * 1000000.0 / 1024 / elapsed_us));
+}
+
+// Prometheus text format; each histogram is exported as a summary with its 50th, 90th and 99th
+// percentiles, in base units (seconds, bytes per second).
+void write_metrics(FILE* out)
+{
+  fprintf(out, "# HELP dbin_bytes_sent_total Transfer payload bytes sent.\n# TYPE dbin_bytes_sent_total counter\ndbin_bytes_sent_total %llu\n", (unsigned long long)atomic_load(&G_METRICS.bytes_sent));
+  fprintf(out, "# HELP dbin_bytes_received_total Transfer payload bytes received.\n# TYPE dbin_bytes_received_total counter\ndbin_bytes_received_total %llu\n", (unsigned long long)atomic_load(&G_METRICS.bytes_received));
+  fprintf(out, "# HELP dbin_transfers_completed_total Transfers that finished intact.\n# TYPE dbin_transfers_completed_total counter\ndbin_transfers_completed_total %llu\n", (unsigned long long)atomic_load(&G_METRICS.transfers_completed));
+  fprintf(out, "# HELP dbin_transfers_failed_total Transfers that broke off or failed a checksum.\n# TYPE dbin_transfers_failed_total counter\ndbin_transfers_failed_total %llu\n", (unsigned long long)atomic_load(&G_METRICS.transfers_failed));
+  fprintf(out, "# HELP dbin_active_transfers Transfers under way.\n# TYPE dbin_active_transfers gauge\ndbin_active_transfers %lld\n", (long long)atomic_load(&G_METRICS.active_transfers));
+  for (size_t h = 0; h < METRIC_MAX_HISTOGRAMS && G_METRICS.histograms[h]; ++h)
+  {
+    metric_histogram* histogram = G_METRICS.histograms[h];
+    fprintf(out, "# HELP %s %s\n# TYPE %s summary\n", histogram->name, histogram->help, histogram->name);
+    const double quantiles[] = { 0.5, 0.9, 0.99 };
+    for (int q = 0; q < 3; ++q) fprintf(out, "%s{quantile=\"%g\"} %.9g\n", histogram->name, quantiles[q], histogram_percentile(histogram, quantiles[q]) * histogram->scale);
+    fprintf(out, "%s_sum %.9g\n%s_count %llu\n", histogram->name, atomic_load(&histogram->sum) * histogram->scale, histogram->name, (unsigned long long)atomic_load(&histogram->count));
+  }
+}
+
+// Serves the metrics to whoever connects to 127.0.0.1:DBIN_METRICS_PORT, as a one-shot HTTP
+// response, so both a Prometheus scrape and a plain 'curl' work.
+void* metrics_thread_func(void* arg)
+{
+  int listen_sock = *(int*)arg;
+  free(arg);
+  while (!G_EXIT_REQUEST)
+  {
+    int sock = accept(listen_sock, NULL, NULL);
+    if (sock < 0) 
+    {
+      if (errno != EINTR) perror("metrics accept");
+      continue;
+    }
+    // The request itself does not matter; it is read only so closing does not reset the connection
+    struct timeval read_timeout = { .tv_sec = 1, .tv_usec = 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &read_timeout, sizeof(read_timeout));
+    char request[1024];
+    recv(sock, request, sizeof(request), 0);
+    char* body = NULL;
+    size_t body_length = 0;
+    FILE* out = open_memstream(&body, &body_length);
+    if (out) 
+    {
+      write_metrics(out);
+      fclose(out);
+      char header[128];
+      int header_length = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", body_length);
+      send(sock, header, header_length, MSG_NOSIGNAL);
+      send(sock, body, body_length, MSG_NOSIGNAL);
+      free(body);
+    }
+    close(sock);
+  }
+  close(listen_sock);
+  return NULL;
+}
+
+void start_metrics_endpoint(int port)
+{
+  int* listen_sock = malloc(sizeof(int));
+  if (!listen_sock) return;
+  *listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+  int opt = 1;
+  setsockopt(*listen_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+  struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK), .sin_port = htons(port) };
+  pthread_t metrics_tid;
+  if (*listen_sock < 0 || bind(*listen_sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(*listen_sock, 8) < 0) 
+  {
+    perror("metrics endpoint");
+    if (*listen_sock >= 0) close(*listen_sock);
+    free(listen_sock);
+    return;
+  }
+  if (pthread_create(&metrics_tid, NULL, metrics_thread_func, listen_sock) != 0) 
+  {
+    close(*listen_sock);
+    free(listen_sock);
+    return;
+  }
+  pthread_detach(metrics_tid);
+  printf("Metrics served on 127.0.0.1:%d.\n", port);
+}
+
+// Striping
+// Files are split into one contiguous range per stream; small files are not worth extra connections.
+int streams_for_size(long long filesize)
+{
+  long long wanted = (filesize + STRIPE_MIN_BYTES - 1) / STRIPE_MIN_BYTES;
+  if (wanted < 1) return 1;
+  return wanted < G_MAX_STREAMS ? (int)wanted : G_MAX_STREAMS;
+}
+
+int grant_stream_count(int offered)
+{
+  if (offered < 1) return 1;
+  return offered < G_MAX_STREAMS ? offered : G_MAX_STREAMS;
+}
+
+void stripe_range(long long filesize, int stream_count, int stream_index, off_t* offset, off_t* length)
+{
+  long long stripe = (filesize + stream_count - 1) / stream_count;
+  long long start = stripe * stream_index;
+  if (start > filesize) start = filesize;
+  *offset = start;
+  *length = filesize - start < stripe ? filesize - start : stripe;
+}
+
+// IP Sets
+// Nodes are kept as an open-addressing hash set of IPv4 addresses in network order, where 0 marks
+// an empty slot, so checking a sender costs one hash and a short probe however large the network
+// grows. The set doubles once it is half full.
+size_t ip_set_home(const ip_set* set, uint32_t addr)
+{
+  // Fibonacci hashing spreads addresses that differ only in their last octet
+  return (size_t)(((uint64_t)addr * 0x9E3779B97F4A7C15ull) >> 32) & (set->capacity - 1);
+}
+
+bool ip_set_contains(const ip_set* set, struct in_addr addr)
+{
+  if (set->count == 0 || addr.s_addr == 0) return false;
+  size_t mask = set->capacity - 1;
+  for (size_t i = ip_set_home(set, addr.s_addr); set->slots[i] != 0; i = (i + 1) & mask)
+  {
+    if (set->slots[i] == addr.s_addr) return true;
+  }
+  return false;
+}
+
+bool ip_set_grow(ip_set* set)
+{
+  ip_set grown = { .capacity = set->capacity ? set->capacity * 2 : IP_SET_INITIAL_CAPACITY };
+  if (!(grown.slots = calloc(grown.capacity, sizeof(uint32_t)))) return false;
+  for (size_t i = 0; i < set->capacity; ++i)
+  {
+    if (set->slots[i] != 0) ip_set_add(&grown, (struct in_addr){ .s_addr = set->slots[i] });
+  }
+  free(set->slots);
+  *set = grown;
+  return true;
+}
+
+// Returns false only when the set had to grow and could not.
+bool ip_set_add(ip_set* set, struct in_addr addr)
+{
+  if (addr.s_addr == 0) return true;
+  if ((set->count + 1) * 2 > set->capacity && !ip_set_grow(set)) return false;
+  size_t mask = set->capacity - 1;
+  size_t i = ip_set_home(set, addr.s_addr);
+  for (; set->slots[i] != 0; i = (i + 1) & mask)
+  {
+    if (set->slots[i] == addr.s_addr) return true;
+  }
+  set->slots[i] = addr.s_addr;
+  set->count++;
+  return true;
+}
+
+// Entries after the hole move back into it when that keeps them reachable from their home slot,
+// so removals leave no tombstones behind to lengthen later probes.
+bool ip_set_remove(ip_set* set, struct in_addr addr)
+{
+  if (!ip_set_contains(set, addr)) return false;
+  size_t mask = set->capacity - 1;
+  size_t hole = ip_set_home(set, addr.s_addr);
+  while (set->slots[hole] != addr.s_addr) hole = (hole + 1) & mask;
+  set->slots[hole] = 0;
+  set->count--;
+  for (size_t i = (hole + 1) & mask; set->slots[i] != 0; i = (i + 1) & mask)
+  {
+    size_t home = ip_set_home(set, set->slots[i]);
+    if (((i - home) & mask) >= ((i - hole) & mask))
+    {
+      set->slots[hole] = set->slots[i];
+      set->slots[i] = 0;
+      hole = i;
+    }
+  }
+  return true;
+}
+
+void ip_set_clear(ip_set* set)
+{
+  if (set->slots) memset(set->slots, 0, set->capacity * sizeof(uint32_t));
+  set->count = 0;
+}
+
+// Control Protocol
+void control_begin(control_frame* frame, control_type type)
+{
+  memcpy(frame->data, CONTROL_MAGIC, 2);
+  frame->data[2] = CONTROL_VERSION;
+  frame->data[3] = (uint8_t)type;
+  frame->data[4] = frame->data[5] = 0;
+  frame->length = CONTROL_HEADER_SIZE;
+  frame->invalid = false;
+}
+
+// Appends one field and keeps the header's body length current, so the frame is whole after every
+// call. A field that does not fit marks the frame invalid, and an invalid frame is never sent.
+void control_put(control_frame* frame, control_field tag, const void* value, size_t length)
+{
+  if (frame->length + CONTROL_FIELD_HEADER + length > CONTROL_MAX_SIZE) 
+  {
+    frame->invalid = true;
+    return;
+  }
+  uint8_t* field = frame->data + frame->length;
+  field[0] = (uint8_t)tag;
+  field[1] = (uint8_t)(length >> 8);
+  field[2] = (uint8_t)length;
+  memcpy(field + CONTROL_FIELD_HEADER, value, length);
+  frame->length += CONTROL_FIELD_HEADER + length;
+  size_t body_length = frame->length - CONTROL_HEADER_SIZE;
+  frame->data[4] = (uint8_t)(body_length >> 8);
+  frame->data[5] = (uint8_t)body_length;
+}
+
+void control_put_u64(control_frame* frame, control_field tag, uint64_t value)
+{
+  uint64_t wire = htobe64(value);
+  control_put(frame, tag, &wire, sizeof(wire));
+}
+
+void control_put_u32(control_frame* frame, control_field tag, uint32_t value)
+{
+  uint32_t wire = htonl(value);
+  control_put(frame, tag, &wire, sizeof(wire));
+}
+
+void control_put_string(control_frame* frame, control_field tag, const char* value)
+{
+  control_put(frame, tag, value, strlen(value));
+}
+
+void control_put_addr(control_frame* frame, control_field tag, struct in_addr addr)
+{
+  control_put(frame, tag, &addr, sizeof(addr));
+}
+
+void control_put_ip(control_frame* frame, control_field tag, const char* ip)
+{
+  struct in_addr addr;
+  if (inet_pton(AF_INET, ip, &addr) == 1) control_put_addr(frame, tag, addr);
+  else frame->invalid = true;
+}
+
+// A SHA-256 travels as its 32 raw bytes rather than as hex.
+void control_put_hash(control_frame* frame, control_field tag, const char* hex)
+{
+  uint8_t digest[SHA256_HEX_LENGTH / 2];
+  for (size_t i = 0; i < sizeof(digest); ++i)
+  {
+    int high = hex_digit_value(hex[2 * i]);
+    int low = high < 0 ? -1 : hex_digit_value(hex[2 * i + 1]);
+    if (low < 0) 
+    {
+      frame->invalid = true;
+      return;
+    }
+    digest[i] = (uint8_t)(high << 4 | low);
+  }
+  control_put(frame, tag, digest, sizeof(digest));
+}
+
+int hex_digit_value(char c)
+{
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  return -1;
+}
+
+// Names from the wire are joined to local paths, so only a plain file name is accepted.
+bool is_plain_filename(const char* name)
+{
+  return name[0] != '\0' && strchr(name, '/') == NULL && strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
+}
+
+// Field readers for control_decode; each rejects a value of the wrong size.
+bool control_get_u64(const uint8_t* value, size_t length, uint64_t* out)
+{
+  uint64_t wire;
+  if (length != sizeof(wire)) return false;
+  memcpy(&wire, value, sizeof(wire));
+  *out = be64toh(wire);
+  return true;
+}
+
+bool control_get_i64(const uint8_t* value, size_t length, long long* out)
+{
+  uint64_t wire;
+  if (!control_get_u64(value, length, &wire)) return false;
+  *out = (long long)wire;
+  return true;
+}
+
+bool control_get_u32(const uint8_t* value, size_t length, uint32_t* out)
+{
+  uint32_t wire;
+  if (length != sizeof(wire)) return false;
+  memcpy(&wire, value, sizeof(wire));
+  *out = ntohl(wire);
+  return true;
+}
+
+bool control_get_int(const uint8_t* value, size_t length, int* out)
+{
+  uint32_t wire;
+  if (!control_get_u32(value, length, &wire) || wire > INT32_MAX) return false;
+  *out = (int)wire;
+  return true;
+}
+
+// Strings may hold spaces but no NUL of their own, and must fit 'out' with its terminator.
+bool control_get_string(const uint8_t* value, size_t length, char* out, size_t capacity)
+{
+  if (length >= capacity || memchr(value, '\0', length)) return false;
+  memcpy(out, value, length);
+  out[length] = '\0';
+  return true;
+}
+
+bool control_get_addr(const uint8_t* value, size_t length, struct in_addr* out)
+{
+  if (length != sizeof(*out)) return false;
+  memcpy(out, value, sizeof(*out));
+  return true;
+}
+
+bool control_get_ip(const uint8_t* value, size_t length, char* out)
+{
+  return length == sizeof(struct in_addr) && inet_ntop(AF_INET, value, out, MAX_IP_LENGTH) != NULL;
+}
+
+bool control_get_hash(const uint8_t* value, size_t length, char* hex)
+{
+  static const char digits[] = "0123456789abcdef";
+  if (length != SHA256_HEX_LENGTH / 2) return false;
+  for (size_t i = 0; i < length; ++i)
+  {
+    hex[2 * i] = digits[value[i] >> 4];
+    hex[2 * i + 1] = digits[value[i] & 0x0f];
+  }
+  hex[SHA256_HEX_LENGTH] = '\0';
+  return true;
+}
+
+// Reads the frame at the start of 'data' into 'message' in one pass over its fields, without
+// allocating. Returns the frame's length, 0 while 'length' does not hold all of it yet, or -1 for
+// anything that is not a well-formed frame of this version. Optional fields a frame leaves out
+// read as empty strings, one stream and no mtime.
+int control_decode(const uint8_t* data, size_t length, control_message* message)
+{
+  if (length < CONTROL_HEADER_SIZE) return 0;
+  if (memcmp(data, CONTROL_MAGIC, 2) != 0 || data[2] != CONTROL_VERSION) return -1;
+  size_t frame_length = CONTROL_HEADER_SIZE + ((size_t)data[4] << 8 | data[5]);
+  if (frame_length > CONTROL_MAX_SIZE) return -1;
+  if (length < frame_length) return 0;
+  message->type = (control_type)data[3];
+  message->present = 0;
+  message->streams = 1;
+  message->mtime = 0;
+  message->node_count = 0;
+  message->name[0] = message->sender_ip[0] = message->hash[0] = message->codec[0] = message->text[0] = '\0';
+  size_t offset = CONTROL_HEADER_SIZE;
+  while (offset < frame_length)
+  {
+    if (frame_length - offset < CONTROL_FIELD_HEADER) return -1;
+    int tag = data[offset];
+    size_t field_length = (size_t)data[offset + 1] << 8 | data[offset + 2];
+    const uint8_t* value = data + offset + CONTROL_FIELD_HEADER;
+    if (frame_length - offset - CONTROL_FIELD_HEADER < field_length) return -1;
+    offset += CONTROL_FIELD_HEADER + field_length;
+    bool ok;
+    switch (tag)
+    {
+      case FIELD_MESSAGE_ID: ok = control_get_u64(value, field_length, &message->message_id); break;
+      case FIELD_TRANSFER_ID: ok = control_get_u64(value, field_length, &message->transfer_id); break;
+      case FIELD_NAME: ok = control_get_string(value, field_length, message->name, sizeof(message->name)) && is_plain_filename(message->name); break;
+      case FIELD_SIZE: ok = control_get_i64(value, field_length, &message->size) && message->size >= 0; break;
+      case FIELD_MTIME: ok = control_get_i64(value, field_length, &message->mtime); break;
+      case FIELD_SENDER_IP: ok = control_get_ip(value, field_length, message->sender_ip); break;
+      case FIELD_STREAMS: ok = control_get_int(value, field_length, &message->streams); break;
+      case FIELD_HASH: ok = control_get_hash(value, field_length, message->hash); break;
+      case FIELD_CODEC: ok = control_get_string(value, field_length, message->codec, sizeof(message->codec)); break;
+      case FIELD_PORT: ok = control_get_int(value, field_length, &message->port) && message->port <= 65535; break;
+      case FIELD_COUNT: ok = control_get_int(value, field_length, &message->count); break;
+      case FIELD_CHECKSUM: ok = control_get_u32(value, field_length, &message->checksum); break;
+      case FIELD_TEXT: ok = control_get_string(value, field_length, message->text, sizeof(message->text)); break;
+      case FIELD_CR_ADDR: ok = control_get_addr(value, field_length, &message->cr_addr); break;
+      case FIELD_SU_ADDR: ok = control_get_addr(value, field_length, &message->su_addr); break;
+      case FIELD_VERSION: ok = control_get_u64(value, field_length, &message->version); break;
+      case FIELD_CHUNK: ok = control_get_int(value, field_length, &message->chunk); break;
+      case FIELD_NODE:
+        ok = message->node_count < CONTROL_MAX_NODES && control_get_addr(value, field_length, &message->nodes[message->node_count]);
+        if (ok) message->node_count++;
+        break;
+      default: continue;
+    }
+    if (!ok) return -1;
+    message->present |= 1u << tag;
+  }
+  return (int)frame_length;
+}
+
+bool send_control(int sock, const struct sockaddr_in* addr, const control_frame* frame)
+{
+  if (frame->invalid) return false;
+  return sendto(sock, frame->data, frame->length, 0, (const struct sockaddr*)addr, sizeof(*addr)) == (ssize_t)frame->length;
+}
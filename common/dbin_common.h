@@ -0,0 +1,255 @@
+//------------------------------------------------------------------------------------//
+	              		//DBIN COMMON DEFINITIONS//
+//------------------------------------------------------------------------------------//
+// What the CR, NU and SU share: the control protocol codec, SHA-256, CRC32C, the LZ codec, rate
+// scheduling, metrics, striping and the IP set. Each program's Makefile builds dbin_common.c in.
+
+#ifndef DBIN_COMMON_H
+#define DBIN_COMMON_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+// Shared Definitions
+#define MAX_IP_LENGTH 16
+#define MAX_CMD_LENGTH 512
+#define MAX_FILENAME_LENGTH 256
+#define MAX_STREAMS 8
+#define DEFAULT_STREAM_COUNT 4
+#define STRIPE_MIN_BYTES (4LL * 1024 * 1024)
+#define HASH_BUFFER_SIZE 65536
+#define SHA256_HEX_LENGTH 64
+#define CRC32C_POLYNOMIAL 0x82F63B78u
+#define COMPRESS_CHUNK_SIZE 65536
+#define COMPRESS_FRAME_HEADER 8
+#define COMPRESS_SAMPLE_CHUNKS 4
+#define COMPRESS_MIN_FILE_SIZE 4096
+#define COMPRESS_MIN_SAVING_PERCENT 10
+#define COMPRESS_GIVE_UP_CHUNKS 8
+#define COMPRESS_REPROBE_INTERVAL 64
+#define COMPRESSION_CODEC "lz"
+#define LZ_HASH_BITS 14
+#define LZ_MIN_MATCH 4
+#define CONTROL_MAGIC "DB"
+#define CONTROL_VERSION 1
+#define CONTROL_HEADER_SIZE 6
+#define CONTROL_FIELD_HEADER 3
+#define CONTROL_MAX_SIZE 1024
+#define CONTROL_MAX_NODES ((CONTROL_MAX_SIZE - CONTROL_HEADER_SIZE) / (CONTROL_FIELD_HEADER + 4))
+#define IP_SET_INITIAL_CAPACITY 16
+#define RATE_SLICES_PER_SECOND 20
+#define RATE_MIN_QUANTUM 4096
+#define RATE_MAX_QUANTUM (256 * 1024)
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+#define METRIC_MAX_HISTOGRAMS 8
+
+// Shared Types
+// Transfers under way, each drawing on its share of the rate limits (see Scheduling); the limits
+// are in bytes per second, 0 when unset. The clients' stream threads hold 'mutex' while they use
+// the scheduler; the CR's reactor thread is its only user and does not need to.
+typedef enum { PRIORITY_INTERACTIVE, PRIORITY_BULK, PRIORITY_BACKGROUND } transfer_priority;
+typedef struct transfer_flow
+{
+  transfer_priority priority;
+  struct in_addr peer;
+  double rate;
+  double tokens;
+  long long refilled_ms;
+  bool settled;
+  struct transfer_flow* next;
+} transfer_flow;
+typedef struct { pthread_mutex_t mutex; long long global_rate; long long peer_rate; transfer_flow* flows; } transfer_scheduler;
+
+// Counters and histograms behind the metrics endpoint (see Metrics), updated from any thread with
+// relaxed atomics. Latencies are kept in microseconds and throughputs in KiB/s. Each program
+// defines G_METRICS, naming its histograms and listing every one it reports in 'histograms'.
+typedef struct
+{
+  const char* name;
+  const char* help;
+  const char* label;
+  double scale;
+  double display_scale;
+  const char* display_unit;
+  _Atomic uint64_t count;
+  _Atomic uint64_t sum;
+  _Atomic uint64_t max;
+  _Atomic uint64_t buckets[HISTOGRAM_BUCKETS];
+} metric_histogram;
+typedef struct
+{
+  _Atomic uint64_t bytes_sent;
+  _Atomic uint64_t bytes_received;
+  _Atomic uint64_t transfers_completed;
+  _Atomic uint64_t transfers_failed;
+  _Atomic int64_t active_transfers;
+  metric_histogram handshake;
+  metric_histogram first_byte;
+  metric_histogram throughput;
+  metric_histogram* histograms[METRIC_MAX_HISTOGRAMS];
+} node_metrics;
+
+// An open-addressing hash set of IPv4 addresses (see IP Sets)
+typedef struct { uint32_t* slots; size_t capacity; size_t count; } ip_set;
+
+typedef struct { uint32_t state[8]; uint64_t length; uint8_t buffer[64]; size_t buffered; } sha256_ctx;
+
+// Control messages are binary frames: the magic "DB", a version byte, a type byte and the body
+// length (big-endian uint16), then the body as tagged fields, each a tag byte, a big-endian uint16
+// length and the value. Integers are big-endian and addresses are 4-byte IPv4; a decoder skips
+// tags it does not know, so fields can be added without breaking older peers.
+typedef enum
+{
+  CONTROL_REQUEST_UPLOAD = 1,
+  CONTROL_REQUEST_BATCH,
+  CONTROL_READY_TO_RECEIVE,
+  CONTROL_BUSY,
+  CONTROL_STORED,
+  CONTROL_FBACK,
+  CONTROL_READY_TO_SEND,
+  CONTROL_LIST,
+  CONTROL_READY_TO_LIST,
+  CONTROL_CLEARDB,
+  CONTROL_TEXT,
+  CONTROL_TERMINATE,
+  CONTROL_PING,
+  CONTROL_PONG,
+  CONTROL_ACK,
+  CONTROL_IP_TABLE,
+  CONTROL_NODE_ADD,
+  CONTROL_NODE_REMOVE,
+  CONTROL_TABLE_PULL,
+  CONTROL_REQUEST_RELAY
+} control_type;
+typedef enum
+{
+  FIELD_MESSAGE_ID = 1,
+  FIELD_TRANSFER_ID,
+  FIELD_NAME,
+  FIELD_SIZE,
+  FIELD_MTIME,
+  FIELD_SENDER_IP,
+  FIELD_STREAMS,
+  FIELD_HASH,
+  FIELD_CODEC,
+  FIELD_PORT,
+  FIELD_COUNT,
+  FIELD_CHECKSUM,
+  FIELD_TEXT,
+  FIELD_NODE,
+  FIELD_CR_ADDR,
+  FIELD_SU_ADDR,
+  FIELD_VERSION,
+  FIELD_CHUNK
+} control_field;
+typedef struct { uint8_t data[CONTROL_MAX_SIZE]; size_t length; bool invalid; } control_frame;
+
+// A decoded frame. Values are copied out, strings NUL-terminated, so nothing points into the
+// buffer it came from; 'present' has a bit set for each field the frame carried.
+typedef struct
+{
+  control_type type;
+  uint32_t present;
+  uint64_t message_id;
+  uint64_t transfer_id;
+  char name[MAX_FILENAME_LENGTH];
+  long long size;
+  long long mtime;
+  char sender_ip[MAX_IP_LENGTH];
+  int streams;
+  char hash[SHA256_HEX_LENGTH + 1];
+  char codec[16];
+  int port;
+  int count;
+  uint32_t checksum;
+  char text[MAX_CMD_LENGTH];
+  struct in_addr cr_addr;
+  struct in_addr su_addr;
+  uint64_t version;
+  int chunk;
+  struct in_addr nodes[CONTROL_MAX_NODES];
+  int node_count;
+} control_message;
+#define CONTROL_HAS(message, field) (((message)->present & (1u << (field))) != 0)
+
+// Shared Global Variables
+extern volatile bool G_EXIT_REQUEST;
+extern int G_MAX_STREAMS;
+extern transfer_scheduler G_SCHEDULER;
+extern node_metrics G_METRICS;
+
+// Function Prototypes
+void trim_whitespace(char *str);
+int env_int(const char* name, int fallback, int min, int max);
+uint64_t generate_transfer_id(void);
+long long monotonic_ms(void);
+long long monotonic_us(void);
+void sha256_init(sha256_ctx* ctx);
+void sha256_block(sha256_ctx* ctx, const uint8_t* block);
+void sha256_update(sha256_ctx* ctx, const void* data, size_t length);
+void sha256_final_hex(sha256_ctx* ctx, char* hex);
+bool sha256_file(const char* path, char* hex);
+void crc32c_init(void);
+uint32_t crc32c_software(uint32_t crc, const uint8_t* data, size_t length);
+uint32_t crc32c_hardware(uint32_t crc, const uint8_t* data, size_t length);
+uint32_t crc32c_update(uint32_t crc, const void* data, size_t length);
+uint32_t gf2_matrix_times(const uint32_t* matrix, uint32_t vector);
+void gf2_matrix_square(uint32_t* square, const uint32_t* matrix);
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, long long length2);
+bool crc32c_file_range(int fd, off_t offset, off_t length, uint32_t* crc);
+void lz_emit_length(uint8_t* dst, size_t* out, size_t length);
+bool lz_emit_sequence(uint8_t* dst, size_t capacity, size_t* out, const uint8_t* literals, size_t literal_length, size_t match_length, size_t match_offset);
+size_t lz_compress(const uint8_t* src, size_t length, uint8_t* dst, size_t capacity);
+bool lz_decompress(const uint8_t* src, size_t length, uint8_t* dst, size_t raw_length);
+size_t encode_chunk(const uint8_t* raw, size_t raw_length, uint8_t* frame, int* incompressible_run);
+bool sample_compressible(int fd, long long filesize);
+size_t rate_quantum(double rate);
+void rebalance_flows(void);
+void metric_add(_Atomic uint64_t* counter, uint64_t amount);
+size_t histogram_index(uint64_t value);
+uint64_t histogram_bucket_floor(size_t index);
+void histogram_record(metric_histogram* histogram, uint64_t value);
+uint64_t histogram_percentile(metric_histogram* histogram, double quantile);
+long long metrics_transfer_started(void);
+void metrics_transfer_finished(long long started_us, long long bytes, bool ok);
+void write_metrics(FILE* out);
+void* metrics_thread_func(void* arg);
+void start_metrics_endpoint(int port);
+int streams_for_size(long long filesize);
+int grant_stream_count(int offered);
+void stripe_range(long long filesize, int stream_count, int stream_index, off_t* offset, off_t* length);
+size_t ip_set_home(const ip_set* set, uint32_t addr);
+bool ip_set_contains(const ip_set* set, struct in_addr addr);
+bool ip_set_grow(ip_set* set);
+bool ip_set_add(ip_set* set, struct in_addr addr);
+bool ip_set_remove(ip_set* set, struct in_addr addr);
+void ip_set_clear(ip_set* set);
+void control_begin(control_frame* frame, control_type type);
+void control_put(control_frame* frame, control_field tag, const void* value, size_t length);
+void control_put_u64(control_frame* frame, control_field tag, uint64_t value);
+void control_put_u32(control_frame* frame, control_field tag, uint32_t value);
+void control_put_string(control_frame* frame, control_field tag, const char* value);
+void control_put_addr(control_frame* frame, control_field tag, struct in_addr addr);
+void control_put_ip(control_frame* frame, control_field tag, const char* ip);
+void control_put_hash(control_frame* frame, control_field tag, const char* hex);
+int hex_digit_value(char c);
+bool is_plain_filename(const char* name);
+bool control_get_u64(const uint8_t* value, size_t length, uint64_t* out);
+bool control_get_i64(const uint8_t* value, size_t length, long long* out);
+bool control_get_u32(const uint8_t* value, size_t length, uint32_t* out);
+bool control_get_int(const uint8_t* value, size_t length, int* out);
+bool control_get_string(const uint8_t* value, size_t length, char* out, size_t capacity);
+bool control_get_addr(const uint8_t* value, size_t length, struct in_addr* out);
+bool control_get_ip(const uint8_t* value, size_t length, char* out);
+bool control_get_hash(const uint8_t* value, size_t length, char* hex);
+int control_decode(const uint8_t* data, size_t length, control_message* message);
+bool send_control(int sock, const struct sockaddr_in* addr, const control_frame* frame);
+
+#endif